@@ -2,6 +2,23 @@
 #include <vector>
 #include <unordered_map>
 #include <iostream>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <ctime>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <deque>
+#include <new>
+#include <memory>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -40,6 +57,10 @@ public:
         return this->id;
     }
 
+    int getPaymentDue() {
+        return this->paymentDue;
+    }
+
     void charge(int amount) {
         this->paymentDue += amount;
     }
@@ -60,135 +81,2434 @@ public:
     SemiTruck() : Vehicle(3) {}
 };
 
+// Refers to a pooled object; the generation makes handles to released slots stale
+class PoolHandle {
+public:
+    uint32_t index;
+    uint32_t generation;
+};
+
+// Typed object pool: storage comes in fixed chunks that are never returned,
+// released slots go on a free list, and reclaimAll() drops every live object at once.
+// Chunks and bookkeeping all come from Allocator.
+template <typename T, typename Allocator = allocator<T>>
+class ObjectPool {
+private:
+    static const uint32_t CHUNK_SIZE = 1024;
+
+    template <typename U>
+    using Rebound = typename allocator_traits<Allocator>::template rebind_alloc<U>;
+
+    Allocator allocator;
+    vector<T*, Rebound<T*>> chunks;
+    vector<uint32_t, Rebound<uint32_t>> generations;
+    vector<bool, Rebound<bool>> live;
+    vector<uint32_t, Rebound<uint32_t>> freeSlots;
+
+    T* slot(uint32_t index) {
+        return this->chunks[index / CHUNK_SIZE] + index % CHUNK_SIZE;
+    }
+
+    void grow() {
+        this->chunks.push_back(this->allocator.allocate(CHUNK_SIZE));
+        uint32_t first = this->generations.size();
+        this->generations.resize(first + CHUNK_SIZE, 0);
+        this->live.resize(first + CHUNK_SIZE, false);
+        this->freeSlots.reserve(this->generations.size());
+        for (uint32_t i = first + CHUNK_SIZE; i > first; i--) {
+            this->freeSlots.push_back(i - 1);
+        }
+    }
+
+public:
+    ObjectPool(Allocator allocator = Allocator())
+        : allocator(allocator), chunks(allocator), generations(allocator), live(allocator), freeSlots(allocator) {}
+
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    ~ObjectPool() {
+        this->reclaimAll();
+        for (T* chunk : this->chunks) {
+            this->allocator.deallocate(chunk, CHUNK_SIZE);
+        }
+    }
+
+    template <typename... Args>
+    PoolHandle acquire(Args... args) {
+        if (this->freeSlots.empty()) {
+            this->grow();
+        }
+        uint32_t index = this->freeSlots.back();
+        this->freeSlots.pop_back();
+        new (this->slot(index)) T(args...);
+        this->live[index] = true;
+        return PoolHandle{index, this->generations[index]};
+    }
+
+    // nullptr once the handle's object has been released
+    T* get(PoolHandle handle) {
+        if (handle.index >= this->generations.size() || this->generations[handle.index] != handle.generation
+            || !this->live[handle.index]) {
+            return nullptr;
+        }
+        return this->slot(handle.index);
+    }
+
+    bool release(PoolHandle handle) {
+        T* object = this->get(handle);
+        if (object == nullptr) {
+            return false;
+        }
+        object->~T();
+        this->live[handle.index] = false;
+        this->generations[handle.index]++;
+        this->freeSlots.push_back(handle.index);
+        return true;
+    }
+
+    // Release every live object; capacity is kept for reuse
+    void reclaimAll() {
+        this->freeSlots.clear();
+        for (uint32_t i = this->generations.size(); i > 0; i--) {
+            uint32_t index = i - 1;
+            if (this->live[index]) {
+                this->slot(index)->~T();
+                this->live[index] = false;
+                this->generations[index]++;
+            }
+            this->freeSlots.push_back(index);
+        }
+    }
+
+    int getLiveCount() {
+        return this->generations.size() - this->freeSlots.size();
+    }
+};
+
+class DriverHandle {
+public:
+    PoolHandle driver;
+    PoolHandle vehicle;
+    int spotSize;
+};
+
+// Arena for drivers and their vehicles, so an arrival costs no heap allocation
+// once the pools have warmed up
+template <typename Allocator = allocator<char>>
+class ParkingPools {
+private:
+    template <typename T>
+    using Pool = ObjectPool<T, typename allocator_traits<Allocator>::template rebind_alloc<T>>;
+
+    Pool<Driver> drivers;
+    Pool<Car> cars;
+    Pool<Limo> limos;
+    Pool<SemiTruck> semiTrucks;
+
+public:
+    ParkingPools(Allocator allocator = Allocator())
+        : drivers(allocator), cars(allocator), limos(allocator), semiTrucks(allocator) {}
+
+    // spotSize picks the vehicle type: 1 Car, 2 Limo, 3 SemiTruck
+    DriverHandle acquireDriver(int id, int spotSize) {
+        DriverHandle handle;
+        Vehicle* vehicle;
+        if (spotSize == 1) {
+            handle.vehicle = this->cars.acquire();
+            vehicle = this->cars.get(handle.vehicle);
+        } else if (spotSize == 2) {
+            handle.vehicle = this->limos.acquire();
+            vehicle = this->limos.get(handle.vehicle);
+        } else if (spotSize == 3) {
+            handle.vehicle = this->semiTrucks.acquire();
+            vehicle = this->semiTrucks.get(handle.vehicle);
+        } else {
+            throw "Unknown vehicle size";
+        }
+        handle.spotSize = spotSize;
+        handle.driver = this->drivers.acquire(id, vehicle);
+        return handle;
+    }
+
+    Driver* getDriver(DriverHandle handle) {
+        return this->drivers.get(handle.driver);
+    }
+
+    bool releaseDriver(DriverHandle handle) {
+        if (!this->drivers.release(handle.driver)) {
+            return false;
+        }
+        if (handle.spotSize == 1) {
+            this->cars.release(handle.vehicle);
+        } else if (handle.spotSize == 2) {
+            this->limos.release(handle.vehicle);
+        } else {
+            this->semiTrucks.release(handle.vehicle);
+        }
+        return true;
+    }
+
+    void reclaimAll() {
+        this->drivers.reclaimAll();
+        this->cars.reclaimAll();
+        this->limos.reclaimAll();
+        this->semiTrucks.reclaimAll();
+    }
+
+    int getLiveDriverCount() {
+        return this->drivers.getLiveCount();
+    }
+};
+
+// Free list of equally sized blocks shared by every copy of a
+// RecyclingAllocator, so a map that keeps inserting and erasing reuses its
+// nodes instead of going back to the heap once it has reached its peak size
+class NodeRecycler {
+public:
+    size_t blockSize = 0;
+    size_t blockCount = 0;
+    vector<void*> freeBlocks;       // kept large enough for every block, so a release never allocates
+    long long heapAllocations = 0;
+
+    ~NodeRecycler() {
+        for (void* block : this->freeBlocks) {
+            ::operator delete(block);
+        }
+    }
+};
+
+// Recycles single objects of the first size it is asked for (a container's
+// nodes); anything else, like a hash map's bucket array, comes from the heap
+template <typename T>
+class RecyclingAllocator {
+public:
+    typedef T value_type;
+    typedef true_type propagate_on_container_copy_assignment;
+    typedef true_type propagate_on_container_move_assignment;
+    typedef true_type propagate_on_container_swap;
+
+    shared_ptr<NodeRecycler> recycler;
+
+    RecyclingAllocator() : recycler(make_shared<NodeRecycler>()) {}
+
+    // copied rather than moved, so a moved-from container can still free its memory
+    RecyclingAllocator(const RecyclingAllocator& other) : recycler(other.recycler) {}
+
+    template <typename U>
+    RecyclingAllocator(const RecyclingAllocator<U>& other) : recycler(other.recycler) {}
+
+    T* allocate(size_t n) {
+        NodeRecycler* recycler = this->recycler.get();
+        if (n == 1 && recycler->blockSize == 0) {
+            recycler->blockSize = sizeof(T);
+        }
+        if (n != 1 || recycler->blockSize != sizeof(T)) {
+            recycler->heapAllocations++;
+            return allocator<T>().allocate(n);
+        }
+        if (recycler->freeBlocks.empty()) {
+            recycler->heapAllocations++;
+            if (++recycler->blockCount > recycler->freeBlocks.capacity()) {
+                recycler->heapAllocations++;
+                recycler->freeBlocks.reserve(2 * recycler->blockCount);
+            }
+            return static_cast<T*>(::operator new(sizeof(T)));
+        }
+        void* block = recycler->freeBlocks.back();
+        recycler->freeBlocks.pop_back();
+        return static_cast<T*>(block);
+    }
+
+    void deallocate(T* memory, size_t n) {
+        if (n != 1 || this->recycler->blockSize != sizeof(T)) {
+            allocator<T>().deallocate(memory, n);
+            return;
+        }
+        this->recycler->freeBlocks.push_back(memory);
+    }
+
+    long long getHeapAllocations() {
+        return this->recycler->heapAllocations;
+    }
+
+    template <typename U>
+    bool operator==(const RecyclingAllocator<U>& other) const {
+        return this->recycler == other.recycler;
+    }
+
+    template <typename U>
+    bool operator!=(const RecyclingAllocator<U>& other) const {
+        return this->recycler != other.recycler;
+    }
+};
+
+template <typename Key, typename Value>
+using RecyclingMap = unordered_map<Key, Value, hash<Key>, equal_to<Key>, RecyclingAllocator<pair<const Key, Value>>>;
+
+class Relocation {
+public:
+    Vehicle* vehicle;
+    int from;
+    int to;
+};
+
+// Copy of a floor's spots and parked spans for planning off the placement
+// thread. The vehicles are only handles for the plan: they may be removed and
+// recycled meanwhile, so planners read span sizes from sizes, never from them.
+class FloorSnapshot {
+public:
+    int floor;
+    long long version;
+    vector<unsigned char> spots;
+    vector<Vehicle*> vehicles;
+    vector<int> starts;
+    vector<int> sizes;
+};
+
+// Moves that free spots [windowStart, windowStart + length) on a floor,
+// valid only while the floor is still at version
+class CompactionPlan {
+public:
+    int floor;
+    long long version;
+    int windowStart;
+    int length;
+    vector<Relocation> relocations;
+};
+
 class ParkingFloor {
 private:
-    vector<int> spots;
-    unordered_map<Vehicle*, vector<int>> vehicleMap;
+    unsigned char* spots;               // one occupancy byte per spot
+    int* spanEnds;                      // spanEnds[start] = end + 1 for every parked vehicle, 0 elsewhere
+    int spotCount;
+    vector<unsigned char> ownedSpots;   // backing storage when the floor is not memory-mapped
+    vector<int> ownedSpanEnds;
+    RecyclingMap<Vehicle*, pair<int, int>> vehicleMap;     // vehicle -> first and last spot
+    int occupiedSpots;                  // -1 until counted, for a floor attached to existing storage
+    long long version;                  // bumped on every spot change
+
+    // Free-run index: a segment tree over the spots, padded to leaves (a
+    // power of two) with taken spots. Node i covers a power-of-two range and
+    // keeps the free run at its start, the one at its end and its longest, so
+    // held and occupied spots are skipped a whole subtree at a time.
+    int leaves;
+    vector<int> prefixFree;
+    vector<int> suffixFree;
+    vector<int> longestFree;
+
+    void pullUp(int node, int length) {
+        int left = 2 * node, right = left + 1, half = length / 2;
+        this->prefixFree[node] = this->prefixFree[left] == half ? half + this->prefixFree[right]
+                                                                : this->prefixFree[left];
+        this->suffixFree[node] = this->suffixFree[right] == half ? half + this->suffixFree[left]
+                                                                 : this->suffixFree[right];
+        this->longestFree[node] = max(max(this->longestFree[left], this->longestFree[right]),
+                                      this->suffixFree[left] + this->prefixFree[right]);
+    }
+
+    // Refresh the leaves of spots [start, end] and every node above them
+    void updateIndex(int start, int end) {
+        for (int k = start; k <= end; k++) {
+            int free = k < this->spotCount && this->spots[k] == FREE;
+            int leaf = this->leaves + k;
+            this->prefixFree[leaf] = this->suffixFree[leaf] = this->longestFree[leaf] = free;
+        }
+        int lo = (this->leaves + start) / 2, hi = (this->leaves + end) / 2;
+        for (int length = 2; lo >= 1; length *= 2, lo /= 2, hi /= 2) {
+            for (int node = lo; node <= hi; node++) {
+                this->pullUp(node, length);
+            }
+        }
+    }
+
+    void buildIndex() {
+        this->leaves = 1;
+        while (this->leaves < this->spotCount) {
+            this->leaves *= 2;
+        }
+        this->prefixFree = vector<int>(2 * this->leaves);
+        this->suffixFree = vector<int>(2 * this->leaves);
+        this->longestFree = vector<int>(2 * this->leaves);
+        this->updateIndex(0, this->leaves - 1);
+    }
+
+    // First free run of size spots; held and occupied spots both end a run.
+    // Walks down the index in O(log spots).
+    int findFreeRun(int size) {
+        if (size <= 0 || this->longestFree[1] < size) {
+            return -1;
+        }
+        int node = 1, start = 0;
+        for (int length = this->leaves; length > 1; length /= 2) {
+            int left = 2 * node, half = length / 2;
+            if (this->longestFree[left] >= size) {
+                node = left;
+            } else if (this->suffixFree[left] + this->prefixFree[left + 1] >= size) {
+                return start + half - this->suffixFree[left];
+            } else {
+                node = left + 1;
+                start += half;
+            }
+        }
+        return start;
+    }
+
+    void fillSpots(int start, int end, unsigned char state) {
+        int occupied = 0;
+        for (int k = start; k <= end; k++) {
+            occupied += (state == OCCUPIED) - (this->spots[k] == OCCUPIED);
+            this->spots[k] = state;
+        }
+        if (this->occupiedSpots >= 0) {
+            this->occupiedSpots += occupied;
+        }
+        this->updateIndex(start, end);
+        this->version++;
+    }
 
 public:
+    static const unsigned char FREE = 0;
+    static const unsigned char OCCUPIED = 1;
+    static const unsigned char HELD = 2;
+
     ParkingFloor(int spotCount) {
-        this->spots = vector<int>(spotCount);
-        this->vehicleMap = unordered_map<Vehicle*, vector<int>>();
+        this->ownedSpots = vector<unsigned char>(spotCount);
+        this->ownedSpanEnds = vector<int>(spotCount);
+        this->spots = this->ownedSpots.data();
+        this->spanEnds = this->ownedSpanEnds.data();
+        this->spotCount = spotCount;
+        this->vehicleMap = RecyclingMap<Vehicle*, pair<int, int>>();
+        this->occupiedSpots = 0;
+        this->version = 0;
+        this->buildIndex();
+    }
+
+    // Attach to spot storage owned by someone else, e.g. a GarageStore mapping
+    ParkingFloor(unsigned char* spots, int* spanEnds, int spotCount) {
+        this->spots = spots;
+        this->spanEnds = spanEnds;
+        this->spotCount = spotCount;
+        this->vehicleMap = RecyclingMap<Vehicle*, pair<int, int>>();
+        this->occupiedSpots = -1;
+        this->version = 0;
+        this->buildIndex();
     }
 
     bool parkVehicle(Vehicle* vehicle) {
         int size = vehicle->getSpotSize();
-        int l = 0, r = 0;
-        while (r < this->spots.size()) {
-            if (this->spots[r] != 0) {
-                l = r + 1;
-            }
-            if (r - l + 1 == size) {
-                // we found enough spots, park the vehicle
-                for (int k = l; k <= r; k++) {
-                    this->spots[k] = 1;
-                }
-                this->vehicleMap[vehicle] = vector<int>{l, r};
-                return true;
+        int l = this->findFreeRun(size);
+        if (l == -1) {
+            return false;
+        }
+        // we found enough spots, park the vehicle
+        int r = l + size - 1;
+        this->fillSpots(l, r, OCCUPIED);
+        this->spanEnds[l] = r + 1;
+        this->vehicleMap[vehicle] = {l, r};
+        return true;
+    }
+
+    // Hold size free spots for a reservation; returns the first spot or -1
+    int holdSpots(int size) {
+        int l = this->findFreeRun(size);
+        if (l != -1) {
+            this->fillSpots(l, l + size - 1, HELD);
+        }
+        return l;
+    }
+
+    void releaseSpots(int start, int end) {
+        this->fillSpots(start, end, FREE);
+    }
+
+    // Turn a held span into a parked vehicle
+    bool parkHeldVehicle(Vehicle* vehicle, int start, int end) {
+        if (end - start + 1 != vehicle->getSpotSize()) {
+            return false;
+        }
+        this->fillSpots(start, end, OCCUPIED);
+        this->spanEnds[start] = end + 1;
+        this->vehicleMap[vehicle] = {start, end};
+        return true;
+    }
+
+    // Holds are not persisted with their deadlines, so a floor attached to a
+    // GarageStore after a restart should drop the ones it finds
+    void releaseOrphanedHolds() {
+        for (int i = 0; i < this->spotCount; i++) {
+            if (this->spots[i] == HELD) {
+                this->spots[i] = FREE;
             }
-            r++;
         }
-        return false;
+        this->buildIndex();
+        this->version++;
     }
 
-    void removeVehicle(Vehicle* vehicle) {
-        vector<int> startEnd = this->vehicleMap[vehicle];
-        int start = startEnd[0], end = startEnd[1];
-        for (int i = start; i <= end; i++) {
-            this->spots[i] = 0;
+    // Longest run of free spots, i.e. the largest vehicle this floor can take
+    int getLongestFreeRun() {
+        return this->longestFree[1];
+    }
+
+    // Spots taken by parked vehicles, bound or not; held spots do not count
+    int getOccupiedSpots() {
+        if (this->occupiedSpots < 0) {
+            this->occupiedSpots = 0;
+            for (int i = 0; i < this->spotCount; i++) {
+                this->occupiedSpots += this->spots[i] == OCCUPIED;
+            }
         }
+        return this->occupiedSpots;
+    }
+
+    void removeVehicle(Vehicle* vehicle) {
+        pair<int, int> startEnd = this->vehicleMap[vehicle];
+        int start = startEnd.first, end = startEnd.second;
+        this->fillSpots(start, end, FREE);
+        this->spanEnds[start] = 0;
         this->vehicleMap.erase(vehicle);
     }
 
+    // Spans that were occupied when the floor was attached but have no Vehicle bound yet
+    vector<vector<int>> getUnboundSpans() {
+        vector<vector<int>> spans;
+        unordered_map<int, bool> bound;
+        for (auto& entry : this->vehicleMap) {
+            bound[entry.second.first] = true;
+        }
+        for (int i = 0; i < this->spotCount; i++) {
+            if (this->spanEnds[i] != 0 && !bound.count(i)) {
+                spans.push_back(vector<int>{i, this->spanEnds[i] - 1});
+            }
+        }
+        return spans;
+    }
+
+    // Bind a vehicle to a span restored from persistent storage
+    bool reattachVehicle(Vehicle* vehicle, int start) {
+        if (start < 0 || start >= this->spotCount || this->spanEnds[start] - start != vehicle->getSpotSize()) {
+            return false;
+        }
+        this->vehicleMap[vehicle] = {start, this->spanEnds[start] - 1};
+        return true;
+    }
+
     vector<int> getParkingSpots() {
-        return this->spots;
+        return vector<int>(this->spots, this->spots + this->spotCount);
     }
 
-    vector<int> getVehicleSpots(Vehicle* vehicle) {
-        return this->vehicleMap[vehicle];
+    bool hasVehicle(Vehicle* vehicle) {
+        return this->vehicleMap.count(vehicle) != 0;
     }
-};
 
-class ParkingGarage {
-private:
-    vector<ParkingFloor*> parkingFloors;
+    // Heap allocations the vehicle map has made; flat once it has held its peak
+    long long getHeapAllocations() {
+        return this->vehicleMap.get_allocator().getHeapAllocations();
+    }
 
-public:
-    ParkingGarage(int floorCount, int spotsPerFloor) {
-        this->parkingFloors = vector<ParkingFloor*>(floorCount);
-        for (int i = 0; i < floorCount; i++) {
-            this->parkingFloors[i] = new ParkingFloor(spotsPerFloor);
+    vector<int> getVehicleSpots(Vehicle* vehicle) {
+        auto entry = this->vehicleMap.find(vehicle);
+        if (entry == this->vehicleMap.end()) {
+            return vector<int>();
         }
+        return vector<int>{entry->second.first, entry->second.second};
     }
 
-    bool parkVehicle(Vehicle* vehicle) {
-        for (ParkingFloor* floor : this->parkingFloors) {
-            if (floor->parkVehicle(vehicle)) {
-                return true;
+    FloorSnapshot getSnapshot(int floor) {
+        FloorSnapshot snapshot;
+        snapshot.floor = floor;
+        snapshot.version = this->version;
+        snapshot.spots = vector<unsigned char>(this->spots, this->spots + this->spotCount);
+        for (auto& entry : this->vehicleMap) {
+            snapshot.vehicles.push_back(entry.first);
+            snapshot.starts.push_back(entry.second.first);
+            snapshot.sizes.push_back(entry.second.second - entry.second.first + 1);
+        }
+        return snapshot;
+    }
+
+    // Move a parked vehicle so its span starts at newStart; fails if those spots are taken
+    bool relocateVehicle(Vehicle* vehicle, int newStart) {
+        auto entry = this->vehicleMap.find(vehicle);
+        if (entry == this->vehicleMap.end()) {
+            return false;
+        }
+        int start = entry->second.first, end = entry->second.second;
+        int newEnd = newStart + (end - start);
+        if (newStart < 0 || newEnd >= this->spotCount) {
+            return false;
+        }
+        this->fillSpots(start, end, FREE);
+        for (int k = newStart; k <= newEnd; k++) {
+            if (this->spots[k] != FREE) {
+                this->fillSpots(start, end, OCCUPIED);
+                return false;
             }
         }
-        return false;
+        this->spanEnds[start] = 0;
+        this->fillSpots(newStart, newEnd, OCCUPIED);
+        this->spanEnds[newStart] = newEnd + 1;
+        entry->second = {newStart, newEnd};
+        return true;
     }
 
-    bool removeVehicle(Vehicle* vehicle) {
-        for (ParkingFloor* floor : this->parkingFloors) {
-            if (floor->getVehicleSpots(vehicle).size() != 0) {
-                floor->removeVehicle(vehicle);
-                return true;
+    // Apply a plan made from this floor's snapshot; a plan made before any
+    // later change to the floor is rejected untouched. If a relocation fails,
+    // the ones before it are undone and the plan is rejected.
+    bool applyPlan(CompactionPlan& plan) {
+        if (plan.version != this->version) {
+            return false;
+        }
+        for (size_t i = 0; i < plan.relocations.size(); i++) {
+            if (!this->relocateVehicle(plan.relocations[i].vehicle, plan.relocations[i].to)) {
+                while (i-- > 0) {
+                    this->relocateVehicle(plan.relocations[i].vehicle, plan.relocations[i].from);
+                }
+                return false;
             }
         }
-        return false;
+        return true;
     }
 };
 
-class ParkingSystem {
+// Fixed-layout garage image that is memory-mapped shared, so floor mutations
+// reach the file through the page cache and a restart only has to map it.
+//   header | occupancy bytes (floor-major) | span ends (int32, floor-major)
+class GarageStore {
 private:
-    ParkingGarage* parkingGarage;
-    int hourlyRate;
-    unordered_map<int, int> timeParked;    // map driverId to time that they parked
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        int32_t floorCount;
+        int32_t spotsPerFloor;
+        unsigned char padding[48];
+    };
+
+    static const uint32_t MAGIC = 0x4750524b;    // "KRPG"
+    static const uint32_t VERSION = 1;
+
+    int fd;
+    size_t mappedSize;
+    unsigned char* base;
+    Header* header;
+
+    static size_t spanOffset(long long spotCount) {
+        return (sizeof(Header) + spotCount + 7) / 8 * 8;
+    }
 
 public:
-    ParkingSystem(ParkingGarage* parkingGarage, int hourlyRate) {
-        this->parkingGarage = parkingGarage;
-        this->hourlyRate = hourlyRate;
-        this->timeParked = unordered_map<int, int>();
+    // Open the image at path, creating a zeroed one when it does not exist yet
+    GarageStore(string path, int floorCount, int spotsPerFloor) {
+        this->fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (this->fd < 0) {
+            throw "Could not open garage store";
+        }
+        struct stat info;
+        if (fstat(this->fd, &info) != 0) {
+            close(this->fd);
+            throw "Could not read garage store";
+        }
+        long long spotCount = (long long) floorCount * spotsPerFloor;
+        this->mappedSize = spanOffset(spotCount) + spotCount * sizeof(int32_t);
+        bool isNew = info.st_size == 0;
+        if (isNew && ftruncate(this->fd, this->mappedSize) != 0) {
+            close(this->fd);
+            throw "Could not size garage store";
+        }
+        if (!isNew && (size_t) info.st_size != this->mappedSize) {
+            close(this->fd);
+            throw "Garage store does not match the requested layout";
+        }
+
+        void* mapping = mmap(nullptr, this->mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, this->fd, 0);
+        if (mapping == MAP_FAILED) {
+            close(this->fd);
+            throw "Could not map garage store";
+        }
+        this->base = (unsigned char*) mapping;
+        this->header = (Header*) mapping;
+        if (isNew) {
+            this->header->magic = MAGIC;
+            this->header->version = VERSION;
+            this->header->floorCount = floorCount;
+            this->header->spotsPerFloor = spotsPerFloor;
+        } else if (this->header->magic != MAGIC || this->header->version != VERSION
+                   || this->header->floorCount != floorCount || this->header->spotsPerFloor != spotsPerFloor) {
+            munmap(this->base, this->mappedSize);
+            close(this->fd);
+            throw "Garage store does not match the requested layout";
+        }
     }
 
-    bool parkVehicle(Driver* driver) {
-        int currentHour = time(0);
-        bool isParked = this->parkingGarage->parkVehicle(driver->getVehicle());
-        if (isParked) {
-            this->timeParked[driver->getId()] = currentHour;
+    ~GarageStore() {
+        munmap(this->base, this->mappedSize);
+        close(this->fd);
+    }
+
+    int getFloorCount() {
+        return this->header->floorCount;
+    }
+
+    int getSpotsPerFloor() {
+        return this->header->spotsPerFloor;
+    }
+
+    unsigned char* getFloorSpots(int floor) {
+        return this->base + sizeof(Header) + (size_t) floor * this->header->spotsPerFloor;
+    }
+
+    int* getFloorSpanEnds(int floor) {
+        long long spotCount = (long long) this->header->floorCount * this->header->spotsPerFloor;
+        return (int*) (this->base + spanOffset(spotCount)) + (size_t) floor * this->header->spotsPerFloor;
+    }
+
+    // Force dirty pages to disk; without it the kernel writes them back on its own schedule
+    void sync() {
+        msync(this->base, this->mappedSize, MS_SYNC);
+    }
+};
+
+// Notified by ParkingGarage on the placement thread; implementations must not
+// block. occupiedSpots is the floor's total after the change, so an observer
+// that misses events or attaches late still sees the true occupancy.
+class ParkingObserver {
+public:
+    virtual ~ParkingObserver() {}
+    virtual void onVehicleParked(int floor, int spotSize, int occupiedSpots) = 0;
+    virtual void onVehicleRemoved(int floor, int spotSize, int occupiedSpots) = 0;
+    virtual void onVehicleRejected(int spotSize) = 0;
+    // Current occupancy of every floor, sent when the observer is added
+    virtual void onFloorOccupancy(int floor, int occupiedSpots) = 0;
+};
+
+class OccupancyEvent {
+public:
+    static const unsigned char PARKED = 0;
+    static const unsigned char REMOVED = 1;
+    static const unsigned char REJECTED = 2;
+    static const unsigned char SYNCED = 3;
+
+    long long time;
+    unsigned char type;
+    unsigned char spotSize;
+    int occupiedSpots;              // the floor's total after the event
+};
+
+// Single-producer single-consumer ring; the producer drops events instead of
+// waiting when the consumer falls behind
+class EventRing {
+private:
+    vector<OccupancyEvent> events;
+    size_t mask;
+    alignas(64) atomic<size_t> head;    // next slot the consumer reads
+    alignas(64) atomic<size_t> tail;    // next slot the producer writes
+    alignas(64) atomic<long long> dropped;
+
+public:
+    EventRing(size_t capacity) : head(0), tail(0), dropped(0) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
         }
-        return isParked;
+        this->events = vector<OccupancyEvent>(size);
+        this->mask = size - 1;
     }
 
-    bool removeVehicle(Driver* driver) {
-        if (this->timeParked.find(driver->getId()) == this->timeParked.end()) {
+    void push(OccupancyEvent event) {
+        size_t tail = this->tail.load(memory_order_relaxed);
+        if (tail - this->head.load(memory_order_acquire) > this->mask) {
+            this->dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        this->events[tail & this->mask] = event;
+        this->tail.store(tail + 1, memory_order_release);
+    }
+
+    bool pop(OccupancyEvent& event) {
+        size_t head = this->head.load(memory_order_relaxed);
+        if (head == this->tail.load(memory_order_acquire)) {
             return false;
         }
-        int currentHour = time(0);
-        int timeParked = ceil(currentHour - this->timeParked[driver->getId()]);
-        driver->charge(timeParked * this->hourlyRate);
+        event = this->events[head & this->mask];
+        this->head.store(head + 1, memory_order_release);
+        return true;
+    }
 
-        this->timeParked.erase(driver->getId());
-        return this->parkingGarage->removeVehicle(driver->getVehicle());
+    long long getDropped() {
+        return this->dropped.load(memory_order_relaxed);
     }
 };
 
-int main() {
-    ParkingGarage* parkingGarage = new ParkingGarage(3, 2);
-    ParkingSystem* parkingSystem = new ParkingSystem(parkingGarage, 5);
+class MinuteRollup {
+public:
+    long long minute;               // minutes since the epoch
+    int occupiedSpots;              // at the end of the minute
+    int peakOccupiedSpots;
+    int arrivals;
+    int departures;
+    int rejectedBySize[4];          // indexed by spot size
 
-    Driver* driver1 = new Driver(1, new Car());
-    Driver* driver2 = new Driver(2, new Limo());
-    Driver* driver3 = new Driver(3, new SemiTruck());
+    MinuteRollup(long long minute, int occupiedSpots) {
+        this->minute = minute;
+        this->occupiedSpots = occupiedSpots;
+        this->peakOccupiedSpots = occupiedSpots;
+        this->arrivals = 0;
+        this->departures = 0;
+        for (int i = 0; i < 4; i++) {
+            this->rejectedBySize[i] = 0;
+        }
+    }
+};
 
-    cout << parkingSystem->parkVehicle(driver1) << endl;    // true
-    cout << parkingSystem->parkVehicle(driver2) << endl;    // true
-    cout << parkingSystem->parkVehicle(driver3) << endl;    // false
+// Observer that turns garage events into per-minute rollups. The placement
+// thread only appends to a per-floor ring; a background aggregator drains the
+// rings and dashboards read finished rollups under a lock the hot path never takes.
+class OccupancyAnalytics : public ParkingObserver {
+private:
+    class RollupSeries {
+    public:
+        vector<MinuteRollup> closed;
+        MinuteRollup open = MinuteRollup(-1, 0);
 
-    cout << parkingSystem->removeVehicle(driver1) << endl;  // true
-    cout << parkingSystem->removeVehicle(driver2) << endl;  // true
-    cout << parkingSystem->removeVehicle(driver3) << endl;  // false
+        // change is how much the event moved the series' total. Each event
+        // counts in its own minute; one that reaches the aggregator after its
+        // minute closed goes back into that rollup, and its change carries
+        // into every minute after it.
+        void apply(OccupancyEvent& event, int change) {
+            long long minute = event.time / 60;
+            this->advanceTo(minute);
+            size_t first = this->closed.size();
+            if (minute < this->open.minute) {
+                first = this->findClosed(minute);
+            }
+            MinuteRollup& rollup = first < this->closed.size() ? this->closed[first] : this->open;
+            if (event.type == OccupancyEvent::PARKED) {
+                rollup.arrivals++;
+            } else if (event.type == OccupancyEvent::REMOVED) {
+                rollup.departures++;
+            } else if (event.type == OccupancyEvent::REJECTED) {
+                rollup.rejectedBySize[min((int) event.spotSize, 3)]++;
+                return;
+            }
+            for (size_t i = first; i < this->closed.size(); i++) {
+                this->closed[i].occupiedSpots += change;
+                this->closed[i].peakOccupiedSpots = max(this->closed[i].peakOccupiedSpots, this->closed[i].occupiedSpots);
+            }
+            this->open.occupiedSpots += change;
+            this->open.peakOccupiedSpots = max(this->open.peakOccupiedSpots, this->open.occupiedSpots);
+        }
+
+        // Index of the closed rollup for minute, inserting one if the series
+        // had no events in that minute
+        size_t findClosed(long long minute) {
+            size_t i = this->closed.size();
+            while (i > 0 && this->closed[i - 1].minute > minute) {
+                i--;
+            }
+            if (i > 0 && this->closed[i - 1].minute == minute) {
+                return i - 1;
+            }
+            int occupiedSpots = i > 0 ? this->closed[i - 1].occupiedSpots : 0;
+            this->closed.insert(this->closed.begin() + i, MinuteRollup(minute, occupiedSpots));
+            return i;
+        }
+
+        // Close the open minute once time has moved past it
+        void advanceTo(long long minute) {
+            if (this->open.minute == -1) {
+                this->open.minute = minute;
+            } else if (minute > this->open.minute) {
+                this->closed.push_back(this->open);
+                this->open = MinuteRollup(minute, this->open.occupiedSpots);
+            }
+        }
+    };
+
+    vector<EventRing*> floorRings;
+    EventRing* rejectRing;
+    vector<pair<OccupancyEvent, int>> pending;     // one pass's events and their floors, merged by time
+    vector<RollupSeries> floorSeries;
+    RollupSeries garageSeries;
+    vector<int> floorOccupied;      // latest total reported by each floor
+    mutex rollupLock;
+    thread aggregator;
+    atomic<bool> running;
+
+    void drain(EventRing* ring, int floor) {
+        OccupancyEvent event;
+        while (ring->pop(event)) {
+            this->pending.push_back(make_pair(event, floor));
+        }
+    }
+
+    // Floor events also feed the garage-wide series; rejections (floor -1)
+    // only feed that one
+    void apply(OccupancyEvent& event, int floor) {
+        int change = 0;
+        if (floor >= 0) {
+            change = event.occupiedSpots - this->floorOccupied[floor];
+            this->floorOccupied[floor] = event.occupiedSpots;
+            this->floorSeries[floor].apply(event, change);
+        }
+        this->garageSeries.apply(event, change);
+    }
+
+public:
+    OccupancyAnalytics(int floorCount, int ringCapacity) : running(false) {
+        for (int i = 0; i < floorCount; i++) {
+            this->floorRings.push_back(new EventRing(ringCapacity));
+        }
+        this->rejectRing = new EventRing(ringCapacity);
+        this->floorSeries = vector<RollupSeries>(floorCount);
+        this->floorOccupied = vector<int>(floorCount, 0);
+    }
+
+    ~OccupancyAnalytics() {
+        this->stop();
+        for (EventRing* ring : this->floorRings) {
+            delete ring;
+        }
+        delete this->rejectRing;
+    }
+
+    void onVehicleParked(int floor, int spotSize, int occupiedSpots) {
+        this->floorRings[floor]->push(
+            OccupancyEvent{time(0), OccupancyEvent::PARKED, (unsigned char) spotSize, occupiedSpots});
+    }
+
+    void onVehicleRemoved(int floor, int spotSize, int occupiedSpots) {
+        this->floorRings[floor]->push(
+            OccupancyEvent{time(0), OccupancyEvent::REMOVED, (unsigned char) spotSize, occupiedSpots});
+    }
+
+    void onVehicleRejected(int spotSize) {
+        this->rejectRing->push(OccupancyEvent{time(0), OccupancyEvent::REJECTED, (unsigned char) spotSize, 0});
+    }
+
+    void onFloorOccupancy(int floor, int occupiedSpots) {
+        this->floorRings[floor]->push(OccupancyEvent{time(0), OccupancyEvent::SYNCED, 0, occupiedSpots});
+    }
+
+    // Drain every ring once, apply the events in time order and close
+    // minutes that ended before now. Each ring is already in order, so a
+    // stable sort keeps a floor's events in the order they happened.
+    void aggregate(long long now) {
+        lock_guard<mutex> guard(this->rollupLock);
+        for (size_t i = 0; i < this->floorRings.size(); i++) {
+            this->drain(this->floorRings[i], i);
+        }
+        this->drain(this->rejectRing, -1);
+        stable_sort(this->pending.begin(), this->pending.end(),
+                    [](const pair<OccupancyEvent, int>& a, const pair<OccupancyEvent, int>& b) {
+                        return a.first.time < b.first.time;
+                    });
+        for (auto& entry : this->pending) {
+            this->apply(entry.first, entry.second);
+        }
+        this->pending.clear();
+        for (size_t i = 0; i < this->floorSeries.size(); i++) {
+            this->floorSeries[i].advanceTo(now / 60);
+        }
+        this->garageSeries.advanceTo(now / 60);
+    }
+
+    void start(int intervalMillis) {
+        this->running = true;
+        this->aggregator = thread([this, intervalMillis]() {
+            while (this->running) {
+                this->aggregate(time(0));
+                this_thread::sleep_for(chrono::milliseconds(intervalMillis));
+            }
+        });
+    }
+
+    void stop() {
+        if (this->aggregator.joinable()) {
+            this->running = false;
+            this->aggregator.join();
+        }
+    }
+
+    vector<MinuteRollup> getFloorRollups(int floor) {
+        lock_guard<mutex> guard(this->rollupLock);
+        return this->floorSeries[floor].closed;
+    }
+
+    vector<MinuteRollup> getGarageRollups() {
+        lock_guard<mutex> guard(this->rollupLock);
+        return this->garageSeries.closed;
+    }
+
+    long long getDroppedEvents() {
+        long long dropped = this->rejectRing->getDropped();
+        for (EventRing* ring : this->floorRings) {
+            dropped += ring->getDropped();
+        }
+        return dropped;
+    }
+};
+
+class TimerEntry {
+public:
+    int id;
+    long long deadline;
+
+    TimerEntry(int id, long long deadline) {
+        this->id = id;
+        this->deadline = deadline;
+    }
+};
+
+// Hierarchical timing wheel with one-second ticks. Level l holds timers whose
+// deadline first differs from the current tick in base-64 digit l, so every
+// timer is touched once per level on its way down and advancing never scans
+// timers that are not due.
+class TimingWheel {
+private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+
+    vector<TimerEntry> slots[LEVELS][SLOTS];
+    vector<TimerEntry> overflow;    // deadlines beyond the top level
+    vector<TimerEntry> due;         // scheduled at or before the current tick
+    long long currentTick;
+    int size;
+
+    void place(TimerEntry entry) {
+        if (entry.deadline <= this->currentTick) {
+            this->due.push_back(entry);
+            return;
+        }
+        unsigned long long diff = (unsigned long long) (entry.deadline ^ this->currentTick);
+        int level = 0;
+        while (level < LEVELS && (diff >> (SLOT_BITS * (level + 1))) != 0) {
+            level++;
+        }
+        if (level == LEVELS) {
+            this->overflow.push_back(entry);
+            return;
+        }
+        this->slots[level][(entry.deadline >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(entry);
+    }
+
+    void cascade(vector<TimerEntry>& bucket) {
+        vector<TimerEntry> entries;
+        entries.swap(bucket);
+        for (TimerEntry& entry : entries) {
+            this->place(entry);
+        }
+    }
+
+public:
+    TimingWheel() {
+        this->currentTick = 0;
+        this->size = 0;
+    }
+
+    void schedule(int id, long long deadline) {
+        this->place(TimerEntry(id, deadline));
+        this->size++;
+    }
+
+    int getSize() {
+        return this->size;
+    }
+
+    // Move time forward to now and append the ids of every timer that fired
+    void advance(long long now, vector<int>& expired) {
+        if (this->size == 0) {
+            this->currentTick = max(this->currentTick, now);
+            return;
+        }
+        while (true) {
+            for (TimerEntry& entry : this->due) {
+                expired.push_back(entry.id);
+            }
+            this->size -= this->due.size();
+            this->due.clear();
+            if (this->currentTick >= now || this->size == 0) {
+                break;
+            }
+            this->currentTick++;
+            if ((this->currentTick & ((1LL << (SLOT_BITS * LEVELS)) - 1)) == 0) {
+                this->cascade(this->overflow);
+            }
+            for (int level = LEVELS - 1; level > 0; level--) {
+                if ((this->currentTick & ((1LL << (SLOT_BITS * level)) - 1)) == 0) {
+                    this->cascade(this->slots[level][(this->currentTick >> (SLOT_BITS * level)) & (SLOTS - 1)]);
+                }
+            }
+            this->cascade(this->slots[0][this->currentTick & (SLOTS - 1)]);
+        }
+        this->currentTick = max(this->currentTick, now);
+    }
+};
+
+class Reservation {
+public:
+    int floor;
+    int start;
+    int end;
+
+    Reservation(int floor, int start, int end) {
+        this->floor = floor;
+        this->start = start;
+        this->end = end;
+    }
+};
+
+class ParkingGarage {
+private:
+    vector<ParkingFloor*> parkingFloors;
+    unordered_map<int, Reservation> reservations;
+    TimingWheel reservationExpiry;
+    int nextReservationId = 0;
+    vector<ParkingObserver*> observers;
+
+public:
+    ParkingGarage(int floorCount, int spotsPerFloor) {
+        this->parkingFloors = vector<ParkingFloor*>(floorCount);
+        for (int i = 0; i < floorCount; i++) {
+            this->parkingFloors[i] = new ParkingFloor(spotsPerFloor);
+        }
+    }
+
+    // Floors are views over the store, so no spot is touched until it is used
+    ParkingGarage(GarageStore* store) {
+        int floorCount = store->getFloorCount();
+        this->parkingFloors = vector<ParkingFloor*>(floorCount);
+        for (int i = 0; i < floorCount; i++) {
+            this->parkingFloors[i] = new ParkingFloor(store->getFloorSpots(i), store->getFloorSpanEnds(i), store->getSpotsPerFloor());
+        }
+    }
+
+    ParkingFloor* getFloor(int floor) {
+        return this->parkingFloors[floor];
+    }
+
+    int getFloorCount() {
+        return this->parkingFloors.size();
+    }
+
+    void addObserver(ParkingObserver* observer) {
+        this->observers.push_back(observer);
+        for (int i = 0; i < this->getFloorCount(); i++) {
+            observer->onFloorOccupancy(i, this->parkingFloors[i]->getOccupiedSpots());
+        }
+    }
+
+    long long getHeapAllocations() {
+        long long allocations = 0;
+        for (ParkingFloor* floor : this->parkingFloors) {
+            allocations += floor->getHeapAllocations();
+        }
+        return allocations;
+    }
+
+    // Largest vehicle the garage can currently take
+    int getLongestFreeRun() {
+        int longest = 0;
+        for (ParkingFloor* floor : this->parkingFloors) {
+            longest = max(longest, floor->getLongestFreeRun());
+        }
+        return longest;
+    }
+
+    bool parkVehicle(Vehicle* vehicle) {
+        for (int i = 0; i < this->getFloorCount(); i++) {
+            if (this->parkingFloors[i]->parkVehicle(vehicle)) {
+                for (ParkingObserver* observer : this->observers) {
+                    observer->onVehicleParked(i, vehicle->getSpotSize(), this->parkingFloors[i]->getOccupiedSpots());
+                }
+                return true;
+            }
+        }
+        for (ParkingObserver* observer : this->observers) {
+            observer->onVehicleRejected(vehicle->getSpotSize());
+        }
+        return false;
+    }
+
+    bool removeVehicle(Vehicle* vehicle) {
+        for (int i = 0; i < this->getFloorCount(); i++) {
+            if (this->parkingFloors[i]->hasVehicle(vehicle)) {
+                this->parkingFloors[i]->removeVehicle(vehicle);
+                for (ParkingObserver* observer : this->observers) {
+                    observer->onVehicleRemoved(i, vehicle->getSpotSize(), this->parkingFloors[i]->getOccupiedSpots());
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Hold size spots until deadline; returns a reservation id or -1 when full
+    int reserveSpots(int size, long long currentTime, long long deadline) {
+        this->expireReservations(currentTime);
+        for (int i = 0; i < this->getFloorCount(); i++) {
+            int start = this->parkingFloors[i]->holdSpots(size);
+            if (start != -1) {
+                int reservationId = this->nextReservationId++;
+                this->reservations.insert({reservationId, Reservation(i, start, start + size - 1)});
+                this->reservationExpiry.schedule(reservationId, deadline);
+                return reservationId;
+            }
+        }
+        return -1;
+    }
+
+    // Park a vehicle in its reserved spots; fails once the hold has expired
+    bool claimReservation(int reservationId, Vehicle* vehicle, long long currentTime) {
+        this->expireReservations(currentTime);
+        auto entry = this->reservations.find(reservationId);
+        if (entry == this->reservations.end()) {
+            return false;
+        }
+        Reservation reservation = entry->second;
+        if (!this->parkingFloors[reservation.floor]->parkHeldVehicle(vehicle, reservation.start, reservation.end)) {
+            return false;
+        }
+        for (ParkingObserver* observer : this->observers) {
+            observer->onVehicleParked(reservation.floor, vehicle->getSpotSize(),
+                                      this->parkingFloors[reservation.floor]->getOccupiedSpots());
+        }
+        // the wheel entry stays behind and is ignored when it fires
+        this->reservations.erase(entry);
+        return true;
+    }
+
+    bool cancelReservation(int reservationId) {
+        auto entry = this->reservations.find(reservationId);
+        if (entry == this->reservations.end()) {
+            return false;
+        }
+        this->parkingFloors[entry->second.floor]->releaseSpots(entry->second.start, entry->second.end);
+        this->reservations.erase(entry);
+        return true;
+    }
+
+    // Release every hold whose deadline has passed; returns how many expired
+    int expireReservations(long long currentTime) {
+        vector<int> expired;
+        this->reservationExpiry.advance(currentTime, expired);
+        int released = 0;
+        for (int reservationId : expired) {
+            if (this->cancelReservation(reservationId)) {
+                released++;
+            }
+        }
+        return released;
+    }
+};
+
+// Searches floor snapshots for the window of spots that can be cleared for a
+// vehicle of the requested length with the fewest relocations. Work is done in
+// ticks of a bounded number of windows, so a background thread never hogs a core.
+class CompactionPlanner {
+private:
+    class Job {
+    public:
+        FloorSnapshot snapshot;
+        int length;
+        int nextWindow = 0;
+        vector<int> owner;              // spot -> index into the snapshot's spans, or -1
+        vector<int> pinnedPrefix;       // spots in [0, i) that cannot be cleared
+        vector<pair<int, int>> freeRuns;
+        int freeSpots = 0;
+        CompactionPlan best;
+        int bestCost = -1;
+    };
+
+    int reserveSpots;
+    deque<Job*> jobs;
+    vector<CompactionPlan> ready;
+    mutex lock;
+    thread worker;
+    atomic<bool> running;
+
+    static Job* prepare(FloorSnapshot snapshot, int length) {
+        Job* job = new Job();
+        int spotCount = snapshot.spots.size();
+        job->length = length;
+        job->owner = vector<int>(spotCount, -1);
+        for (size_t i = 0; i < snapshot.sizes.size(); i++) {
+            for (int k = 0; k < snapshot.sizes[i]; k++) {
+                job->owner[snapshot.starts[i] + k] = i;
+            }
+        }
+        // Held spots and occupied spans with no Vehicle bound yet (after an
+        // attach) have nothing the plan could move
+        job->pinnedPrefix = vector<int>(spotCount + 1, 0);
+        for (int i = 0; i < spotCount; i++) {
+            bool pinned = snapshot.spots[i] == ParkingFloor::HELD ||
+                          (snapshot.spots[i] == ParkingFloor::OCCUPIED && job->owner[i] == -1);
+            job->pinnedPrefix[i + 1] = job->pinnedPrefix[i] + pinned;
+            if (snapshot.spots[i] == ParkingFloor::FREE) {
+                job->freeSpots++;
+                if (i > 0 && snapshot.spots[i - 1] == ParkingFloor::FREE) {
+                    job->freeRuns.back().second++;
+                } else {
+                    job->freeRuns.push_back({i, 1});
+                }
+            }
+        }
+        job->snapshot = snapshot;
+        return job;
+    }
+
+    // Relocations clearing window w, or false when the displaced vehicles do
+    // not fit in the free runs outside it. Packing is greedy (largest vehicle
+    // first, each into the tightest run that takes it), so a window it gives
+    // up on may still have a packing, and the chosen plan is only the fewest
+    // moves among windows the greedy can pack.
+    static bool planWindow(Job* job, int w, vector<Relocation>& relocations) {
+        int end = w + job->length;
+        vector<int> displaced;
+        for (int k = w; k < end; k++) {
+            int owner = job->owner[k];
+            if (owner != -1 && (displaced.empty() || displaced.back() != owner)) {
+                displaced.push_back(owner);
+            }
+        }
+        // free runs with the window carved out
+        vector<pair<int, int>> runs;
+        for (pair<int, int> run : job->freeRuns) {
+            int runEnd = run.first + run.second;
+            if (runEnd <= w || run.first >= end) {
+                runs.push_back(run);
+                continue;
+            }
+            if (run.first < w) {
+                runs.push_back({run.first, w - run.first});
+            }
+            if (runEnd > end) {
+                runs.push_back({end, runEnd - end});
+            }
+        }
+        vector<int>& sizes = job->snapshot.sizes;
+        stable_sort(displaced.begin(), displaced.end(), [&sizes](int a, int b) {
+            return sizes[a] > sizes[b];
+        });
+        for (int index : displaced) {
+            int size = sizes[index];
+            int bestRun = -1;
+            for (int r = 0; r < (int) runs.size(); r++) {
+                if (runs[r].second >= size && (bestRun == -1 || runs[r].second < runs[bestRun].second)) {
+                    bestRun = r;
+                }
+            }
+            if (bestRun == -1) {
+                return false;
+            }
+            relocations.push_back(Relocation{job->snapshot.vehicles[index], job->snapshot.starts[index], runs[bestRun].first});
+            runs[bestRun].first += size;
+            runs[bestRun].second -= size;
+        }
+        return true;
+    }
+
+    // Evaluate up to budget windows of the job; true once the job is finished
+    static bool advance(Job* job, int budget) {
+        int lastWindow = (int) job->snapshot.spots.size() - job->length;
+        for (; budget > 0 && job->nextWindow <= lastWindow; budget--, job->nextWindow++) {
+            int w = job->nextWindow;
+            if (job->pinnedPrefix[w + job->length] - job->pinnedPrefix[w] != 0) {
+                continue;
+            }
+            int cost = 0;
+            for (int k = w; k < w + job->length; k++) {
+                if (job->owner[k] != -1 && (k == w || job->owner[k] != job->owner[k - 1])) {
+                    cost++;
+                }
+            }
+            if (job->bestCost != -1 && cost >= job->bestCost) {
+                continue;
+            }
+            vector<Relocation> relocations;
+            if (planWindow(job, w, relocations)) {
+                job->bestCost = cost;
+                job->best.windowStart = w;
+                job->best.relocations = relocations;
+                if (cost == 0) {
+                    break;
+                }
+            }
+        }
+        return job->bestCost == 0 || job->nextWindow > lastWindow;
+    }
+
+public:
+    // A floor is only compacted while it keeps reserveSpots free spots
+    // besides the cleared window, so large vehicles cannot use compaction to
+    // take the last spots cars would otherwise have parked in
+    CompactionPlanner(int reserveSpots = 0) : running(false) {
+        this->reserveSpots = reserveSpots;
+    }
+
+    ~CompactionPlanner() {
+        this->stop();
+        for (Job* job : this->jobs) {
+            delete job;
+        }
+    }
+
+    // Queue a search for a window of length free spots on the snapshot's floor
+    void requestPlan(FloorSnapshot snapshot, int length) {
+        Job* job = prepare(snapshot, length);
+        if (job->freeSpots - length < this->reserveSpots) {
+            delete job;
+            return;
+        }
+        lock_guard<mutex> guard(this->lock);
+        this->jobs.push_back(job);
+    }
+
+    // Spend at most budget window evaluations on the oldest job
+    void tick(int budget) {
+        Job* job;
+        {
+            lock_guard<mutex> guard(this->lock);
+            if (this->jobs.empty()) {
+                return;
+            }
+            job = this->jobs.front();
+        }
+        if (!advance(job, budget)) {
+            return;
+        }
+        lock_guard<mutex> guard(this->lock);
+        this->jobs.pop_front();
+        if (job->bestCost != -1) {
+            job->best.floor = job->snapshot.floor;
+            job->best.version = job->snapshot.version;
+            job->best.length = job->length;
+            this->ready.push_back(job->best);
+        }
+        delete job;
+    }
+
+    void start(int budgetPerTick, int tickMillis) {
+        this->running = true;
+        this->worker = thread([this, budgetPerTick, tickMillis]() {
+            while (this->running) {
+                this->tick(budgetPerTick);
+                this_thread::sleep_for(chrono::milliseconds(tickMillis));
+            }
+        });
+    }
+
+    void stop() {
+        if (this->worker.joinable()) {
+            this->running = false;
+            this->worker.join();
+        }
+    }
+
+    bool isIdle() {
+        lock_guard<mutex> guard(this->lock);
+        return this->jobs.empty();
+    }
+
+    // Finished plans, to be applied on the placement thread
+    vector<CompactionPlan> takePlans() {
+        lock_guard<mutex> guard(this->lock);
+        vector<CompactionPlan> plans;
+        plans.swap(this->ready);
+        return plans;
+    }
+};
+
+// Rates for every hour of the week (Monday 00:00 UTC first) plus an optional daily cap.
+class Tariff {
+private:
+    vector<int> hourlyRates;
+    int dailyCap;
+
+public:
+    static const int HOURS_PER_DAY = 24;
+    static const int HOURS_PER_WEEK = 7 * 24;
+
+    Tariff(int hourlyRate) {
+        this->hourlyRates = vector<int>(HOURS_PER_WEEK, hourlyRate);
+        this->dailyCap = 0;
+    }
+
+    Tariff(vector<int> hourlyRates, int dailyCap) {
+        if (hourlyRates.size() != HOURS_PER_WEEK) {
+            throw "Tariff needs one rate per hour of the week";
+        }
+        this->hourlyRates = hourlyRates;
+        this->dailyCap = dailyCap;
+    }
+
+    // Apply a rate to [startHour, endHour) on every day of the week
+    void setBand(int startHour, int endHour, int rate) {
+        for (int day = 0; day < 7; day++) {
+            for (int hour = startHour; hour < endHour; hour++) {
+                this->hourlyRates[day * HOURS_PER_DAY + hour] = rate;
+            }
+        }
+    }
+
+    void setDailyCap(int dailyCap) {
+        this->dailyCap = dailyCap;
+    }
+
+    int getRate(int hourOfWeek) {
+        return this->hourlyRates[hourOfWeek];
+    }
+
+    int getDailyCap() {
+        return this->dailyCap;
+    }
+};
+
+// Precompiles a Tariff into prefix sums over hourly buckets so that the
+// charge for any stay is O(1): every hour started since the stay began is
+// billed at the band rate of the clock hour it starts in, and each calendar
+// day (UTC) is capped at the tariff's daily cap.
+class BillingEngine {
+private:
+    vector<long long> hourPrefix;     // hourPrefix[h] = cost of hours [0, h) of the week
+    vector<long long> dayPrefix;      // dayPrefix[d] = capped cost of full days [0, d) of the week
+    long long dailyCap;
+
+    static const long long SECONDS_PER_HOUR = 3600;
+    static const long long EPOCH_HOUR_OFFSET = 3 * 24;    // 1970-01-01 was a Thursday
+
+    static long long floorDiv(long long a, long long b) {
+        return a / b - (a % b != 0 && (a < 0) != (b < 0));
+    }
+
+    // Uncapped cost of hours [0, h) counted from the Monday before the epoch
+    long long hoursCost(long long h) {
+        long long week = floorDiv(h, Tariff::HOURS_PER_WEEK);
+        return week * this->hourPrefix[Tariff::HOURS_PER_WEEK] + this->hourPrefix[h - week * Tariff::HOURS_PER_WEEK];
+    }
+
+    // Capped cost of full days [0, d) counted from the Monday before the epoch
+    long long daysCost(long long d) {
+        long long week = floorDiv(d, 7);
+        return week * this->dayPrefix[7] + this->dayPrefix[d - week * 7];
+    }
+
+    long long capped(long long cost) {
+        return this->dailyCap > 0 && cost > this->dailyCap ? this->dailyCap : cost;
+    }
+
+public:
+    BillingEngine(Tariff tariff) {
+        this->dailyCap = tariff.getDailyCap();
+        this->hourPrefix = vector<long long>(Tariff::HOURS_PER_WEEK + 1, 0);
+        for (int h = 0; h < Tariff::HOURS_PER_WEEK; h++) {
+            this->hourPrefix[h + 1] = this->hourPrefix[h] + tariff.getRate(h);
+        }
+        this->dayPrefix = vector<long long>(8, 0);
+        for (int d = 0; d < 7; d++) {
+            long long dayCost = this->hourPrefix[(d + 1) * Tariff::HOURS_PER_DAY] - this->hourPrefix[d * Tariff::HOURS_PER_DAY];
+            this->dayPrefix[d + 1] = this->dayPrefix[d] + this->capped(dayCost);
+        }
+    }
+
+    long long charge(long long startTime, long long endTime) {
+        if (endTime <= startTime) {
+            return 0;
+        }
+        // Billed hour k starts at startTime + k hours, in clock hour a + k
+        long long a = floorDiv(startTime, SECONDS_PER_HOUR) + EPOCH_HOUR_OFFSET;
+        long long b = a + (endTime - startTime + SECONDS_PER_HOUR - 1) / SECONDS_PER_HOUR;
+        if (this->dailyCap <= 0) {
+            return this->hoursCost(b) - this->hoursCost(a);
+        }
+        long long firstDay = floorDiv(a, Tariff::HOURS_PER_DAY);
+        long long lastDay = floorDiv(b - 1, Tariff::HOURS_PER_DAY);
+        if (firstDay == lastDay) {
+            return this->capped(this->hoursCost(b) - this->hoursCost(a));
+        }
+        long long head = this->capped(this->hoursCost((firstDay + 1) * Tariff::HOURS_PER_DAY) - this->hoursCost(a));
+        long long tail = this->capped(this->hoursCost(b) - this->hoursCost(lastDay * Tariff::HOURS_PER_DAY));
+        return head + (this->daysCost(lastDay) - this->daysCost(firstDay + 1)) + tail;
+    }
+
+    // Charge every stay [startTimes[i], endTime) into charges[i], split across threads
+    void settle(const long long* startTimes, long long endTime, long long* charges, int count, int threadCount) {
+        if (threadCount <= 1 || count < threadCount) {
+            for (int i = 0; i < count; i++) {
+                charges[i] = this->charge(startTimes[i], endTime);
+            }
+            return;
+        }
+        vector<thread> workers;
+        int sliceSize = (count + threadCount - 1) / threadCount;
+        for (int t = 0; t < threadCount; t++) {
+            int begin = t * sliceSize;
+            int end = min(count, begin + sliceSize);
+            workers.push_back(thread([this, startTimes, endTime, charges, begin, end]() {
+                for (int i = begin; i < end; i++) {
+                    charges[i] = this->charge(startTimes[i], endTime);
+                }
+            }));
+        }
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+};
+
+class ParkingSession {
+public:
+    Driver* driver;
+    long long startTime;
+    long long billed;       // charged at settlements so far
+
+    ParkingSession(Driver* driver, long long startTime) {
+        this->driver = driver;
+        this->startTime = startTime;
+        this->billed = 0;
+    }
+};
+
+class ParkingSystem {
+private:
+    ParkingGarage* parkingGarage;
+    BillingEngine billingEngine;
+    RecyclingMap<int, ParkingSession> openSessions;     // map driverId to their current stay
+
+public:
+    ParkingSystem(ParkingGarage* parkingGarage, int hourlyRate) : billingEngine(Tariff(hourlyRate)) {
+        this->parkingGarage = parkingGarage;
+        this->openSessions = RecyclingMap<int, ParkingSession>();
+    }
+
+    ParkingSystem(ParkingGarage* parkingGarage, BillingEngine billingEngine) : billingEngine(billingEngine) {
+        this->parkingGarage = parkingGarage;
+        this->openSessions = RecyclingMap<int, ParkingSession>();
+    }
+
+    bool parkVehicle(Driver* driver) {
+        return this->parkVehicle(driver, time(0));
+    }
+
+    // Heap allocations made for open stays and parked vehicles so far
+    long long getHeapAllocations() {
+        return this->openSessions.get_allocator().getHeapAllocations() + this->parkingGarage->getHeapAllocations();
+    }
+
+    bool parkVehicle(Driver* driver, long long currentTime) {
+        bool isParked = this->parkingGarage->parkVehicle(driver->getVehicle());
+        if (isParked) {
+            this->openSessions.insert_or_assign(driver->getId(), ParkingSession(driver, currentTime));
+        }
+        return isParked;
+    }
+
+    int reserveSpot(Driver* driver, long long currentTime, long long deadline) {
+        return this->parkingGarage->reserveSpots(driver->getVehicle()->getSpotSize(), currentTime, deadline);
+    }
+
+    bool parkReservedVehicle(Driver* driver, int reservationId, long long currentTime) {
+        bool isParked = this->parkingGarage->claimReservation(reservationId, driver->getVehicle(), currentTime);
+        if (isParked) {
+            this->openSessions.insert_or_assign(driver->getId(), ParkingSession(driver, currentTime));
+        }
+        return isParked;
+    }
+
+    bool removeVehicle(Driver* driver) {
+        return this->removeVehicle(driver, time(0));
+    }
+
+    bool removeVehicle(Driver* driver, long long currentTime) {
+        auto session = this->openSessions.find(driver->getId());
+        if (session == this->openSessions.end()) {
+            return false;
+        }
+        driver->charge(this->billingEngine.charge(session->second.startTime, currentTime) - session->second.billed);
+
+        this->openSessions.erase(session);
+        return this->parkingGarage->removeVehicle(driver->getVehicle());
+    }
+
+    // End-of-day settlement: bill every open stay for what it owes up to
+    // currentTime beyond its earlier settlements. Stays keep their start
+    // time, so a started hour or a capped day is never billed twice. Returns
+    // the total amount billed.
+    long long settleOpenSessions(long long currentTime, int threadCount) {
+        int count = this->openSessions.size();
+        vector<ParkingSession*> sessions;
+        vector<long long> startTimes;
+        sessions.reserve(count);
+        startTimes.reserve(count);
+        for (auto& entry : this->openSessions) {
+            sessions.push_back(&entry.second);
+            startTimes.push_back(entry.second.startTime);
+        }
+        vector<long long> charges(count);
+        this->billingEngine.settle(startTimes.data(), currentTime, charges.data(), count, threadCount);
+
+        long long total = 0;
+        for (int i = 0; i < count; i++) {
+            long long owed = charges[i] - sessions[i]->billed;
+            sessions[i]->driver->charge(owed);
+            sessions[i]->billed = charges[i];
+            total += owed;
+        }
+        return total;
+    }
+};
+
+class ParkingRequest {
+public:
+    static const int PARK = 0;
+    static const int REMOVE = 1;
+
+    int type;
+    Driver* driver;
+    long long time;
+    int homeGarage;
+    int hops;           // overflow candidates of the home garage already considered
+
+    ParkingRequest(int type, Driver* driver, long long time, int homeGarage) {
+        this->type = type;
+        this->driver = driver;
+        this->time = time;
+        this->homeGarage = homeGarage;
+        this->hops = 0;
+    }
+};
+
+// Blocking multi-producer queue used to hand requests between shards
+class RequestQueue {
+private:
+    vector<ParkingRequest> pending;
+    mutex lock;
+    condition_variable ready;
+    bool closed = false;
+
+public:
+    void push(ParkingRequest request) {
+        {
+            lock_guard<mutex> guard(this->lock);
+            this->pending.push_back(request);
+        }
+        this->ready.notify_one();
+    }
+
+    // Wait for requests and take all of them at once; false once closed and empty
+    bool popAll(vector<ParkingRequest>& requests) {
+        unique_lock<mutex> guard(this->lock);
+        this->ready.wait(guard, [this]() { return this->closed || !this->pending.empty(); });
+        if (this->pending.empty()) {
+            return false;
+        }
+        requests.swap(this->pending);
+        return true;
+    }
+
+    void close() {
+        {
+            lock_guard<mutex> guard(this->lock);
+            this->closed = true;
+        }
+        this->ready.notify_all();
+    }
+};
+
+class ParkingListener {
+public:
+    virtual ~ParkingListener() {}
+    // garage is where the driver ended up, or -1 when every garage was full
+    virtual void onParked(Driver* driver, int garage) = 0;
+    // Only called when the driver was actually parked at garage
+    virtual void onRemoved(Driver* driver, int garage) = 0;
+};
+
+// Coordinates many garages. Each garage is a shard whose ParkingSystem is only
+// touched by that shard's worker thread; shards talk through RequestQueues and
+// publish their longest free run so overflow can be routed without asking.
+class ParkingNetwork {
+private:
+    class Shard {
+    public:
+        ParkingSystem* parkingSystem;
+        ParkingGarage* garage;
+        RequestQueue queue;
+        thread worker;
+        alignas(64) atomic<int> longestFreeRun;
+        vector<int> nearestGarages;     // other garages, closest first
+    };
+
+    vector<Shard*> shards;
+    ParkingListener* listener;
+    atomic<long long> outstanding;
+    mutex idleLock;
+    condition_variable idle;
+
+    void finish() {
+        if (this->outstanding.fetch_sub(1) == 1) {
+            lock_guard<mutex> guard(this->idleLock);
+            this->idle.notify_all();
+        }
+    }
+
+    // Nearest garage with room for size spots that this request has not tried yet
+    int findOverflowGarage(int from, int size, int hops) {
+        vector<int>& nearest = this->shards[from]->nearestGarages;
+        for (int i = hops; i < (int) nearest.size(); i++) {
+            if (this->shards[nearest[i]]->longestFreeRun.load(memory_order_relaxed) >= size) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void run(int index) {
+        Shard* shard = this->shards[index];
+        vector<ParkingRequest> requests;
+        while (shard->queue.popAll(requests)) {
+            for (ParkingRequest& request : requests) {
+                this->handle(index, request);
+            }
+            requests.clear();
+            shard->longestFreeRun.store(shard->garage->getLongestFreeRun(), memory_order_relaxed);
+        }
+    }
+
+    void handle(int index, ParkingRequest& request) {
+        Shard* shard = this->shards[index];
+        if (request.type == ParkingRequest::REMOVE) {
+            bool removed = shard->parkingSystem->removeVehicle(request.driver, request.time);
+            if (removed && this->listener != nullptr) {
+                this->listener->onRemoved(request.driver, index);
+            }
+            this->finish();
+            return;
+        }
+        if (shard->parkingSystem->parkVehicle(request.driver, request.time)) {
+            if (this->listener != nullptr) {
+                this->listener->onParked(request.driver, index);
+            }
+            this->finish();
+            return;
+        }
+        int home = request.homeGarage;
+        int next = this->findOverflowGarage(home, request.driver->getVehicle()->getSpotSize(), request.hops);
+        if (next == -1) {
+            if (this->listener != nullptr) {
+                this->listener->onParked(request.driver, -1);
+            }
+            this->finish();
+            return;
+        }
+        request.hops = next + 1;
+        this->shards[this->shards[home]->nearestGarages[next]]->queue.push(request);
+    }
+
+public:
+    // positions[i] is the (x, y) location of garages[i], used to rank overflow targets
+    ParkingNetwork(vector<ParkingGarage*> garages, vector<pair<double, double>> positions, int hourlyRate, ParkingListener* listener)
+        : outstanding(0) {
+        this->listener = listener;
+        for (size_t i = 0; i < garages.size(); i++) {
+            Shard* shard = new Shard();
+            shard->garage = garages[i];
+            shard->parkingSystem = new ParkingSystem(garages[i], hourlyRate);
+            shard->longestFreeRun = garages[i]->getLongestFreeRun();
+            for (size_t j = 0; j < garages.size(); j++) {
+                if (j != i) {
+                    shard->nearestGarages.push_back(j);
+                }
+            }
+            auto distance = [&positions, i](int j) {
+                double dx = positions[i].first - positions[j].first, dy = positions[i].second - positions[j].second;
+                return dx * dx + dy * dy;
+            };
+            stable_sort(shard->nearestGarages.begin(), shard->nearestGarages.end(),
+                        [&distance](int a, int b) { return distance(a) < distance(b); });
+            this->shards.push_back(shard);
+        }
+        for (size_t i = 0; i < this->shards.size(); i++) {
+            this->shards[i]->worker = thread([this, i]() { this->run(i); });
+        }
+    }
+
+    ~ParkingNetwork() {
+        for (Shard* shard : this->shards) {
+            shard->queue.close();
+        }
+        for (Shard* shard : this->shards) {
+            shard->worker.join();
+            delete shard->parkingSystem;
+            delete shard;
+        }
+    }
+
+    int getGarageCount() {
+        return this->shards.size();
+    }
+
+    void parkVehicle(Driver* driver, int homeGarage, long long currentTime) {
+        this->outstanding++;
+        this->shards[homeGarage]->queue.push(ParkingRequest(ParkingRequest::PARK, driver, currentTime, homeGarage));
+    }
+
+    void removeVehicle(Driver* driver, int garage, long long currentTime) {
+        this->outstanding++;
+        this->shards[garage]->queue.push(ParkingRequest(ParkingRequest::REMOVE, driver, currentTime, garage));
+    }
+
+    // Block until every submitted request has been handled
+    void waitForIdle() {
+        unique_lock<mutex> guard(this->idleLock);
+        this->idle.wait(guard, [this]() { return this->outstanding.load() == 0; });
+    }
+};
+
+void benchmarkSettlement() {
+    const int sessionCount = 10000000;
+    Tariff tariff(5);
+    tariff.setBand(8, 18, 8);
+    tariff.setDailyCap(60);
+    BillingEngine engine(tariff);
+
+    long long endOfDay = 1700006400;
+    mt19937_64 rng(42);
+    vector<long long> startTimes(sessionCount);
+    for (int i = 0; i < sessionCount; i++) {
+        startTimes[i] = endOfDay - (long long) (rng() % (30LL * 24 * 3600));
+    }
+    vector<long long> charges(sessionCount);
+
+    int threadCount = max(1u, thread::hardware_concurrency());
+    auto start = chrono::steady_clock::now();
+    engine.settle(startTimes.data(), endOfDay, charges.data(), sessionCount, threadCount);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    long long total = 0;
+    for (long long charge : charges) {
+        total += charge;
+    }
+    cout << "settled " << sessionCount << " sessions on " << threadCount << " threads in " << seconds << "s ("
+         << sessionCount / seconds / 1e6 << "M/s), total billed " << total << endl;
+}
+
+// Replay one Limo per four spots onto every floor of the garage
+void seedGarage(ParkingGarage* garage, int floorCount, int spotsPerFloor, vector<Limo>& limos) {
+    int limosPerFloor = spotsPerFloor / 4;
+    for (int floor = 0; floor < floorCount; floor++) {
+        for (int i = 0; i < limosPerFloor; i++) {
+            garage->getFloor(floor)->parkVehicle(&limos[floor * limosPerFloor + i]);
+        }
+    }
+}
+
+// Time to bring up a half-occupied garage of 1M spots: rebuilt in memory and
+// replayed, versus attached to an existing GarageStore image
+void benchmarkColdStart() {
+    const int floorCount = 1000;
+    const int spotsPerFloor = 1000;
+    const string path = "garage_bench.img";
+    vector<Limo> limos(floorCount * (spotsPerFloor / 4));
+
+    auto start = chrono::steady_clock::now();
+    ParkingGarage* rebuilt = new ParkingGarage(floorCount, spotsPerFloor);
+    seedGarage(rebuilt, floorCount, spotsPerFloor, limos);
+    double rebuildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    unlink(path.c_str());
+    {
+        GarageStore store(path, floorCount, spotsPerFloor);
+        ParkingGarage seeded(&store);
+        seedGarage(&seeded, floorCount, spotsPerFloor, limos);
+    }
+
+    start = chrono::steady_clock::now();
+    GarageStore* store = new GarageStore(path, floorCount, spotsPerFloor);
+    ParkingGarage* attached = new ParkingGarage(store);
+    double attachSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "cold start of " << floorCount * spotsPerFloor << " spots: rebuild " << rebuildSeconds * 1000 << "ms, attach "
+         << attachSeconds * 1000 << "ms" << endl;
+    delete attached;
+    delete store;
+    unlink(path.c_str());
+}
+
+// Hold and expire reservations at a steady arrival rate and report how many
+// expiries per second the timing wheel processes
+void benchmarkReservationExpiry() {
+    const int reservationCount = 2000000;
+    const int holdsPerSecond = 100000;
+    TimingWheel wheel;
+    mt19937 rng(7);
+    long long now = 1700000000;
+    vector<int> expired;
+    long long expiredCount = 0;
+
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < reservationCount; i++) {
+        if (i % holdsPerSecond == 0) {
+            now++;
+            wheel.advance(now, expired);
+            expiredCount += expired.size();
+            expired.clear();
+        }
+        wheel.schedule(i, now + 60 + rng() % (4 * 3600));
+    }
+    while (wheel.getSize() > 0) {
+        now += 60;
+        wheel.advance(now, expired);
+        expiredCount += expired.size();
+        expired.clear();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "scheduled and expired " << expiredCount << " holds in " << seconds << "s ("
+         << expiredCount / seconds / 1e6 << "M expiries/s)" << endl;
+}
+
+// Every garage minute must count the arrivals and departures of all floors
+// in that minute and end at the sum of the floors' occupancy
+bool rollupsAddUp(OccupancyAnalytics& analytics, int floorCount) {
+    vector<vector<MinuteRollup>> floors;
+    for (int i = 0; i < floorCount; i++) {
+        floors.push_back(analytics.getFloorRollups(i));
+    }
+    vector<size_t> next(floorCount, 0);
+    vector<int> occupied(floorCount, 0);
+    for (MinuteRollup& garage : analytics.getGarageRollups()) {
+        int arrivals = 0, departures = 0, occupiedSpots = 0;
+        for (int i = 0; i < floorCount; i++) {
+            for (; next[i] < floors[i].size() && floors[i][next[i]].minute <= garage.minute; next[i]++) {
+                if (floors[i][next[i]].minute == garage.minute) {
+                    arrivals += floors[i][next[i]].arrivals;
+                    departures += floors[i][next[i]].departures;
+                }
+                occupied[i] = floors[i][next[i]].occupiedSpots;
+            }
+            occupiedSpots += occupied[i];
+        }
+        if (arrivals != garage.arrivals || departures != garage.departures || occupiedSpots != garage.occupiedSpots) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Park/remove churn on a garage with and without analytics attached, to show
+// what publishing to the event rings costs the placement thread
+void benchmarkAnalyticsOverhead() {
+    const int operations = 2000000;
+    vector<Car> cars(64);
+    double seconds[2];
+    for (int withAnalytics = 0; withAnalytics < 2; withAnalytics++) {
+        ParkingGarage garage(4, 16);
+        OccupancyAnalytics analytics(4, 1 << 16);
+        if (withAnalytics) {
+            garage.addObserver(&analytics);
+            analytics.start(1);
+        }
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < operations; i++) {
+            Car* car = &cars[i % cars.size()];
+            if (!garage.removeVehicle(car)) {
+                garage.parkVehicle(car);
+            }
+        }
+        seconds[withAnalytics] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        analytics.stop();
+        if (withAnalytics) {
+            analytics.aggregate(time(0) + 60);
+            cout << "dropped events: " << analytics.getDroppedEvents() << ", garage rollups "
+                 << (rollupsAddUp(analytics, 4) ? "add up" : "DO NOT add up") << " to the floor rollups" << endl;
+        }
+    }
+    cout << operations << " park/remove operations: " << seconds[0] * 1e9 / operations << "ns/op without analytics, "
+         << seconds[1] * 1e9 / operations << "ns/op with analytics" << endl;
+}
+
+class ChurnListener : public ParkingListener {
+private:
+    ParkingNetwork* network;
+    long long remaining;
+
+public:
+    atomic<long long> completed;
+
+    ChurnListener(long long operations) : completed(0) {
+        this->network = nullptr;
+        this->remaining = operations;
+    }
+
+    void setNetwork(ParkingNetwork* network) {
+        this->network = network;
+    }
+
+    // Every parked driver leaves again and every departure brings the driver back,
+    // so each shard keeps churning until the operation budget is spent
+    void onParked(Driver* driver, int garage) {
+        if (this->completed.fetch_add(1) < this->remaining && garage != -1) {
+            this->network->removeVehicle(driver, garage, 0);
+        }
+    }
+
+    void onRemoved(Driver* driver, int garage) {
+        if (this->completed.fetch_add(1) < this->remaining) {
+            this->network->parkVehicle(driver, garage, 0);
+        }
+    }
+};
+
+// Aggregate park/remove throughput of a ParkingNetwork as the shard count grows
+void benchmarkShardScaling() {
+    const long long operationsPerShard = 500000;
+    const int driversPerShard = 64;
+    int maxShards = max(8u, thread::hardware_concurrency());
+    for (int shardCount = 1; shardCount <= maxShards; shardCount *= 2) {
+        vector<ParkingGarage*> garages;
+        vector<pair<double, double>> positions;
+        vector<Driver*> drivers;
+        for (int i = 0; i < shardCount; i++) {
+            garages.push_back(new ParkingGarage(4, 32));
+            positions.push_back({(double) i, 0});
+            for (int j = 0; j < driversPerShard; j++) {
+                drivers.push_back(new Driver(i * driversPerShard + j, new Car()));
+            }
+        }
+        ChurnListener listener(operationsPerShard * shardCount);
+        auto start = chrono::steady_clock::now();
+        {
+            ParkingNetwork network(garages, positions, 5, &listener);
+            listener.setNetwork(&network);
+            for (size_t i = 0; i < drivers.size(); i++) {
+                network.parkVehicle(drivers[i], i / driversPerShard, 0);
+            }
+            network.waitForIdle();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << shardCount << " shards: " << listener.completed.load() / seconds / 1e6 << "M operations/s" << endl;
+    }
+}
+
+// std::allocator that counts its allocations into a caller's counter
+template <typename T>
+class CountingAllocator {
+public:
+    typedef T value_type;
+
+    long long* count;
+
+    CountingAllocator(long long* count) {
+        this->count = count;
+    }
+
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U>& other) {
+        this->count = other.count;
+    }
+
+    T* allocate(size_t n) {
+        (*this->count)++;
+        return allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* memory, size_t n) {
+        allocator<T>().deallocate(memory, n);
+    }
+
+    template <typename U>
+    bool operator==(const CountingAllocator<U>& other) const {
+        return this->count == other.count;
+    }
+
+    template <typename U>
+    bool operator!=(const CountingAllocator<U>& other) const {
+        return this->count != other.count;
+    }
+};
+
+// Heap allocations per arrival/departure when every driver and vehicle is
+// allocated on its own versus ParkingPools, after the pools have warmed up.
+// Both sides allocate through a CountingAllocator.
+void benchmarkDriverAllocations() {
+    const int rounds = 1000000;
+    const int resident = 512;
+
+    long long heapCount = 0;
+    CountingAllocator<Driver> driverAllocator(&heapCount);
+    CountingAllocator<Vehicle> vehicleAllocator(&heapCount);
+    auto start = chrono::steady_clock::now();
+    vector<Driver*> heapDrivers(resident, nullptr);
+    for (int i = 0; i < rounds; i++) {
+        Driver*& slot = heapDrivers[i % resident];
+        if (slot != nullptr) {
+            vehicleAllocator.deallocate(slot->getVehicle(), 1);
+            driverAllocator.deallocate(slot, 1);
+        }
+        Vehicle* vehicle = new (vehicleAllocator.allocate(1)) Vehicle(i % 3 == 0 ? 2 : 1);
+        slot = new (driverAllocator.allocate(1)) Driver(i, vehicle);
+    }
+    double heapSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (Driver* driver : heapDrivers) {
+        vehicleAllocator.deallocate(driver->getVehicle(), 1);
+        driverAllocator.deallocate(driver, 1);
+    }
+
+    long long poolCount = 0;
+    ParkingPools<CountingAllocator<char>> pools((CountingAllocator<char>(&poolCount)));
+    vector<DriverHandle> pooledDrivers(resident);
+    for (int i = 0; i < resident; i++) {
+        pooledDrivers[i] = pools.acquireDriver(i, i % 3 == 0 ? 2 : 1);
+    }
+    poolCount = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        DriverHandle& slot = pooledDrivers[i % resident];
+        pools.releaseDriver(slot);
+        slot = pools.acquireDriver(i, i % 3 == 0 ? 2 : 1);
+    }
+    double poolSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    pools.reclaimAll();
+
+    cout << rounds << " driver arrivals: one by one " << heapCount << " allocations in " << heapSeconds * 1000
+         << "ms, pools " << poolCount << " allocations in " << poolSeconds * 1000 << "ms" << endl;
+
+    // The same churn parked and removed through a ParkingSystem, whose stays
+    // and vehicle spans live in recycled map nodes
+    ParkingGarage garage(4, 1024);
+    ParkingSystem system(&garage, 5);
+    for (int i = 0; i < resident; i++) {
+        pooledDrivers[i] = pools.acquireDriver(i, i % 3 == 0 ? 2 : 1);
+        system.parkVehicle(pools.getDriver(pooledDrivers[i]), 0);
+    }
+    poolCount = 0;
+    long long warmAllocations = system.getHeapAllocations();
+    start = chrono::steady_clock::now();
+    for (int i = resident; i < rounds; i++) {
+        DriverHandle& slot = pooledDrivers[i % resident];
+        system.removeVehicle(pools.getDriver(slot), 3600);
+        pools.releaseDriver(slot);
+        slot = pools.acquireDriver(i, i % 3 == 0 ? 2 : 1);
+        system.parkVehicle(pools.getDriver(slot), 0);
+    }
+    double systemSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << rounds - resident << " arrivals through a ParkingSystem: "
+         << poolCount + system.getHeapAllocations() - warmAllocations << " allocations in " << systemSeconds * 1000
+         << "ms" << endl;
+    pools.reclaimAll();
+}
+
+// Random churn of cars, limos and semi trucks. With compaction, whenever a
+// vehicle is turned away the floors are replanned and the best plans applied
+// before the next arrival. Reports the rejection rate per vehicle size.
+void benchmarkCompaction() {
+    const int events = 200000;
+    const int floorCount = 4;
+    const int spotsPerFloor = 64;
+    const int reserveSpots = 5;
+    for (int compact = 0; compact < 2; compact++) {
+        ParkingGarage garage(floorCount, spotsPerFloor);
+        CompactionPlanner planner(reserveSpots);
+        mt19937 rng(11);
+        vector<Vehicle*> parked;
+        long long arrivals[4] = {0, 0, 0, 0};
+        long long rejections[4] = {0, 0, 0, 0};
+        long long relocations = 0;
+        vector<Vehicle> fleet;
+        fleet.reserve(events);
+        for (int i = 0; i < events; i++) {
+            if (!parked.empty() && rng() % 100 < 48) {
+                int index = rng() % parked.size();
+                garage.removeVehicle(parked[index]);
+                parked[index] = parked.back();
+                parked.pop_back();
+                continue;
+            }
+            int roll = rng() % 10;
+            fleet.push_back(Vehicle(roll < 6 ? 1 : roll < 9 ? 2 : 3));
+            Vehicle* vehicle = &fleet.back();
+            int size = vehicle->getSpotSize();
+            arrivals[size]++;
+            bool isParked = garage.parkVehicle(vehicle);
+            if (!isParked && compact) {
+                for (int floor = 0; floor < floorCount; floor++) {
+                    planner.requestPlan(garage.getFloor(floor)->getSnapshot(floor), size);
+                }
+                while (!planner.isIdle()) {
+                    planner.tick(16);
+                }
+                vector<CompactionPlan> plans = planner.takePlans();
+                if (!plans.empty()) {
+                    CompactionPlan* cheapest = &plans[0];
+                    for (CompactionPlan& plan : plans) {
+                        if (plan.relocations.size() < cheapest->relocations.size()) {
+                            cheapest = &plan;
+                        }
+                    }
+                    if (garage.getFloor(cheapest->floor)->applyPlan(*cheapest)) {
+                        relocations += cheapest->relocations.size();
+                    }
+                }
+                isParked = garage.parkVehicle(vehicle);
+            }
+            if (isParked) {
+                parked.push_back(vehicle);
+            } else {
+                rejections[size]++;
+            }
+        }
+        cout << (compact ? "with compaction: " : "without compaction: ");
+        for (int size = 1; size <= 3; size++) {
+            cout << "size " << size << " rejected " << 100.0 * rejections[size] / arrivals[size] << "%  ";
+        }
+        cout << relocations << " relocations" << endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && string(argv[1]) == "bench") {
+        string name = argc > 2 ? argv[2] : "";
+        if (name == "" || name == "settlement") {
+            benchmarkSettlement();
+        }
+        if (name == "" || name == "coldstart") {
+            benchmarkColdStart();
+        }
+        if (name == "" || name == "reservations") {
+            benchmarkReservationExpiry();
+        }
+        if (name == "" || name == "analytics") {
+            benchmarkAnalyticsOverhead();
+        }
+        if (name == "" || name == "shards") {
+            benchmarkShardScaling();
+        }
+        if (name == "" || name == "allocations") {
+            benchmarkDriverAllocations();
+        }
+        if (name == "" || name == "compaction") {
+            benchmarkCompaction();
+        }
+        return 0;
+    }
+
+    ParkingGarage* parkingGarage = new ParkingGarage(3, 2);
+    ParkingSystem* parkingSystem = new ParkingSystem(parkingGarage, 5);
+
+    Driver* driver1 = new Driver(1, new Car());
+    Driver* driver2 = new Driver(2, new Limo());
+    Driver* driver3 = new Driver(3, new SemiTruck());
+
+    cout << parkingSystem->parkVehicle(driver1) << endl;    // true
+    cout << parkingSystem->parkVehicle(driver2) << endl;    // true
+    cout << parkingSystem->parkVehicle(driver3) << endl;    // false
+
+    cout << parkingSystem->removeVehicle(driver1) << endl;  // true
+    cout << parkingSystem->removeVehicle(driver2) << endl;  // true
+    cout << parkingSystem->removeVehicle(driver3) << endl;  // false
+
+    // Peak hours cost more and no calendar day costs more than 60
+    Tariff tariff(5);
+    tariff.setBand(8, 18, 8);
+    tariff.setDailyCap(60);
+    ParkingSystem* peakParkingSystem = new ParkingSystem(parkingGarage, BillingEngine(tariff));
+
+    long long monday = 1699833600;    // Monday 00:00 UTC
+    peakParkingSystem->parkVehicle(driver1, monday + 7 * 3600);
+    peakParkingSystem->removeVehicle(driver1, monday + 9 * 3600 + 30 * 60);
+    cout << driver1->getPaymentDue() << endl;               // 21 (5 + 8 + 8)
+    peakParkingSystem->parkVehicle(driver1, monday + 10 * 3600 + 58 * 60);
+    peakParkingSystem->removeVehicle(driver1, monday + 11 * 3600 + 60);
+    cout << driver1->getPaymentDue() << endl;               // 29 (one started hour across 11:00)
+
+    peakParkingSystem->parkVehicle(driver2, monday);
+    peakParkingSystem->settleOpenSessions(monday + 2 * 24 * 3600, 2);
+    cout << driver2->getPaymentDue() << endl;               // 120 (two capped days)
+    peakParkingSystem->settleOpenSessions(monday + 2 * 24 * 3600 + 8 * 3600 + 30 * 60, 2);
+    peakParkingSystem->removeVehicle(driver2, monday + 2 * 24 * 3600 + 12 * 3600);
+    cout << driver2->getPaymentDue() << endl;               // 180 (the third day capped once)
+
+    // Occupancy lives in the mapped image, so a restarted garage sees it at once
+    unlink("garage.img");
+    GarageStore* store = new GarageStore("garage.img", 3, 2);
+    ParkingGarage* persistentGarage = new ParkingGarage(store);
+    Limo* limo = new Limo();
+    persistentGarage->parkVehicle(limo);
+    delete store;
+
+    GarageStore* reopenedStore = new GarageStore("garage.img", 3, 2);
+    ParkingGarage* restartedGarage = new ParkingGarage(reopenedStore);
+    vector<vector<int>> spans = restartedGarage->getFloor(0)->getUnboundSpans();
+    cout << spans.size() << endl;                           // 1 (spots 0-1)
+    cout << restartedGarage->getFloor(0)->reattachVehicle(limo, spans[0][0]) << endl;  // true
+    cout << restartedGarage->removeVehicle(limo) << endl;   // true
+    delete reopenedStore;
+    unlink("garage.img");
+
+    // A booked spot is skipped by walk-ins until it is claimed or expires
+    ParkingGarage* bookedGarage = new ParkingGarage(1, 2);
+    ParkingSystem* bookingSystem = new ParkingSystem(bookedGarage, 5);
+    int reservationId = bookingSystem->reserveSpot(driver1, monday, monday + 900);
+    cout << bookingSystem->parkVehicle(driver2, monday) << endl;                      // false
+    cout << bookingSystem->parkReservedVehicle(driver1, reservationId, monday + 600) << endl;    // true
+    bookingSystem->removeVehicle(driver1, monday + 1200);
+    reservationId = bookingSystem->reserveSpot(driver1, monday + 1200, monday + 1500);
+    cout << bookedGarage->expireReservations(monday + 1800) << endl;                  // 1
+    cout << bookingSystem->parkVehicle(driver2, monday + 1800) << endl;               // true
+
+    // Dashboards read per-minute rollups fed from the garage's event stream
+    OccupancyAnalytics* analytics = new OccupancyAnalytics(bookedGarage->getFloorCount(), 1024);
+    bookedGarage->addObserver(analytics);
+    bookedGarage->parkVehicle(driver3->getVehicle());     // rejected, the floor is full
+    bookedGarage->removeVehicle(driver2->getVehicle());
+    analytics->aggregate(time(0) + 60);
+    MinuteRollup rollup = analytics->getGarageRollups().back();
+    cout << rollup.departures << " " << rollup.rejectedBySize[3] << " " << rollup.occupiedSpots << " "
+         << rollup.peakOccupiedSpots << endl;                                       // 1 1 0 2
+
+    // A full garage overflows to the nearest one that has room
+    class PrintingListener : public ParkingListener {
+    public:
+        void onParked(Driver* driver, int garage) {
+            cout << "driver " << driver->getId() << " parked in garage " << garage << endl;
+        }
+        void onRemoved(Driver*, int) {}
+    };
+    PrintingListener printingListener;
+    ParkingNetwork* network = new ParkingNetwork({new ParkingGarage(1, 1), new ParkingGarage(1, 1), new ParkingGarage(1, 3)},
+                                                 {{0, 0}, {5, 0}, {1, 0}}, 5, &printingListener);
+    network->parkVehicle(new Driver(4, new Car()), 0, monday);
+    network->waitForIdle();
+    network->parkVehicle(new Driver(5, new Car()), 0, monday);     // driver 5 parked in garage 2
+    network->waitForIdle();
+    delete network;
+
+    // Pooled drivers are recycled by handle and freed in bulk
+    ParkingPools<>* pools = new ParkingPools<>();
+    DriverHandle pooled = pools->acquireDriver(6, 2);
+    cout << parkingSystem->parkVehicle(pools->getDriver(pooled)) << endl;              // true
+    cout << parkingSystem->removeVehicle(pools->getDriver(pooled)) << endl;            // true
+    pools->releaseDriver(pooled);
+    cout << (pools->getDriver(pooled) == nullptr) << endl;                             // true
+    pools->acquireDriver(7, 1);
+    pools->reclaimAll();
+    cout << pools->getLiveDriverCount() << endl;                                        // 0
+    delete pools;
+
+    // Churn leaves single free spots; the planner moves one car to fit a limo
+    ParkingGarage* fragmentedGarage = new ParkingGarage(1, 4);
+    Car* cars = new Car[3];
+    for (int i = 0; i < 3; i++) {
+        fragmentedGarage->parkVehicle(&cars[i]);
+    }
+    fragmentedGarage->removeVehicle(&cars[1]);                 // spots: 1 0 1 0
+    Limo* longLimo = new Limo();
+    cout << fragmentedGarage->parkVehicle(longLimo) << endl;    // false
+    CompactionPlanner* planner = new CompactionPlanner();
+    planner->requestPlan(fragmentedGarage->getFloor(0)->getSnapshot(0), 2);
+    planner->tick(8);
+    CompactionPlan plan = planner->takePlans()[0];
+    cout << plan.relocations.size() << " " << fragmentedGarage->getFloor(0)->applyPlan(plan) << endl;   // 1 1
+    cout << fragmentedGarage->parkVehicle(longLimo) << endl;    // true
+    delete planner;
 }
@@ -2,10 +2,40 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <fstream>
 #include <math.h>
+#include <cstdint>
+#include <chrono>
+#include <ctime>
+#include <charconv>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <random>
+#include <queue>
+#include <deque>
 
 using namespace std;
 
+enum TransactionType : uint8_t {
+    OPEN_ACCOUNT = 1,
+    DEPOSIT = 2,
+    WITHDRAWAL = 3,
+    TRANSFER = 4,
+    ACCRUAL = 5,    // a batch job's net change to a range of accounts: customer ID is the first, counterparty ID the last
+};
+
 class Transaction {
 private:
     int customerId;
@@ -16,6 +46,8 @@ public:
         this->customerId = customerId;
         this->tellerId = tellerId;
     }
+
+    virtual ~Transaction() {}
     
     int getCustomerId() {
         return customerId;
@@ -24,6 +56,17 @@ public:
     int getTellerId() {
         return tellerId;
     }
+
+    virtual TransactionType getType() = 0;
+
+    virtual int getAmount() {
+        return 0;
+    }
+
+    // Receiving account of a transfer, -1 for everything else
+    virtual int getCounterpartyId() {
+        return -1;
+    }
     
     virtual string getTransactionDescription() = 0;
 };
@@ -36,6 +79,14 @@ public:
     Deposit(int customerId, int tellerId, int amount) : Transaction(customerId, tellerId) {
         this->amount = amount;
     }
+
+    TransactionType getType() {
+        return DEPOSIT;
+    }
+
+    int getAmount() {
+        return amount;
+    }
     
     string getTransactionDescription() {
         return "Teller " + to_string(getTellerId()) + " deposited " + to_string(amount) + " to account " + to_string(getCustomerId());
@@ -51,249 +102,6258 @@ public:
         this->amount = amount;
     }
 
+    TransactionType getType() {
+        return WITHDRAWAL;
+    }
+
+    int getAmount() {
+        return amount;
+    }
+
     string getTransactionDescription() {
         return "Teller " + to_string(getTellerId()) + " withdrew " + to_string(amount) + " from account " + to_string(getCustomerId());
     }
 };
 
+class Transfer : public Transaction {
+private:
+    int toCustomerId;
+    int amount;
+
+public:
+    Transfer(int customerId, int toCustomerId, int tellerId, int amount) : Transaction(customerId, tellerId) {
+        this->toCustomerId = toCustomerId;
+        this->amount = amount;
+    }
+
+    TransactionType getType() {
+        return TRANSFER;
+    }
+
+    int getAmount() {
+        return amount;
+    }
+
+    int getCounterpartyId() {
+        return toCustomerId;
+    }
+
+    string getTransactionDescription() {
+        return "Teller " + to_string(getTellerId()) + " transferred " + to_string(amount) + " from account " + to_string(getCustomerId()) + " to account " + to_string(toCustomerId);
+    }
+};
+
 class OpenAccount : public Transaction {
 public:
     OpenAccount(int customerId, int tellerId) : Transaction(customerId, tellerId) {
     }
+
+    TransactionType getType() {
+        return OPEN_ACCOUNT;
+    }
     
     string getTransactionDescription() {
         return "Teller " + to_string(getTellerId()) + " opened account " + to_string(getCustomerId());
     }
 };
 
-class BankTeller {
+// One fixed-size block of the ledger, stored column by column
+class LedgerSegment {
+public:
+    static const int ROWS = 1 << 14;
+
+    atomic<uint8_t> types[ROWS];  // written last; 0 until the row is published
+    int32_t customerIds[ROWS];
+    int32_t counterpartyIds[ROWS];
+    int32_t tellerIds[ROWS];
+    int64_t amounts[ROWS];
+    int64_t timestamps[ROWS];     // microseconds since the epoch
+
+    // Secondary indexes: each row links to the previous row of the same
+    // customer, counterparty and teller bucket, or -1
+    int32_t previousCustomerRows[ROWS];
+    int32_t previousCounterpartyRows[ROWS];
+    int32_t previousTellerRows[ROWS];
+
+    // Time partition: bounds of the timestamps of the published rows. A
+    // reader that finds every row published seals the segment, so later
+    // range queries can trust the bounds without checking again.
+    atomic<int64_t> minTimestamp;
+    atomic<int64_t> maxTimestamp;
+    atomic<bool> sealed;
+
+    LedgerSegment() : minTimestamp(INT64_MAX), maxTimestamp(INT64_MIN), sealed(false) {
+        for (atomic<uint8_t>& type : this->types) {
+            type.store(0, memory_order_relaxed);
+        }
+    }
+};
+
+// Append-only columnar transaction log. Rows live in parallel arrays inside
+// fixed segments, so appending never allocates per transaction and scans walk
+// contiguous memory instead of chasing Transaction pointers.
+class TransactionLedger {
+public:
+    static const int MAX_SEGMENTS = 1 << 16;
+    static const long long MAX_ROWS = (long long) MAX_SEGMENTS * LedgerSegment::ROWS;
+    static_assert(MAX_ROWS <= INT32_MAX, "the index links hold rows as int32");
+
 private:
-    int id;
+    static const int HEADS_PER_CHUNK = 4096;
+    static const int TELLER_BUCKETS = 1 << 16;
+
+    vector<atomic<LedgerSegment*>> segments;
+    long long first;            // rows before this were dropped by a restart
+    atomic<long long> size;
+    vector<atomic<atomic<int32_t>*>> customerHeads;     // newest row per customer, in lazily made chunks
+    vector<atomic<int32_t>> tellerHeads;                // newest row per teller ID bucket
+
+    // Newest-row slot of customerId, created by whichever appender reaches it first
+    atomic<int32_t>& customerHead(int customerId) {
+        atomic<atomic<int32_t>*>& slot = this->customerHeads[customerId / HEADS_PER_CHUNK];
+        atomic<int32_t>* chunk = slot.load(memory_order_acquire);
+        if (chunk == nullptr) {
+            atomic<int32_t>* fresh = new atomic<int32_t>[HEADS_PER_CHUNK];
+            for (int i = 0; i < HEADS_PER_CHUNK; i++) {
+                fresh[i].store(-1, memory_order_relaxed);
+            }
+            if (slot.compare_exchange_strong(chunk, fresh, memory_order_acq_rel)) {
+                chunk = fresh;
+            } else {
+                delete[] fresh;
+            }
+        }
+        return chunk[customerId % HEADS_PER_CHUNK];
+    }
+
+    // Segment holding row, created by whichever appender reaches it first
+    LedgerSegment* segmentFor(long long row) {
+        atomic<LedgerSegment*>& slot = this->segments[row / LedgerSegment::ROWS];
+        LedgerSegment* segment = slot.load(memory_order_acquire);
+        if (segment == nullptr) {
+            LedgerSegment* fresh = new LedgerSegment();
+            if (slot.compare_exchange_strong(segment, fresh, memory_order_acq_rel)) {
+                segment = fresh;
+            } else {
+                delete fresh;
+            }
+        }
+        return segment;
+    }
 
 public:
-    BankTeller(int id) {
-        this->id = id;
+    TransactionLedger()
+        : segments(MAX_SEGMENTS), first(0), size(0), customerHeads(MAX_SEGMENTS), tellerHeads(TELLER_BUCKETS) {
+        for (atomic<LedgerSegment*>& segment : this->segments) {
+            segment.store(nullptr, memory_order_relaxed);
+        }
+        for (atomic<atomic<int32_t>*>& chunk : this->customerHeads) {
+            chunk.store(nullptr, memory_order_relaxed);
+        }
+        for (atomic<int32_t>& head : this->tellerHeads) {
+            head.store(-1, memory_order_relaxed);
+        }
     }
 
-    int getId() {
-        return id;
+    ~TransactionLedger() {
+        for (atomic<LedgerSegment*>& segment : this->segments) {
+            delete segment.load();
+        }
+        for (atomic<atomic<int32_t>*>& chunk : this->customerHeads) {
+            delete[] chunk.load();
+        }
+    }
+
+    TransactionLedger(const TransactionLedger&) = delete;
+    TransactionLedger& operator=(const TransactionLedger&) = delete;
+
+    // Coarse clock: millisecond-ish resolution is plenty for a ledger and much cheaper per row
+    static long long now() {
+        timespec clock;
+        clock_gettime(CLOCK_REALTIME_COARSE, &clock);
+        return clock.tv_sec * 1000000LL + clock.tv_nsec / 1000;
+    }
+
+    // Safe to call from many threads, as long as no two append for the same
+    // customer at once
+    long long append(TransactionType type, int customerId, int tellerId, long long amount, int counterpartyId = -1) {
+        long long row = this->reserve(1);
+        this->write(row, type, customerId, tellerId, amount, counterpartyId, now());
+        return row;
+    }
+
+    // Claim count consecutive rows; each must then be filled with write.
+    // Throws, claiming nothing, if they would not fit in MAX_ROWS.
+    long long reserve(long long count) {
+        long long row = this->size.load(memory_order_relaxed);
+        do {
+            if (row + count > MAX_ROWS) {
+                throw "Ledger is full";
+            }
+        } while (!this->size.compare_exchange_weak(row, row + count, memory_order_relaxed));
+        return row;
+    }
+
+    // Fill and publish a reserved row, linking it into the indexes
+    void write(long long row, TransactionType type, int customerId, int tellerId, long long amount,
+               int counterpartyId, long long timestamp) {
+        int offset = row % LedgerSegment::ROWS;
+        LedgerSegment* segment = this->segmentFor(row);
+        segment->customerIds[offset] = customerId;
+        segment->counterpartyIds[offset] = counterpartyId;
+        segment->tellerIds[offset] = tellerId;
+        segment->amounts[offset] = amount;
+        segment->timestamps[offset] = timestamp;
+
+        // Appends for one customer are serialized by the caller (BankSystem
+        // holds the account lock), so its head needs no read-modify-write.
+        // Accruals span many customers and stay out of their histories.
+        segment->previousCustomerRows[offset] = -1;
+        if (type != ACCRUAL) {
+            atomic<int32_t>& customerHead = this->customerHead(customerId);
+            segment->previousCustomerRows[offset] = customerHead.load(memory_order_relaxed);
+            customerHead.store(row, memory_order_release);
+        }
+        segment->previousCounterpartyRows[offset] = -1;
+        if (counterpartyId >= 0 && type != ACCRUAL) {
+            atomic<int32_t>& counterpartyHead = this->customerHead(counterpartyId);
+            segment->previousCounterpartyRows[offset] = counterpartyHead.load(memory_order_relaxed);
+            counterpartyHead.store(row, memory_order_release);
+        }
+        segment->previousTellerRows[offset] =
+            this->tellerHeads[tellerId & (TELLER_BUCKETS - 1)].exchange(row, memory_order_acq_rel);
+        int64_t bound = segment->minTimestamp.load(memory_order_relaxed);
+        while (timestamp < bound && !segment->minTimestamp.compare_exchange_weak(bound, timestamp)) {
+        }
+        bound = segment->maxTimestamp.load(memory_order_relaxed);
+        while (timestamp > bound && !segment->maxTimestamp.compare_exchange_weak(bound, timestamp)) {
+        }
+
+        segment->types[offset].store(type, memory_order_release);
+    }
+
+    // Rows reserved so far; the last few may still be being written
+    long long getSize() {
+        return this->size.load(memory_order_acquire);
+    }
+
+    long long getFirst() {
+        return this->first;
+    }
+
+    // Newest row of customerId, or -1; older rows follow the links back
+    long long getCustomerHead(int customerId) {
+        return this->customerHead(customerId).load(memory_order_acquire);
+    }
+
+    // Newest row in the bucket of tellerId, which other tellers may share
+    long long getTellerHead(int tellerId) {
+        return this->tellerHeads[tellerId & (TELLER_BUCKETS - 1)].load(memory_order_acquire);
+    }
+
+    // Published segment, or nullptr if no row has reached it yet
+    LedgerSegment* findSegment(long long row) {
+        return this->segments[row / LedgerSegment::ROWS].load(memory_order_acquire);
+    }
+
+    // Continue numbering at row on an empty ledger, so new rows keep the
+    // log sequence numbers they had before a restart; not thread-safe
+    void restartAt(long long row) {
+        this->first = row;
+        this->size.store(row, memory_order_release);
+    }
+
+    // Segment of a reserved row, once its appender has published it
+    LedgerSegment* getSegment(long long row) {
+        LedgerSegment* segment;
+        while ((segment = this->segments[row / LedgerSegment::ROWS].load(memory_order_acquire)) == nullptr) {
+            this_thread::yield();
+        }
+        while (segment->types[row % LedgerSegment::ROWS].load(memory_order_acquire) == 0) {
+            this_thread::yield();
+        }
+        return segment;
     }
 };
 
-class BankAccount {
+// Lightweight reference to one ledger row; reads straight from the columns
+class TransactionRow {
 private:
-    int customerId;
-    string name;
-    int balance;
+    LedgerSegment* segment;
+    int offset;
 
 public:
-    BankAccount(int customerId, string name, int balance) {
-        this->customerId = customerId;
-        this->name = name;
-        this->balance = balance;
+    TransactionRow(LedgerSegment* segment, int offset) {
+        this->segment = segment;
+        this->offset = offset;
+    }
+
+    TransactionType getType() {
+        return (TransactionType) this->segment->types[this->offset].load(memory_order_relaxed);
+    }
+
+    int getCustomerId() {
+        return this->segment->customerIds[this->offset];
     }
 
-    int getBalance() {
-        return this->balance;
+    int getCounterpartyId() {
+        return this->segment->counterpartyIds[this->offset];
     }
 
-    void deposit(int amount) {
-        this->balance += amount;
+    int getTellerId() {
+        return this->segment->tellerIds[this->offset];
+    }
+
+    long long getAmount() {
+        return this->segment->amounts[this->offset];
+    }
+
+    long long getTimestamp() {
+        return this->segment->timestamps[this->offset];
     }
 
-    void withdraw(int amount) {
-        this->balance -= amount;
+    string getTransactionDescription() {
+        string teller = "Teller " + to_string(getTellerId());
+        if (getType() == DEPOSIT) {
+            return teller + " deposited " + to_string(getAmount()) + " to account " + to_string(getCustomerId());
+        }
+        if (getType() == WITHDRAWAL) {
+            return teller + " withdrew " + to_string(getAmount()) + " from account " + to_string(getCustomerId());
+        }
+        if (getType() == TRANSFER) {
+            return teller + " transferred " + to_string(getAmount()) + " from account " + to_string(getCustomerId())
+                   + " to account " + to_string(getCounterpartyId());
+        }
+        if (getType() == ACCRUAL) {
+            return teller + " posted " + to_string(getAmount()) + " net to accounts " + to_string(getCustomerId())
+                   + " to " + to_string(getCounterpartyId());
+        }
+        return teller + " opened account " + to_string(getCustomerId());
     }
 };
 
-class BankSystem {
+// Iterable range of ledger rows [begin, end), e.g. for (TransactionRow row : view)
+class LedgerView {
 private:
-    vector<BankAccount*> accounts;
-    vector<Transaction*> transactions;
+    TransactionLedger* ledger;
+    long long first;
+    long long last;
 
 public:
-    BankSystem(vector<BankAccount*> accounts, vector<Transaction*> transactions) {
-        this->accounts = accounts;
-        this->transactions = transactions;
+    class Iterator {
+    private:
+        TransactionLedger* ledger;
+        long long row;
+
+    public:
+        Iterator(TransactionLedger* ledger, long long row) {
+            this->ledger = ledger;
+            this->row = row;
+        }
+
+        TransactionRow operator*() {
+            return TransactionRow(this->ledger->getSegment(this->row), this->row % LedgerSegment::ROWS);
+        }
+
+        Iterator& operator++() {
+            this->row++;
+            return *this;
+        }
+
+        bool operator!=(const Iterator& other) const {
+            return this->row != other.row;
+        }
+    };
+
+    LedgerView(TransactionLedger* ledger, long long first, long long last) {
+        this->ledger = ledger;
+        this->first = first;
+        this->last = last;
     }
 
-    BankAccount* getAccount(int customerId) {
-        return this->accounts[customerId];
+    Iterator begin() {
+        return Iterator(this->ledger, this->first);
     }
 
-    vector<BankAccount*> getAccounts() {
-        return this->accounts;
+    Iterator end() {
+        return Iterator(this->ledger, this->last);
     }
 
-    vector<Transaction*> getTransactions() {
-        return this->transactions;
+    long long size() {
+        return this->last - this->first;
     }
 
-    int openAccount(string customerName, int tellerId) {
-        // Create account
-        int customerId = this->accounts.size();
-        BankAccount* account = new BankAccount(customerId, customerName, 0);
-        this->accounts.push_back(account);
-
-        // Log transaction
-        OpenAccount* transaction = new OpenAccount(customerId, tellerId);
-        this->transactions.push_back(transaction);
-        return customerId;
+    TransactionRow operator[](long long index) {
+        long long row = this->first + index;
+        return TransactionRow(this->ledger->getSegment(row), row % LedgerSegment::ROWS);
     }
+};
 
-    void deposit(int customerId, int tellerId, int amount) {
-        BankAccount* account = this->getAccount(customerId);
-        account->deposit(amount);
+// Rows of one customer or one teller, newest first, found by following the
+// index links back from the newest row; optionally limited to timestamps in
+// [fromTimestamp, toTimestamp)
+class HistoryView {
+public:
+    enum Key {
+        CUSTOMER,
+        TELLER,
+    };
 
-        Deposit* transaction = new Deposit(customerId, tellerId, amount);
-        this->transactions.push_back(transaction);
-    }
+private:
+    TransactionLedger* ledger;
+    Key key;
+    int id;
+    long long fromTimestamp;
+    long long toTimestamp;
 
-    void withdraw(int customerId, int tellerId, int amount) {
-        if (amount > this->getAccount(customerId)->getBalance()) {
-            throw "Insufficient funds";
+public:
+    class Iterator {
+    private:
+        TransactionLedger* ledger;
+        Key key;
+        int id;
+        long long fromTimestamp;
+        long long toTimestamp;
+        long long row;
+
+        // Walk back from row to the first row that belongs to id and falls in
+        // the time range; -1 when there is none
+        void settle() {
+            while (this->row >= 0) {
+                LedgerSegment* segment = this->ledger->getSegment(this->row);
+                int offset = this->row % LedgerSegment::ROWS;
+                long long timestamp = segment->timestamps[offset];
+                long long previous;
+                bool matches = true;
+                if (this->key == TELLER) {
+                    matches = segment->tellerIds[offset] == this->id;
+                    previous = segment->previousTellerRows[offset];
+                } else {
+                    // One customer's rows are appended under its account lock, so
+                    // their timestamps never decrease and older ones can be cut off
+                    if (timestamp < this->fromTimestamp) {
+                        this->row = -1;
+                        return;
+                    }
+                    previous = segment->customerIds[offset] == this->id ? segment->previousCustomerRows[offset]
+                                                                        : segment->previousCounterpartyRows[offset];
+                }
+                if (matches && timestamp >= this->fromTimestamp && timestamp < this->toTimestamp) {
+                    return;
+                }
+                this->row = previous;
+            }
+        }
+
+    public:
+        Iterator(TransactionLedger* ledger, Key key, int id, long long fromTimestamp, long long toTimestamp,
+                 long long row) {
+            this->ledger = ledger;
+            this->key = key;
+            this->id = id;
+            this->fromTimestamp = fromTimestamp;
+            this->toTimestamp = toTimestamp;
+            this->row = row;
+            this->settle();
+        }
+
+        TransactionRow operator*() {
+            return TransactionRow(this->ledger->getSegment(this->row), this->row % LedgerSegment::ROWS);
+        }
+
+        Iterator& operator++() {
+            LedgerSegment* segment = this->ledger->getSegment(this->row);
+            int offset = this->row % LedgerSegment::ROWS;
+            if (this->key == TELLER) {
+                this->row = segment->previousTellerRows[offset];
+            } else if (segment->customerIds[offset] == this->id) {
+                this->row = segment->previousCustomerRows[offset];
+            } else {
+                this->row = segment->previousCounterpartyRows[offset];
+            }
+            this->settle();
+            return *this;
+        }
+
+        bool operator!=(const Iterator& other) const {
+            return this->row != other.row;
         }
-        BankAccount* account = this->getAccount(customerId);
-        account->withdraw(amount);
+    };
+
+    HistoryView(TransactionLedger* ledger, Key key, int id, long long fromTimestamp, long long toTimestamp) {
+        this->ledger = ledger;
+        this->key = key;
+        this->id = id;
+        this->fromTimestamp = fromTimestamp;
+        this->toTimestamp = toTimestamp;
+    }
 
-        Withdrawal* transaction = new Withdrawal(customerId, tellerId, amount);
-        this->transactions.push_back(transaction);
+    Iterator begin() {
+        long long head = this->key == TELLER ? this->ledger->getTellerHead(this->id)
+                                             : this->ledger->getCustomerHead(this->id);
+        return Iterator(this->ledger, this->key, this->id, this->fromTimestamp, this->toTimestamp, head);
+    }
+
+    Iterator end() {
+        return Iterator(this->ledger, this->key, this->id, this->fromTimestamp, this->toTimestamp, -1);
     }
 };
 
-class BankBranch {
+// Rows first..last-1 with timestamps in [fromTimestamp, toTimestamp), oldest
+// first. Segments whose timestamp bounds miss the range are skipped whole.
+class TimeRangeView {
 private:
-    string address;
-    int cashOnHand;
-    BankSystem* bankSystem;
-    vector<BankTeller> tellers;
+    TransactionLedger* ledger;
+    long long fromTimestamp;
+    long long toTimestamp;
+    long long first;
+    long long last;
 
 public:
-    BankBranch(string address, int cashOnHand, BankSystem* bankSystem) {
-        this->address = address;
-        this->cashOnHand = cashOnHand;
-        this->bankSystem = bankSystem;
+    class Iterator {
+    private:
+        TransactionLedger* ledger;
+        long long fromTimestamp;
+        long long toTimestamp;
+        long long row;
+        long long last;
+        long long checkedUntil;     // rows before this are in a segment that overlaps the range
+
+        void settle() {
+            while (this->row < this->last) {
+                if (this->row >= this->checkedUntil) {
+                    long long segmentEnd = min(this->last, (this->row / LedgerSegment::ROWS + 1) * LedgerSegment::ROWS);
+                    // The bounds only cover published rows, so wait for the rest
+                    LedgerSegment* segment = this->ledger->getSegment(this->row);
+                    if (!segment->sealed.load(memory_order_acquire)) {
+                        int startOffset = this->row % LedgerSegment::ROWS;
+                        int endOffset = segmentEnd - segmentEnd / LedgerSegment::ROWS * LedgerSegment::ROWS;
+                        endOffset = endOffset == 0 ? LedgerSegment::ROWS : endOffset;
+                        for (int offset = startOffset; offset < endOffset; offset++) {
+                            while (segment->types[offset].load(memory_order_relaxed) == 0) {
+                                this_thread::yield();
+                            }
+                        }
+                        atomic_thread_fence(memory_order_acquire);
+                        if (startOffset == 0 && endOffset == LedgerSegment::ROWS) {
+                            segment->sealed.store(true, memory_order_release);
+                        }
+                    }
+                    if (segment->maxTimestamp.load(memory_order_relaxed) < this->fromTimestamp
+                        || segment->minTimestamp.load(memory_order_relaxed) >= this->toTimestamp) {
+                        this->row = segmentEnd;
+                        continue;
+                    }
+                    this->checkedUntil = segmentEnd;
+                }
+                long long timestamp = this->ledger->getSegment(this->row)->timestamps[this->row % LedgerSegment::ROWS];
+                if (timestamp >= this->fromTimestamp && timestamp < this->toTimestamp) {
+                    return;
+                }
+                this->row++;
+            }
+        }
+
+    public:
+        Iterator(TransactionLedger* ledger, long long fromTimestamp, long long toTimestamp, long long row,
+                 long long last) {
+            this->ledger = ledger;
+            this->fromTimestamp = fromTimestamp;
+            this->toTimestamp = toTimestamp;
+            this->row = row;
+            this->last = last;
+            this->checkedUntil = row;
+            this->settle();
+        }
+
+        TransactionRow operator*() {
+            return TransactionRow(this->ledger->getSegment(this->row), this->row % LedgerSegment::ROWS);
+        }
+
+        Iterator& operator++() {
+            this->row++;
+            this->settle();
+            return *this;
+        }
+
+        bool operator!=(const Iterator& other) const {
+            return this->row != other.row;
+        }
+    };
+
+    TimeRangeView(TransactionLedger* ledger, long long fromTimestamp, long long toTimestamp, long long first,
+                  long long last) {
+        this->ledger = ledger;
+        this->fromTimestamp = fromTimestamp;
+        this->toTimestamp = toTimestamp;
+        this->first = first;
+        this->last = last;
     }
 
-    void addTeller(BankTeller teller) {
-        this->tellers.push_back(teller);
+    Iterator begin() {
+        return Iterator(this->ledger, this->fromTimestamp, this->toTimestamp, this->first, this->last);
     }
 
-    BankTeller getAvailableTeller() {
-        int index = (int) round((double) rand() / RAND_MAX * (this->tellers.size() - 1));
-        return this->tellers[index];
+    Iterator end() {
+        return Iterator(this->ledger, this->fromTimestamp, this->toTimestamp, this->last, this->last);
     }
+};
 
-    int openAccount(string customerName) {
-        if (this->tellers.size() == 0) {
-            throw "Branch does not have any tellers";
-        }
-        BankTeller teller = this->getAvailableTeller();
-        return this->bankSystem->openAccount(customerName, teller.getId());
+// Formats ledger rows straight into a caller's buffer, one line per row,
+// without building a string per transaction
+class TransactionRenderer {
+private:
+    static char* put(char* out, const char* text, size_t length) {
+        memcpy(out, text, length);
+        return out + length;
     }
 
-    void deposit(int customerId, int amount) {
-        if (this->tellers.size() == 0) {
-            throw "Branch does not have any tellers";
+    static const int INT_DIGITS = 11;       // "-2147483648"
+    static const int AMOUNT_DIGITS = 20;    // "-9223372036854775808"
+
+    static char* putNumber(char* out, long long value) {
+        return to_chars(out, out + AMOUNT_DIGITS, value).ptr;
+    }
+
+public:
+    // Longest line render() can produce: a transfer with every number at its widest
+    static const size_t MAX_LINE = sizeof("Teller  transferred  from account  to account \n") - 1 + AMOUNT_DIGITS
+                                   + 3 * INT_DIGITS;
+
+    // Write row's description and a newline to out; returns the bytes written
+    static size_t render(TransactionRow row, char* out) {
+        char* cursor = put(out, "Teller ", 7);
+        cursor = putNumber(cursor, row.getTellerId());
+        if (row.getType() == DEPOSIT) {
+            cursor = put(cursor, " deposited ", 11);
+            cursor = putNumber(cursor, row.getAmount());
+            cursor = put(cursor, " to account ", 12);
+        } else if (row.getType() == WITHDRAWAL) {
+            cursor = put(cursor, " withdrew ", 10);
+            cursor = putNumber(cursor, row.getAmount());
+            cursor = put(cursor, " from account ", 14);
+        } else if (row.getType() == TRANSFER) {
+            cursor = put(cursor, " transferred ", 13);
+            cursor = putNumber(cursor, row.getAmount());
+            cursor = put(cursor, " from account ", 14);
+            cursor = putNumber(cursor, row.getCustomerId());
+            cursor = put(cursor, " to account ", 12);
+            cursor = putNumber(cursor, row.getCounterpartyId());
+            *cursor++ = '\n';
+            return cursor - out;
+        } else if (row.getType() == ACCRUAL) {
+            cursor = put(cursor, " posted ", 8);
+            cursor = putNumber(cursor, row.getAmount());
+            cursor = put(cursor, " net to accounts ", 17);
+            cursor = putNumber(cursor, row.getCustomerId());
+            cursor = put(cursor, " to ", 4);
+            cursor = putNumber(cursor, row.getCounterpartyId());
+            *cursor++ = '\n';
+            return cursor - out;
+        } else {
+            cursor = put(cursor, " opened account ", 16);
         }
-        BankTeller teller = this->getAvailableTeller();
-        this->bankSystem->deposit(customerId, teller.getId(), amount);
+        cursor = putNumber(cursor, row.getCustomerId());
+        *cursor++ = '\n';
+        return cursor - out;
     }
 
-    void withdraw(int customerId, int amount) {
-        if (amount > this->cashOnHand) {
-            throw "Branch does not have enough cash";
+    // Stream every row of view to fd in large writes
+    template <typename View>
+    static void writeLedger(View view, int fd) {
+        const size_t bufferSize = 1 << 16;
+        vector<char> buffer(bufferSize);
+        size_t used = 0;
+        for (TransactionRow row : view) {
+            if (used + MAX_LINE > bufferSize) {
+                writeAll(fd, buffer.data(), used);
+                used = 0;
+            }
+            used += render(row, buffer.data() + used);
         }
-        if (this->tellers.size() == 0) {
-            throw "Branch does not have any tellers";
+        writeAll(fd, buffer.data(), used);
+    }
+
+    static void writeAll(int fd, const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t written = write(fd, data, length);
+            if (written < 0) {
+                throw "Could not write ledger";
+            }
+            data += written;
+            length -= written;
         }
-        this->cashOnHand -= amount;
-        BankTeller teller = this->getAvailableTeller();
-        this->bankSystem->withdraw(customerId, teller.getId(), amount);
     }
+};
 
-    int collectCash(double ratio) {
-        int cashToCollect = (int) round(this->cashOnHand * ratio);
-        this->cashOnHand -= cashToCollect;
-        return cashToCollect;
+class BankTeller {
+private:
+    int id;
+
+public:
+    BankTeller(int id) {
+        this->id = id;
     }
 
-    void provideCash(int amount) {
-        this->cashOnHand += amount;
+    int getId() {
+        return id;
     }
 };
 
-class Bank {
+// Test-and-test-and-set lock, one per account, so accounts never share a lock
+class AccountLock {
 private:
-    vector<BankBranch> branches;
-    BankSystem* bankSystem;
-    int totalCash;
+    atomic<bool> locked;
 
 public:
-    Bank(vector<BankBranch> branches, BankSystem* bankSystem, int totalCash) {
-        this->branches = branches;
-        this->bankSystem = bankSystem;
-        this->totalCash = totalCash;
+    AccountLock() : locked(false) {}
+
+    void lock() {
+        while (true) {
+            if (!this->locked.exchange(true, memory_order_acquire)) {
+                return;
+            }
+            while (this->locked.load(memory_order_relaxed)) {
+                this_thread::yield();
+            }
+        }
     }
 
-    BankBranch addBranch(string address, int initialFunds) {
-        BankBranch branch(address, initialFunds, this->bankSystem);
-        this->branches.push_back(branch);
-        return branch;
+    void unlock() {
+        this->locked.store(false, memory_order_release);
     }
+};
 
-    void collectCash(double ratio) {
-        for (BankBranch branch : this->branches) {
-            int cashCollected = branch.collectCash(ratio);
-            this->totalCash += cashCollected;
+// Fixed-capacity array reserved up front in virtual memory. Pages are only
+// backed once touched, so it can be indexed densely and never moves. Entries
+// start zero-filled, which must be a valid T.
+template <typename T>
+class DenseArray {
+private:
+    T* data;
+    size_t bytes;
+
+public:
+    DenseArray(long long capacity) {
+        this->bytes = capacity * sizeof(T);
+        void* data = mmap(nullptr, this->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (data == MAP_FAILED) {
+            throw "Could not reserve account storage";
         }
+        this->data = (T*) data;
     }
 
-    void printTransactions() {
-        for (Transaction* transaction : this->bankSystem->getTransactions()) {
-            cout << transaction->getTransactionDescription() << endl;
+    ~DenseArray() {
+        munmap(this->data, this->bytes);
+    }
+
+    DenseArray(const DenseArray&) = delete;
+    DenseArray& operator=(const DenseArray&) = delete;
+
+    T& operator[](long long index) {
+        return this->data[index];
+    }
+
+    T* getData() {
+        return this->data;
+    }
+
+    // Pass an madvise() hint, such as MADV_HUGEPAGE, for the whole array
+    void advise(int advice) {
+        madvise(this->data, this->bytes, advice);
+    }
+};
+
+// A sum updated from many threads at once. Each add goes to one of STRIPES
+// cache lines, picked by the caller's hint (e.g. a customer ID), so adds from
+// different cores rarely contend; get() adds the stripes up without locking.
+class StripedCounter {
+public:
+    static const int STRIPES = 64;
+
+private:
+    class alignas(64) Stripe {
+    public:
+        atomic<long long> value;
+    };
+
+    Stripe stripes[STRIPES];
+
+public:
+    StripedCounter() {
+        for (Stripe& stripe : this->stripes) {
+            stripe.value = 0;
+        }
+    }
+
+    void add(long long delta, size_t hint) {
+        this->stripes[hint & (STRIPES - 1)].value.fetch_add(delta, memory_order_relaxed);
+    }
+
+    // Every add that returned before the call, and possibly some still running
+    long long get() {
+        long long sum = 0;
+        for (Stripe& stripe : this->stripes) {
+            sum += stripe.value.load(memory_order_relaxed);
         }
+        return sum;
     }
 };
 
-int main() {
-    BankSystem bankSystem = BankSystem(vector<BankAccount*>(), vector<Transaction*>());
-    Bank bank = Bank(vector<BankBranch>(), &bankSystem, 10000);
+// Operations a teller has posted and the sum of their amounts
+class TellerVolume {
+public:
+    atomic<long long> operations;
+    atomic<long long> amount;
+};
 
-    string address = "123 Main St";
-    string address2 = "456 Elm St";
+// Customer names, each distinct name stored once as [uint32 length][bytes] in
+// 1MB chunks that never move, so readers need no lock. Interning is done by
+// one writer at a time (BankSystem's open-account lock), at most capacity
+// distinct names.
+class NameArena {
+private:
+    static const int CHUNK_BYTES = 1 << 20;
+    static const int MAX_CHUNKS = 1 << 16;
 
-    BankBranch branch1 = bank.addBranch(address, 1000);
-    BankBranch branch2 = bank.addBranch(address2, 1000);
+    vector<atomic<char*>> chunks;
+    long long used;
+    DenseArray<uint64_t> offsets;   // by name ID
+    uint32_t count;
+    // Open addressing on the name hash. A slot holds the 32-bit hash in its
+    // high half and name ID + 1 in its low half (0 if empty), so probing and
+    // growing rarely have to look at the names themselves.
+    vector<uint64_t> table;
 
-    branch1.addTeller(BankTeller(1));
-    branch1.addTeller(BankTeller(2));
-    branch2.addTeller(BankTeller(3));
-    branch2.addTeller(BankTeller(4));
+    static uint32_t hashOf(const string& name) {
+        uint32_t hash = 2166136261U;
+        for (char c : name) {
+            hash = (hash ^ (uint8_t) c) * 16777619U;
+        }
+        return hash;
+    }
 
-    string name1 = "John Doe";
-    string name2 = "Bob Smith";
-    string name3 = "Jane Doe";
+    const char* at(uint64_t offset) {
+        return this->chunks[offset / CHUNK_BYTES].load(memory_order_acquire) + offset % CHUNK_BYTES;
+    }
 
-    int customerId1 = branch1.openAccount(name1);
-    int customerId2 = branch1.openAccount(name2);
-    int customerId3 = branch2.openAccount(name3);
+    bool matches(uint32_t id, const string& name) {
+        const char* entry = this->at(this->offsets[id]);
+        uint32_t length;
+        memcpy(&length, entry, 4);
+        return length == name.size() && memcmp(entry + 4, name.data(), length) == 0;
+    }
 
-    branch1.deposit(customerId1, 100);
-    branch1.deposit(customerId2, 200);
-    branch2.deposit(customerId3, 300);
+    static void insert(vector<uint64_t>& table, uint64_t entry) {
+        size_t mask = table.size() - 1;
+        size_t slot = (entry >> 32) & mask;
+        while (table[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        table[slot] = entry;
+    }
 
-    branch1.withdraw(customerId1, 50);
+    void resize(size_t slots) {
+        vector<uint64_t> grown(slots, 0);
+        for (uint64_t entry : this->table) {
+            if (entry != 0) {
+                insert(grown, entry);
+            }
+        }
+        this->table.swap(grown);
+    }
 
-    bank.printTransactions();
-    /*  Possible Output:
-        Teller 1 opened account 0
-        Teller 2 opened account 1
-        Teller 3 opened account 2
-        Teller 1 deposited 100 to account 0
+public:
+    NameArena(long long capacity) : chunks(MAX_CHUNKS), used(0), offsets(capacity), count(0), table(1024, 0) {
+        for (atomic<char*>& chunk : this->chunks) {
+            chunk.store(nullptr, memory_order_relaxed);
+        }
+    }
+
+    ~NameArena() {
+        for (atomic<char*>& chunk : this->chunks) {
+            delete[] chunk.load();
+        }
+    }
+
+    NameArena(const NameArena&) = delete;
+    NameArena& operator=(const NameArena&) = delete;
+
+    // ID of name, storing it first if it is new
+    uint32_t intern(const string& name) {
+        uint32_t hash = hashOf(name);
+        size_t mask = this->table.size() - 1;
+        for (size_t slot = hash & mask; this->table[slot] != 0; slot = (slot + 1) & mask) {
+            uint64_t entry = this->table[slot];
+            uint32_t id = (uint32_t) entry - 1;
+            if (entry >> 32 == hash && this->matches(id, name)) {
+                return id;
+            }
+        }
+
+        size_t entryBytes = 4 + name.size();
+        if (entryBytes > CHUNK_BYTES) {
+            throw "Name is too long";
+        }
+        if (this->used % CHUNK_BYTES + entryBytes > CHUNK_BYTES) {
+            this->used += CHUNK_BYTES - this->used % CHUNK_BYTES;
+        }
+        atomic<char*>& chunk = this->chunks[this->used / CHUNK_BYTES];
+        if (chunk.load(memory_order_relaxed) == nullptr) {
+            chunk.store(new char[CHUNK_BYTES], memory_order_release);
+        }
+        char* entry = chunk.load(memory_order_relaxed) + this->used % CHUNK_BYTES;
+        uint32_t length = name.size();
+        memcpy(entry, &length, 4);
+        memcpy(entry + 4, name.data(), length);
+        uint32_t id = this->count++;
+        this->offsets[id] = this->used;
+        this->used += entryBytes;
+
+        if (this->count * 2 > this->table.size()) {
+            this->resize(this->table.size() * 2);
+        }
+        insert(this->table, (uint64_t) hash << 32 | (id + 1));
+        return id;
+    }
+
+    // Size the table for count distinct names up front
+    void reserve(size_t count) {
+        size_t slots = this->table.size();
+        while (slots < count * 2) {
+            slots *= 2;
+        }
+        if (slots != this->table.size()) {
+            this->resize(slots);
+        }
+    }
+
+    // Safe from any thread for an ID already handed out
+    string get(uint32_t id) {
+        const char* entry = this->at(this->offsets[id]);
+        uint32_t length;
+        memcpy(&length, entry, 4);
+        return string(entry + 4, length);
+    }
+
+    uint32_t getCount() {
+        return this->count;
+    }
+};
+
+// Accounts as columns indexed by customer ID: balances, the ledger row of
+// each account's last operation, its lock and its interned name. Balance
+// scans read one dense int64 array. The columns are reserved for capacity
+// accounts up front.
+class AccountStore {
+public:
+    static const long long MAX_ACCOUNTS = 1LL << 28;
+
+private:
+    long long capacity;
+    DenseArray<int64_t> balances;
+    DenseArray<int64_t> lastLsns;
+    DenseArray<AccountLock> locks;  // all-zero is an unlocked AccountLock
+    DenseArray<uint32_t> nameIds;
+    NameArena names;
+    atomic<long long> size;
+
+    static long long checkCapacity(long long capacity) {
+        if (capacity <= 0 || capacity > MAX_ACCOUNTS) {
+            throw "Invalid account capacity";
+        }
+        return capacity;
+    }
+
+public:
+    AccountStore(long long capacity)
+        : capacity(checkCapacity(capacity)), balances(capacity), lastLsns(capacity), locks(capacity),
+          nameIds(capacity), names(capacity), size(0) {}
+
+    AccountStore(const AccountStore&) = delete;
+    AccountStore& operator=(const AccountStore&) = delete;
+
+    // One appender at a time; the account is visible to readers on return
+    int add(const string& name, long long balance, long long lastLsn) {
+        long long customerId = this->size.load(memory_order_relaxed);
+        if (customerId == this->capacity) {
+            throw "Too many accounts";
+        }
+        this->balances[customerId] = balance;
+        this->lastLsns[customerId] = lastLsn;
+        this->nameIds[customerId] = this->names.intern(name);
+        this->size.store(customerId + 1, memory_order_release);
+        return customerId;
+    }
+
+    long long getSize() {
+        return this->size.load(memory_order_acquire);
+    }
+
+    long long getCapacity() {
+        return this->capacity;
+    }
+
+    // Prepare for count more accounts with distinct names
+    void reserve(long long count) {
+        this->names.reserve(this->names.getCount() + count);
+    }
+
+    // getSize() entries, indexed by customer ID
+    int64_t* getBalances() {
+        return this->balances.getData();
+    }
+
+    int64_t* getLastLsns() {
+        return this->lastLsns.getData();
+    }
+
+    AccountLock& getLock(int customerId) {
+        return this->locks[customerId];
+    }
+
+    string getName(int customerId) {
+        return this->names.get(this->nameIds[customerId]);
+    }
+
+    uint32_t getDistinctNameCount() {
+        return this->names.getCount();
+    }
+};
+
+// Handle to one account in an AccountStore: two words, cheap to copy, and
+// valid for as long as the store
+class BankAccount {
+private:
+    AccountStore* store;
+    int customerId;
+
+public:
+    BankAccount(AccountStore* store, int customerId) {
+        this->store = store;
+        this->customerId = customerId;
+    }
+
+    int getCustomerId() {
+        return this->customerId;
+    }
+
+    string getName() {
+        return this->store->getName(this->customerId);
+    }
+
+    // Guards balance; BankSystem holds it for the whole check-and-update of an operation
+    AccountLock& getLock() {
+        return this->store->getLock(this->customerId);
+    }
+
+    long long getBalance() {
+        return this->store->getBalances()[this->customerId];
+    }
+
+    void deposit(long long amount) {
+        this->store->getBalances()[this->customerId] += amount;
+    }
+
+    void withdraw(long long amount) {
+        this->store->getBalances()[this->customerId] -= amount;
+    }
+
+    // Ledger row of the last operation applied to balance
+    long long getLastLsn() {
+        return this->store->getLastLsns()[this->customerId];
+    }
+
+    void setLastLsn(long long lsn) {
+        this->store->getLastLsns()[this->customerId] = lsn;
+    }
+};
+
+// Decoded write-ahead log record. name is only set for OPEN_ACCOUNT.
+class LogRecord {
+public:
+    long long lsn;              // ledger row the operation was logged as
+    TransactionType type;
+    int customerId;
+    int counterpartyId;
+    int tellerId;
+    long long amount;
+    long long timestamp;
+    string name;                // name of an opened account, or the int64 deltas of an accrual
+};
+
+// Durable binary log of BankSystem operations. Each record is
+//   uint32 payload length | uint32 CRC-32C of payload | payload
+// and records from many threads are group-committed: one write + fdatasync
+// makes a whole batch durable.
+class WriteAheadLog {
+public:
+    enum DurabilityMode {
+        PER_OPERATION,  // every append is written and synced on its own
+        PER_BATCH,      // whatever queued up during the previous sync goes out in the next one
+        TIME_WINDOW,    // the flusher waits a fixed window to gather a bigger batch
+    };
+
+private:
+    static const size_t FIXED_PAYLOAD = 8 + 1 + 4 + 4 + 4 + 8 + 8;
+
+    int fd;
+    DurabilityMode mode;
+    chrono::microseconds window;
+    vector<char> pending;
+    long long appended;         // tickets handed out
+    long long durable;          // tickets known to be on disk
+    long long appendedBytes;    // file offset just past the last queued record
+    const char* failure;        // set once a write or sync fails; no later ticket becomes durable
+    bool closing;
+    mutex lock;
+    condition_variable flushNeeded;
+    condition_variable flushed;
+    thread flusher;
+
+    static void encode(vector<char>& out, LogRecord& record) {
+        uint32_t length = FIXED_PAYLOAD + record.name.size();
+        size_t start = out.size();
+        out.resize(start + 8 + length);
+        char* payload = out.data() + start + 8;
+        char* cursor = payload;
+        memcpy(cursor, &record.lsn, 8);
+        cursor += 8;
+        *cursor++ = (char) record.type;
+        memcpy(cursor, &record.customerId, 4);
+        cursor += 4;
+        memcpy(cursor, &record.counterpartyId, 4);
+        cursor += 4;
+        memcpy(cursor, &record.tellerId, 4);
+        cursor += 4;
+        memcpy(cursor, &record.amount, 8);
+        cursor += 8;
+        memcpy(cursor, &record.timestamp, 8);
+        cursor += 8;
+        memcpy(cursor, record.name.data(), record.name.size());
+        uint32_t crc = crc32c(payload, length);
+        memcpy(out.data() + start, &length, 4);
+        memcpy(out.data() + start + 4, &crc, 4);
+    }
+
+    void writeAndSync(vector<char>& batch) {
+        const char* data = batch.data();
+        size_t length = batch.size();
+        while (length > 0) {
+            ssize_t written = write(this->fd, data, length);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written < 0) {
+                throw "Could not write the write-ahead log";
+            }
+            data += written;
+            length -= written;
+        }
+        if (fdatasync(this->fd) != 0) {
+            throw "Could not sync the write-ahead log";
+        }
+    }
+
+    // After a failed write or sync the file's contents are unknown, so the
+    // log fails every waiting and later ticket instead of retrying
+    void fail(const char* error) {
+        if (this->failure == nullptr) {
+            this->failure = error;
+        }
+        this->flushed.notify_all();
+    }
+
+    void runFlusher() {
+        try {
+            this->flushBatches();
+        } catch (const char* error) {
+            lock_guard<mutex> guard(this->lock);
+            this->fail(error);
+        } catch (...) {
+            lock_guard<mutex> guard(this->lock);
+            this->fail("Write-ahead log flusher failed");
+        }
+    }
+
+    void flushBatches() {
+        vector<char> batch;
+        unique_lock<mutex> guard(this->lock);
+        while (true) {
+            this->flushNeeded.wait(guard, [this]() { return this->closing || this->appended > this->durable; });
+            if (this->appended == this->durable && this->closing) {
+                return;
+            }
+            if (this->mode == TIME_WINDOW && !this->closing) {
+                guard.unlock();
+                this_thread::sleep_for(this->window);
+                guard.lock();
+            }
+            batch.swap(this->pending);
+            long long ticket = this->appended;
+            guard.unlock();
+            this->writeAndSync(batch);
+            batch.clear();
+            guard.lock();
+            this->durable = ticket;
+            this->flushed.notify_all();
+        }
+    }
+
+    // The SSE4.2 crc32 instruction, 8 bytes at a time
+    __attribute__((target("sse4.2"))) static uint32_t crc32cHardware(const char* data, size_t length) {
+        uint64_t crc = 0xFFFFFFFF;
+        for (; length >= 8; data += 8, length -= 8) {
+            uint64_t word;
+            memcpy(&word, data, 8);
+            crc = __builtin_ia32_crc32di(crc, word);
+        }
+        for (; length > 0; data++, length--) {
+            crc = __builtin_ia32_crc32qi(crc, *data);
+        }
+        return crc ^ 0xFFFFFFFF;
+    }
+
+public:
+    static uint32_t crc32c(const char* data, size_t length) {
+        static const bool hasSse42 = __builtin_cpu_supports("sse4.2");
+        if (hasSse42) {
+            return crc32cHardware(data, length);
+        }
+        static const vector<uint32_t> table = []() {
+            vector<uint32_t> values(256);
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t value = i;
+                for (int bit = 0; bit < 8; bit++) {
+                    value = (value >> 1) ^ (0x82F63B78 & (0 - (value & 1)));
+                }
+                values[i] = value;
+            }
+            return values;
+        }();
+        uint32_t crc = 0xFFFFFFFF;
+        for (size_t i = 0; i < length; i++) {
+            crc = table[(crc ^ (uint8_t) data[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFF;
+    }
+
+    WriteAheadLog(string path, DurabilityMode mode, int windowMicros) {
+        this->fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (this->fd < 0) {
+            throw "Could not open the write-ahead log";
+        }
+        this->mode = mode;
+        this->window = chrono::microseconds(windowMicros);
+        this->appended = 0;
+        this->durable = 0;
+        this->appendedBytes = lseek(this->fd, 0, SEEK_END);
+        this->failure = nullptr;
+        this->closing = false;
+        if (mode != PER_OPERATION) {
+            this->flusher = thread([this]() { this->runFlusher(); });
+        }
+    }
+
+    ~WriteAheadLog() {
+        {
+            lock_guard<mutex> guard(this->lock);
+            this->closing = true;
+        }
+        this->flushNeeded.notify_one();
+        if (this->flusher.joinable()) {
+            this->flusher.join();
+        }
+        close(this->fd);
+    }
+
+    // Queue a record; returns a ticket to wait on. Appends made in order by one
+    // thread (or under one account lock) reach the file in that order.
+    long long append(LogRecord& record) {
+        return this->append(&record, 1);
+    }
+
+    // Queue several records under one lock acquisition; the returned ticket
+    // covers all of them
+    long long append(LogRecord* records, size_t count) {
+        lock_guard<mutex> guard(this->lock);
+        size_t before = this->pending.size();
+        for (size_t i = 0; i < count; i++) {
+            encode(this->pending, records[i]);
+        }
+        this->appendedBytes += this->pending.size() - before;
+        long long ticket = ++this->appended;
+        if (this->mode == PER_OPERATION) {
+            try {
+                if (this->failure == nullptr) {
+                    this->writeAndSync(this->pending);
+                    this->durable = ticket;
+                }
+            } catch (const char* error) {
+                this->fail(error);
+            }
+            this->pending.clear();
+        } else {
+            this->flushNeeded.notify_one();
+        }
+        return ticket;
+    }
+
+    // Every record queued after this call lands at or beyond the returned offset
+    long long getAppendedBytes() {
+        lock_guard<mutex> guard(this->lock);
+        return this->appendedBytes;
+    }
+
+    // Throws if the log failed before the ticket was durable
+    void waitDurable(long long ticket) {
+        unique_lock<mutex> guard(this->lock);
+        this->flushed.wait(guard, [this, ticket]() { return this->durable >= ticket || this->failure != nullptr; });
+        if (this->durable < ticket) {
+            throw this->failure;
+        }
+    }
+
+    // Decode every intact record of the log at path, in file order. A torn or
+    // corrupt tail is cut off so that new appends follow the last good record.
+    static long long read(string path, function<void(LogRecord&)> visit) {
+        return read(path, 0, visit);
+    }
+
+    // Same, starting at a record boundary such as one from getAppendedBytes
+    static long long read(string path, long long fromOffset, function<void(LogRecord&)> visit) {
+        int fd = open(path.c_str(), O_RDWR);
+        if (fd < 0) {
+            return 0;
+        }
+        struct stat status;
+        if (fstat(fd, &status) != 0) {
+            close(fd);
+            throw "Could not read the write-ahead log";
+        }
+        long long end = status.st_size;
+
+        // Decode a buffer at a time; a record cut off by the end of one
+        // buffer is moved to the front of the next
+        vector<char> data(1 << 20);
+        size_t filled = 0;
+        long long position = fromOffset;    // file offset of data[0]
+        long long count = 0;
+        while (position + (long long) filled < end) {
+            size_t want = min(data.size() - filled, (size_t) (end - position - filled));
+            ssize_t bytes = pread(fd, data.data() + filled, want, position + filled);
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes < 0) {
+                close(fd);
+                throw "Could not read the write-ahead log";
+            }
+            if (bytes == 0) {
+                break;
+            }
+            filled += bytes;
+            size_t offset = 0;
+            uint32_t length = 0;
+            bool intact = true;
+            while (offset + 8 <= filled) {
+                uint32_t crc;
+                memcpy(&length, data.data() + offset, 4);
+                memcpy(&crc, data.data() + offset + 4, 4);
+                if (length < FIXED_PAYLOAD || position + (long long) (offset + 8 + length) > end) {
+                    intact = false;
+                    break;
+                }
+                if (offset + 8 + length > filled) {
+                    break;
+                }
+                if (crc32c(data.data() + offset + 8, length) != crc) {
+                    intact = false;
+                    break;
+                }
+                const char* cursor = data.data() + offset + 8;
+                LogRecord record;
+                memcpy(&record.lsn, cursor, 8);
+                record.type = (TransactionType) cursor[8];
+                memcpy(&record.customerId, cursor + 9, 4);
+                memcpy(&record.counterpartyId, cursor + 13, 4);
+                memcpy(&record.tellerId, cursor + 17, 4);
+                memcpy(&record.amount, cursor + 21, 8);
+                memcpy(&record.timestamp, cursor + 29, 8);
+                record.name = string(cursor + FIXED_PAYLOAD, length - FIXED_PAYLOAD);
+                visit(record);
+                offset += 8 + length;
+                count++;
+            }
+            position += offset;
+            if (!intact) {
+                break;
+            }
+            memmove(data.data(), data.data() + offset, filled - offset);
+            filled -= offset;
+            if (filled >= 8 && 8 + length > data.size()) {
+                // A record bigger than the buffer, and within the file
+                data.resize(8 + length);
+            }
+        }
+        // Whatever follows position is torn or corrupt
+        if (position < end && ftruncate(fd, position) != 0) {
+            close(fd);
+            throw "Could not truncate the write-ahead log";
+        }
+        close(fd);
+        return count;
+    }
+};
+
+// Committed state of a checkpoint. Two copies alternate in the file so a
+// torn header write always leaves the previous one intact.
+class CheckpointHeader {
+public:
+    char magic[8];
+    uint64_t sequence;
+    long long accountCount;
+    long long walOffset;        // replay the log from here on restart
+    long long nextLsn;          // ledger row numbering continues from here; teller volumes count the rows before it
+    long long namesBytes;       // valid prefix of the names file
+    long long tellerCount;      // slots in this sequence's teller volume region
+    uint32_t crc;
+};
+
+// Balance of one account as of its lastLsn
+class AccountSlot {
+public:
+    long long balance;
+    long long lastLsn;
+};
+
+// Volume of one teller that has posted anything
+class TellerSlot {
+public:
+    int tellerId;
+    long long operations;
+    long long amount;
+};
+
+// On-disk checkpoint of account balances: the header, then one fixed slot per
+// account, overwritten in place by incremental checkpoints. Names never change,
+// so they live in an append-only file next to it. Teller volumes are few and
+// rewritten whole, into the region of a third file matching the sequence's
+// parity, so the committed region is never overwritten.
+class CheckpointStore {
+public:
+    static const int HEADER_COPY_BYTES = 512;
+    static const int SLOTS_OFFSET = 4096;
+    static const long long TELLER_REGION_BYTES = 1LL << 27;
+
+private:
+    int fd;
+    int namesFd;
+    int tellersFd;
+    CheckpointHeader header;
+
+    static uint32_t checksum(CheckpointHeader& header) {
+        return WriteAheadLog::crc32c((const char*) &header, offsetof(CheckpointHeader, crc));
+    }
+
+    static void writeFully(int fd, const char* data, size_t length, long long offset) {
+        while (length > 0) {
+            ssize_t written = pwrite(fd, data, length, offset);
+            if (written < 0) {
+                throw "Could not write the checkpoint";
+            }
+            data += written;
+            length -= written;
+            offset += written;
+        }
+    }
+
+public:
+    CheckpointStore(string path) {
+        this->fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        this->namesFd = open((path + ".names").c_str(), O_RDWR | O_CREAT, 0644);
+        this->tellersFd = open((path + ".tellers").c_str(), O_RDWR | O_CREAT, 0644);
+        if (this->fd < 0 || this->namesFd < 0 || this->tellersFd < 0) {
+            throw "Could not open the checkpoint";
+        }
+        memset(&this->header, 0, sizeof(CheckpointHeader));
+        for (int copy = 0; copy < 2; copy++) {
+            CheckpointHeader candidate;
+            if (pread(this->fd, &candidate, sizeof(CheckpointHeader), copy * HEADER_COPY_BYTES)
+                    == sizeof(CheckpointHeader)
+                && memcmp(candidate.magic, "BANKCKPT", 8) == 0 && candidate.crc == checksum(candidate)
+                && candidate.sequence > this->header.sequence) {
+                this->header = candidate;
+            }
+        }
+    }
+
+    ~CheckpointStore() {
+        close(this->fd);
+        close(this->namesFd);
+        close(this->tellersFd);
+    }
+
+    CheckpointStore(const CheckpointStore&) = delete;
+    CheckpointStore& operator=(const CheckpointStore&) = delete;
+
+    // Latest committed checkpoint; all zero if there is none yet
+    CheckpointHeader getHeader() {
+        return this->header;
+    }
+
+    void writeSlots(long long firstAccount, AccountSlot* slots, int count) {
+        writeFully(this->fd, (const char*) slots, count * sizeof(AccountSlot),
+                   SLOTS_OFFSET + firstAccount * sizeof(AccountSlot));
+    }
+
+    // Write names after the committed prefix; returns the new prefix length
+    long long appendNames(vector<char>& names) {
+        writeFully(this->namesFd, names.data(), names.size(), this->header.namesBytes);
+        return this->header.namesBytes + names.size();
+    }
+
+    // Write the teller volumes the next commit will point to
+    void writeTellers(vector<TellerSlot>& tellers) {
+        writeFully(this->tellersFd, (const char*) tellers.data(), tellers.size() * sizeof(TellerSlot),
+                   ((this->header.sequence + 1) % 2) * TELLER_REGION_BYTES);
+    }
+
+    // The committed teller volumes
+    vector<TellerSlot> readTellers() {
+        vector<TellerSlot> tellers(this->header.tellerCount);
+        size_t bytes = tellers.size() * sizeof(TellerSlot);
+        if (bytes > 0 && pread(this->tellersFd, tellers.data(), bytes, (this->header.sequence % 2) * TELLER_REGION_BYTES)
+                             != (ssize_t) bytes) {
+            throw "Could not read the checkpoint";
+        }
+        return tellers;
+    }
+
+    // Make everything written so far durable, then switch to the new header.
+    // If a sync fails the previous header stays the committed one.
+    void commit(CheckpointHeader next) {
+        memcpy(next.magic, "BANKCKPT", 8);
+        next.sequence = this->header.sequence + 1;
+        next.crc = checksum(next);
+        if (fdatasync(this->namesFd) != 0 || fdatasync(this->tellersFd) != 0 || fdatasync(this->fd) != 0) {
+            throw "Could not sync the checkpoint";
+        }
+        writeFully(this->fd, (const char*) &next, sizeof(CheckpointHeader),
+                   (next.sequence % 2) * HEADER_COPY_BYTES);
+        if (fdatasync(this->fd) != 0) {
+            throw "Could not sync the checkpoint";
+        }
+        this->header = next;
+    }
+
+    // Map the committed slots and names read-only and hand them to load
+    void map(function<void(const AccountSlot*, const char*)> load) {
+        size_t slotsBytes = SLOTS_OFFSET + this->header.accountCount * sizeof(AccountSlot);
+        size_t namesBytes = this->header.namesBytes;
+        char* slots = (char*) mmap(nullptr, slotsBytes, PROT_READ, MAP_SHARED, this->fd, 0);
+        char* names = namesBytes == 0 ? nullptr
+                                      : (char*) mmap(nullptr, namesBytes, PROT_READ, MAP_SHARED, this->namesFd, 0);
+        if (slots == MAP_FAILED || names == MAP_FAILED) {
+            throw "Could not map the checkpoint";
+        }
+        madvise(slots, slotsBytes, MADV_SEQUENTIAL);
+        if (names != nullptr) {
+            madvise(names, namesBytes, MADV_SEQUENTIAL);
+        }
+        load((const AccountSlot*) (slots + SLOTS_OFFSET), names);
+        munmap(slots, slotsBytes);
+        if (names != nullptr) {
+            munmap(names, namesBytes);
+        }
+    }
+};
+
+// Where one block of a ledger archive is and which rows it holds
+class ArchiveBlock {
+public:
+    long long firstRow;
+    long long rowCount;
+    long long minTimestamp;
+    long long maxTimestamp;
+    long long offset;
+    uint32_t bytes;
+    uint32_t crc;               // CRC-32C of the block's bytes
+};
+
+// Streams ledger rows into a compact binary archive:
+//   "BANKARCH" | blocks | footer | uint64 footer offset | "BANKARCH"
+// A block holds up to BLOCK_ROWS rows column by column (type, customer,
+// counterparty, teller, amount, timestamp). Each value is stored as the
+// zigzag varint of its difference from the previous row's, so timestamps and
+// clustered IDs take a byte or two. The footer lists every ArchiveBlock and a
+// CRC of the list. Only one block is held in memory, whatever the ledger size.
+class LedgerArchiveWriter {
+public:
+    static const int BLOCK_ROWS = 1 << 16;
+    static const int COLUMNS = 6;
+
+private:
+    int fd;
+    long long offset;
+    long long rowCount;
+    vector<int64_t> columns[COLUMNS];
+    int used;
+    vector<char> encoded;
+    vector<ArchiveBlock> blocks;
+
+    static char* putVarint(char* out, uint64_t value) {
+        while (value >= 0x80) {
+            *out++ = (char) (value | 0x80);
+            value >>= 7;
+        }
+        *out++ = (char) value;
+        return out;
+    }
+
+    void writeAll(const char* data, size_t length) {
+        TransactionRenderer::writeAll(this->fd, data, length);
+        this->offset += length;
+    }
+
+    // Block layout: uint32 row count, uint32 byte length of each column, columns
+    void flushBlock() {
+        if (this->used == 0) {
+            return;
+        }
+        size_t headerBytes = 4 * (1 + COLUMNS);
+        this->encoded.resize(headerBytes + (size_t) COLUMNS * this->used * 10);
+        char* cursor = this->encoded.data() + headerBytes;
+        uint32_t lengths[1 + COLUMNS];
+        lengths[0] = this->used;
+        for (int column = 0; column < COLUMNS; column++) {
+            char* start = cursor;
+            const int64_t* values = this->columns[column].data();
+            int64_t previous = 0;
+            for (int i = 0; i < this->used; i++) {
+                uint64_t delta = (uint64_t) values[i] - (uint64_t) previous;
+                cursor = putVarint(cursor, (delta << 1) ^ (uint64_t) ((int64_t) delta >> 63));
+                previous = values[i];
+            }
+            lengths[1 + column] = cursor - start;
+        }
+        memcpy(this->encoded.data(), lengths, headerBytes);
+
+        const int64_t* timestamps = this->columns[COLUMNS - 1].data();
+        ArchiveBlock block;
+        block.firstRow = this->rowCount - this->used;
+        block.rowCount = this->used;
+        block.minTimestamp = *min_element(timestamps, timestamps + this->used);
+        block.maxTimestamp = *max_element(timestamps, timestamps + this->used);
+        block.offset = this->offset;
+        block.bytes = cursor - this->encoded.data();
+        block.crc = WriteAheadLog::crc32c(this->encoded.data(), block.bytes);
+        this->writeAll(this->encoded.data(), block.bytes);
+        this->blocks.push_back(block);
+        this->used = 0;
+    }
+
+public:
+    LedgerArchiveWriter(int fd) {
+        this->fd = fd;
+        this->offset = 0;
+        this->rowCount = 0;
+        this->used = 0;
+        for (vector<int64_t>& column : this->columns) {
+            column.resize(BLOCK_ROWS);
+        }
+        this->writeAll("BANKARCH", 8);
+    }
+
+    void add(TransactionType type, int customerId, int counterpartyId, int tellerId, long long amount,
+             long long timestamp) {
+        this->columns[0][this->used] = type;
+        this->columns[1][this->used] = customerId;
+        this->columns[2][this->used] = counterpartyId;
+        this->columns[3][this->used] = tellerId;
+        this->columns[4][this->used] = amount;
+        this->columns[5][this->used] = timestamp;
+        this->used++;
+        this->rowCount++;
+        if (this->used == BLOCK_ROWS) {
+            this->flushBlock();
+        }
+    }
+
+    template <typename View>
+    void addAll(View view) {
+        for (TransactionRow row : view) {
+            this->add(row.getType(), row.getCustomerId(), row.getCounterpartyId(), row.getTellerId(), row.getAmount(),
+                      row.getTimestamp());
+        }
+    }
+
+    // Write the last block and the footer; returns the archive's size in bytes
+    long long finish() {
+        this->flushBlock();
+        long long footerOffset = this->offset;
+        uint32_t blockCount = this->blocks.size();
+        uint32_t crc = WriteAheadLog::crc32c((const char*) this->blocks.data(), blockCount * sizeof(ArchiveBlock));
+        this->writeAll((const char*) &blockCount, 4);
+        this->writeAll((const char*) this->blocks.data(), blockCount * sizeof(ArchiveBlock));
+        this->writeAll((const char*) &crc, 4);
+        this->writeAll((const char*) &footerOffset, 8);
+        this->writeAll("BANKARCH", 8);
+        return this->offset;
+    }
+
+    long long getRowCount() {
+        return this->rowCount;
+    }
+};
+
+// Reads an archive written by LedgerArchiveWriter. Only the footer is loaded
+// up front; a time-range read fetches and decodes just the blocks whose
+// timestamps overlap the range, one at a time.
+class LedgerArchiveReader {
+private:
+    int fd;
+    vector<ArchiveBlock> blocks;
+
+    static const char* getVarint(const char* in, uint64_t& value) {
+        value = 0;
+        for (int shift = 0;; shift += 7) {
+            uint8_t byte = *in++;
+            value |= (uint64_t) (byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                return in;
+            }
+        }
+    }
+
+    void readFully(char* data, size_t length, long long offset) {
+        while (length > 0) {
+            ssize_t bytes = pread(this->fd, data, length, offset);
+            if (bytes <= 0) {
+                throw "Could not read the ledger archive";
+            }
+            data += bytes;
+            length -= bytes;
+            offset += bytes;
+        }
+    }
+
+public:
+    LedgerArchiveReader(string path) {
+        this->fd = open(path.c_str(), O_RDONLY);
+        if (this->fd < 0) {
+            throw "Could not open the ledger archive";
+        }
+        long long size = lseek(this->fd, 0, SEEK_END);
+        char trailer[16];
+        long long footerOffset = 0;
+        uint32_t blockCount = 0;
+        if (size >= 8 + 4 + 4 + 16) {
+            this->readFully(trailer, 16, size - 16);
+            memcpy(&footerOffset, trailer, 8);
+        }
+        if (size < 8 + 4 + 4 + 16 || memcmp(trailer + 8, "BANKARCH", 8) != 0 || footerOffset < 8
+            || footerOffset > size - 24) {
+            close(this->fd);
+            throw "Invalid ledger archive";
+        }
+        this->readFully((char*) &blockCount, 4, footerOffset);
+        if ((long long) (blockCount * sizeof(ArchiveBlock)) != size - 24 - footerOffset) {
+            close(this->fd);
+            throw "Invalid ledger archive";
+        }
+        this->blocks.resize(blockCount);
+        uint32_t crc;
+        this->readFully((char*) this->blocks.data(), blockCount * sizeof(ArchiveBlock), footerOffset + 4);
+        this->readFully((char*) &crc, 4, footerOffset + 4 + blockCount * sizeof(ArchiveBlock));
+        if (crc != WriteAheadLog::crc32c((const char*) this->blocks.data(), blockCount * sizeof(ArchiveBlock))) {
+            close(this->fd);
+            throw "Invalid ledger archive";
+        }
+    }
+
+    ~LedgerArchiveReader() {
+        close(this->fd);
+    }
+
+    LedgerArchiveReader(const LedgerArchiveReader&) = delete;
+    LedgerArchiveReader& operator=(const LedgerArchiveReader&) = delete;
+
+    long long getRowCount() {
+        return this->blocks.empty() ? 0 : this->blocks.back().firstRow + this->blocks.back().rowCount;
+    }
+
+    long long getBlockCount() {
+        return this->blocks.size();
+    }
+
+    // Visit every row with from <= timestamp <= to, in archive order; the
+    // record's lsn is the row's position in the archive. Returns the number
+    // of rows visited.
+    long long read(long long from, long long to, function<void(LogRecord&)> visit) {
+        const int COLUMNS = LedgerArchiveWriter::COLUMNS;
+        vector<char> encoded;
+        vector<int64_t> columns[COLUMNS];
+        LogRecord record;
+        long long visited = 0;
+        for (ArchiveBlock& block : this->blocks) {
+            if (block.maxTimestamp < from || block.minTimestamp > to) {
+                continue;
+            }
+            encoded.resize(block.bytes);
+            this->readFully(encoded.data(), block.bytes, block.offset);
+            uint32_t lengths[1 + COLUMNS];
+            size_t headerBytes = sizeof(lengths);
+            if (block.bytes < headerBytes || WriteAheadLog::crc32c(encoded.data(), block.bytes) != block.crc) {
+                throw "Corrupt ledger archive block";
+            }
+            memcpy(lengths, encoded.data(), headerBytes);
+            size_t columnBytes = 0;
+            for (int column = 0; column < COLUMNS; column++) {
+                columnBytes += lengths[1 + column];
+            }
+            if (lengths[0] != block.rowCount || headerBytes + columnBytes != block.bytes) {
+                throw "Corrupt ledger archive block";
+            }
+            const char* cursor = encoded.data() + headerBytes;
+            for (int column = 0; column < COLUMNS; column++) {
+                columns[column].resize(block.rowCount);
+                int64_t previous = 0;
+                for (long long i = 0; i < block.rowCount; i++) {
+                    uint64_t zigzag;
+                    cursor = getVarint(cursor, zigzag);
+                    previous += (int64_t) ((zigzag >> 1) ^ -(zigzag & 1));
+                    columns[column][i] = previous;
+                }
+            }
+            for (long long i = 0; i < block.rowCount; i++) {
+                long long timestamp = columns[5][i];
+                if (timestamp < from || timestamp > to) {
+                    continue;
+                }
+                record.lsn = block.firstRow + i;
+                record.type = (TransactionType) columns[0][i];
+                record.customerId = columns[1][i];
+                record.counterpartyId = columns[2][i];
+                record.tellerId = columns[3][i];
+                record.amount = columns[4][i];
+                record.timestamp = timestamp;
+                visit(record);
+                visited++;
+            }
+        }
+        return visited;
+    }
+};
+
+// One line of an end-of-day posting file: a positive amount is a deposit,
+// a negative one a withdrawal
+class Posting {
+public:
+    int customerId;
+    int tellerId;
+    int amount;
+};
+
+// A whole-bank job such as interest or fees: the change to each balance,
+// computed a batch of accounts at a time
+class BalanceJob {
+public:
+    virtual ~BalanceJob() {}
+
+    // deltas[i] for balances[i], i < count. A delta must not take its
+    // balance below zero.
+    virtual void computeDeltas(const int64_t* balances, int64_t* deltas, int count) const = 0;
+};
+
+// Four int64 lanes (GCC/Clang vector extension): one AVX2 register, or two
+// SSE2 registers on CPUs without AVX2
+typedef int64_t Int64x4 __attribute__((vector_size(32)));
+typedef uint64_t Uint64x4 __attribute__((vector_size(32)));
+
+// Interest by balance tier plus a flat fee below a minimum balance, all in
+// fixed point: a rate is the fraction per period scaled by 2^32, interest is
+// balance * rate >> 32 rounded down, and a fee never exceeds the balance.
+class RateSchedule : public BalanceJob {
+private:
+    static const int MAX_TIERS = 4;
+    int tierCount;
+    int64_t minimumBalances[MAX_TIERS];     // ascending; unused tiers are INT64_MAX
+    uint64_t rates[MAX_TIERS];
+    int64_t feeBelow;
+    int64_t fee;
+
+    // Four accounts per step. Inlined into accrueAvx2 it compiles to AVX2;
+    // called directly, to whatever the build targets (SSE2 at least on x86-64).
+    __attribute__((always_inline)) inline void accrue(const int64_t* balances, int64_t* deltas, int count) const {
+        int i = 0;
+        for (; i + 4 <= count; i += 4) {
+            Int64x4 balance;
+            memcpy(&balance, balances + i, sizeof(balance));
+            Uint64x4 rate = (Uint64x4) {} + this->rates[0];
+            for (int t = 1; t < MAX_TIERS; t++) {
+                rate = balance >= this->minimumBalances[t] ? (Uint64x4) {} + this->rates[t] : rate;
+            }
+            // balance * rate >> 32 as two 32x32-bit products, so no lane overflows
+            Uint64x4 positive = (Uint64x4) (balance > 0 ? balance : 0);
+            Uint64x4 interest = (positive >> 32) * rate + (((positive & 0xffffffff) * rate) >> 32);
+            Int64x4 delta = (Int64x4) interest - (balance < this->feeBelow ? this->fee : 0);
+            Int64x4 floor = -(Int64x4) positive;
+            delta = delta < floor ? floor : delta;
+            memcpy(deltas + i, &delta, sizeof(delta));
+        }
+        for (; i < count; i++) {
+            int64_t balance = balances[i];
+            uint64_t rate = this->rates[0];
+            for (int t = 1; t < MAX_TIERS; t++) {
+                rate = balance >= this->minimumBalances[t] ? this->rates[t] : rate;
+            }
+            uint64_t positive = balance > 0 ? balance : 0;
+            int64_t delta = (positive >> 32) * rate + (((positive & 0xffffffff) * rate) >> 32);
+            delta -= balance < this->feeBelow ? this->fee : 0;
+            deltas[i] = max(delta, -(int64_t) positive);
+        }
+    }
+
+    __attribute__((target("avx2"))) void accrueAvx2(const int64_t* balances, int64_t* deltas, int count) const {
+        this->accrue(balances, deltas, count);
+    }
+
+public:
+    RateSchedule() {
+        this->tierCount = 1;
+        this->minimumBalances[0] = INT64_MIN;
+        this->rates[0] = 0;
+        for (int t = 1; t < MAX_TIERS; t++) {
+            this->minimumBalances[t] = INT64_MAX;
+            this->rates[t] = 0;
+        }
+        this->feeBelow = INT64_MIN;
+        this->fee = 0;
+    }
+
+    // Balances of at least minimumBalance earn rate (e.g. 0.0001 per
+    // period) up to the next tier's minimum; add tiers in ascending order
+    void addTier(long long minimumBalance, double rate) {
+        if (rate < 0 || rate >= 1) {
+            throw "Rate must be in [0, 1)";
+        }
+        if (minimumBalance <= 0) {
+            this->rates[0] = llround(rate * 4294967296.0);
+            return;
+        }
+        if (this->tierCount == MAX_TIERS || minimumBalance <= this->minimumBalances[this->tierCount - 1]) {
+            throw "Invalid tier";
+        }
+        this->minimumBalances[this->tierCount] = minimumBalance;
+        this->rates[this->tierCount] = llround(rate * 4294967296.0);
+        this->tierCount++;
+    }
+
+    // Charge fee to balances below belowBalance
+    void setFee(long long belowBalance, long long fee) {
+        if (fee < 0) {
+            throw "Fee must not be negative";
+        }
+        this->feeBelow = belowBalance;
+        this->fee = fee;
+    }
+
+    void computeDeltas(const int64_t* balances, int64_t* deltas, int count) const override {
+        static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+        if (hasAvx2) {
+            this->accrueAvx2(balances, deltas, count);
+        } else {
+            this->accrue(balances, deltas, count);
+        }
+    }
+};
+
+// What runBatchJob did: the ledger row of each batch, and every account's
+// delta as one column indexed by customer ID
+class BatchJobResult {
+public:
+    vector<long long> rows;         // batch b covers customers b * BankSystem::JOB_BATCH onwards
+    vector<int64_t> deltas;
+    long long netDelta;
+};
+
+// Client-chosen identity of one request (e.g. a random UUID), so a retry can
+// be recognised
+class IdempotencyKey {
+public:
+    uint64_t high;
+    uint64_t low;
+};
+
+// Recently used idempotency keys, forgotten timeToLive after use. Keys are
+// spread over SHARDS shards, each with its own lock, by their bits. A shard
+// is an open-addressed array of cache-line buckets of BUCKET_KEYS keys; a
+// key lives in its home bucket or the next one, so a lookup touches one or
+// two cache lines. The table never grows: when both buckets are full of live
+// keys, the one closest to expiring is evicted (and counted).
+class IdempotencyTable {
+public:
+    static const int SHARDS = 64;
+    static const int BUCKET_KEYS = 3;
+
+private:
+    class alignas(64) Bucket {
+    public:
+        uint64_t keys[BUCKET_KEYS][2];
+        uint32_t expiries[BUCKET_KEYS];     // milliseconds since the shard's epoch + 1; 0 if never used
+    };
+
+    class alignas(64) Shard {
+    public:
+        AccountLock lock;
+        Bucket* buckets;
+        long long epoch;                    // moved forward before expiries overflow
+        atomic<long long> hits;             // written under the lock, read without it
+        atomic<long long> misses;
+        atomic<long long> evictions;
+
+        static void count(atomic<long long>& counter) {
+            counter.store(counter.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        }
+    };
+
+    vector<Shard> shards;
+    DenseArray<Bucket> buckets;     // each shard's in turn
+    size_t bucketMask;
+    uint32_t timeToLiveMillis;
+
+    // Milliseconds since the shard's epoch + 1 at now. When a new expiry
+    // would no longer fit in 32 bits, the epoch moves up to now and every
+    // expiry in the shard is shifted down with it; call with the lock held.
+    uint32_t millisAt(Shard& shard, long long now) {
+        long long millis = max(now - shard.epoch, 0LL) / 1000 + 1;
+        if (millis + this->timeToLiveMillis <= UINT32_MAX) {
+            return millis;
+        }
+        uint32_t shift = millis - 1;
+        for (size_t i = 0; i <= this->bucketMask; i++) {
+            for (uint32_t& expiry : shard.buckets[i].expiries) {
+                expiry = expiry > shift ? expiry - shift : 0;
+            }
+        }
+        shard.epoch += (long long) shift * 1000;
+        return 1;
+    }
+
+    static uint64_t hashOf(IdempotencyKey key) {
+        return (key.high ^ (key.low >> 1 | key.low << 63)) * 0x9E3779B97F4A7C15ULL;
+    }
+
+    static long long bucketsPerShard(long long capacity) {
+        long long buckets = 1;
+        while (buckets * SHARDS * BUCKET_KEYS < capacity) {
+            buckets *= 2;
+        }
+        return buckets;
+    }
+
+public:
+    // Room for at least capacity keys; timeToLiveMicros must be under 49 days.
+    // Lookups land anywhere in the table, so it asks for huge pages to keep
+    // TLB misses down.
+    IdempotencyTable(long long capacity, long long timeToLiveMicros)
+        : shards(SHARDS), buckets(SHARDS * bucketsPerShard(capacity)) {
+        long long buckets = bucketsPerShard(capacity);
+        this->buckets.advise(MADV_HUGEPAGE);
+        long long epoch = TransactionLedger::now();
+        for (int i = 0; i < SHARDS; i++) {
+            Shard& shard = this->shards[i];
+            shard.buckets = this->buckets.getData() + i * buckets;
+            shard.epoch = epoch;
+            shard.hits = 0;
+            shard.misses = 0;
+            shard.evictions = 0;
+        }
+        this->bucketMask = buckets - 1;
+        this->timeToLiveMillis = timeToLiveMicros / 1000;
+    }
+
+    // Record key as used at now (as TransactionLedger::now()). Returns false,
+    // a hit, if it was already used within the time to live.
+    bool claim(IdempotencyKey key, long long now) {
+        uint64_t hash = hashOf(key);
+        Shard& shard = this->shards[hash >> 58];
+        size_t home = hash & this->bucketMask;
+        lock_guard<AccountLock> guard(shard.lock);
+        uint32_t current = this->millisAt(shard, now);
+        Bucket* victimBucket = nullptr;
+        int victim = 0;
+        for (int probe = 0; probe < 2; probe++) {
+            Bucket& bucket = shard.buckets[(home + probe) & this->bucketMask];
+            for (int i = 0; i < BUCKET_KEYS; i++) {
+                if (bucket.expiries[i] > current && bucket.keys[i][0] == key.high && bucket.keys[i][1] == key.low) {
+                    Shard::count(shard.hits);
+                    return false;
+                }
+                if (victimBucket == nullptr || bucket.expiries[i] < victimBucket->expiries[victim]) {
+                    victimBucket = &bucket;
+                    victim = i;
+                }
+            }
+        }
+        if (victimBucket->expiries[victim] > current) {
+            Shard::count(shard.evictions);
+        }
+        victimBucket->keys[victim][0] = key.high;
+        victimBucket->keys[victim][1] = key.low;
+        victimBucket->expiries[victim] = current + this->timeToLiveMillis;
+        Shard::count(shard.misses);
+        return true;
+    }
+
+    // Forget key, so the operation it was claimed for can be retried
+    void release(IdempotencyKey key) {
+        uint64_t hash = hashOf(key);
+        Shard& shard = this->shards[hash >> 58];
+        size_t home = hash & this->bucketMask;
+        lock_guard<AccountLock> guard(shard.lock);
+        for (int probe = 0; probe < 2; probe++) {
+            Bucket& bucket = shard.buckets[(home + probe) & this->bucketMask];
+            for (int i = 0; i < BUCKET_KEYS; i++) {
+                if (bucket.keys[i][0] == key.high && bucket.keys[i][1] == key.low) {
+                    bucket.expiries[i] = 0;
+                }
+            }
+        }
+    }
+
+    // Requests seen again within the time to live
+    long long getHits() {
+        long long hits = 0;
+        for (Shard& shard : this->shards) {
+            hits += shard.hits.load(memory_order_relaxed);
+        }
+        return hits;
+    }
+
+    // Requests seen for the first time
+    long long getMisses() {
+        long long misses = 0;
+        for (Shard& shard : this->shards) {
+            misses += shard.misses.load(memory_order_relaxed);
+        }
+        return misses;
+    }
+
+    // Live keys pushed out early because their buckets were full
+    long long getEvictions() {
+        long long evictions = 0;
+        for (Shard& shard : this->shards) {
+            evictions += shard.evictions.load(memory_order_relaxed);
+        }
+        return evictions;
+    }
+};
+
+// Safe to share between threads. Every balance change runs under its account's
+// own lock, so operations on different accounts never wait on each other.
+class BankSystem {
+private:
+    static const int CHECKPOINT_PAGE = 256;     // accounts per 4KB page of checkpoint slots
+    AccountStore accounts;
+    vector<atomic<uint8_t>> dirtyPages;
+    mutex openAccountLock;
+    TransactionLedger transactions;
+    WriteAheadLog* log;
+    IdempotencyTable* idempotencyTable;
+    StripedCounter totalBalance;                // kept equal to the sum of all balances
+    DenseArray<TellerVolume> tellerVolumes;     // indexed by teller ID
+    vector<TellerSlot> checkpointedVolumes;     // teller volumes of the rows before checkpointedLsn, by teller ID
+    long long checkpointedLsn;
+
+    static void checkTeller(int tellerId) {
+        if ((unsigned) tellerId >= MAX_TELLERS) {
+            throw "Invalid teller";
+        }
+    }
+
+    // Replayed logs may hold teller IDs from before MAX_TELLERS was enforced;
+    // those are not counted
+    void countVolume(int tellerId, long long amount) {
+        if ((unsigned) tellerId >= MAX_TELLERS) {
+            return;
+        }
+        TellerVolume& volume = this->tellerVolumes[tellerId];
+        volume.operations.fetch_add(1, memory_order_relaxed);
+        volume.amount.fetch_add(amount < 0 ? -amount : amount, memory_order_relaxed);
+    }
+
+    // Append the volume of one row, as countVolume counts it, to rows
+    static void addRowVolume(vector<TellerSlot>& rows, int tellerId, long long amount) {
+        if ((unsigned) tellerId < MAX_TELLERS) {
+            rows.push_back({tellerId, 1, amount < 0 ? -amount : amount});
+        }
+    }
+
+    // Sum rows into volumes; both come out sorted by teller ID with one slot each
+    static void mergeVolumes(vector<TellerSlot>& volumes, vector<TellerSlot>& rows) {
+        rows.insert(rows.end(), volumes.begin(), volumes.end());
+        sort(rows.begin(), rows.end(), [](const TellerSlot& a, const TellerSlot& b) { return a.tellerId < b.tellerId; });
+        volumes.clear();
+        for (TellerSlot& row : rows) {
+            if (!volumes.empty() && volumes.back().tellerId == row.tellerId) {
+                volumes.back().operations += row.operations;
+                volumes.back().amount += row.amount;
+            } else {
+                volumes.push_back(row);
+            }
+        }
+    }
+
+    // Record that row changed the account; call with the account lock held
+    void touch(BankAccount account, long long row) {
+        account.setLastLsn(row);
+        this->dirtyPages[account.getCustomerId() / CHECKPOINT_PAGE].store(1, memory_order_relaxed);
+    }
+
+    // Apply a logged operation on top of a checkpoint. Each account side is
+    // applied only if the account has not already seen that row.
+    void applyLogged(LogRecord& record) {
+        if (record.type == OPEN_ACCOUNT) {
+            if (record.customerId == this->accounts.getSize()) {
+                this->accounts.add(record.name, 0, record.lsn);
+                this->touch(BankAccount(&this->accounts, record.customerId), record.lsn);
+            }
+            return;
+        }
+        if (record.type == ACCRUAL) {
+            const char* deltas = record.name.data();
+            for (int customerId = record.customerId; customerId <= record.counterpartyId; customerId++) {
+                BankAccount account = this->getAccount(customerId);
+                if (record.lsn > account.getLastLsn()) {
+                    int64_t delta;
+                    memcpy(&delta, deltas + (customerId - record.customerId) * 8, 8);
+                    account.deposit(delta);
+                    this->totalBalance.add(delta, customerId);
+                    this->touch(account, record.lsn);
+                }
+            }
+            return;
+        }
+        BankAccount account = this->getAccount(record.customerId);
+        if (record.lsn > account.getLastLsn()) {
+            if (record.type == DEPOSIT) {
+                account.deposit(record.amount);
+                this->totalBalance.add(record.amount, record.customerId);
+            } else {
+                account.withdraw(record.amount);
+                this->totalBalance.add(-record.amount, record.customerId);
+            }
+            this->touch(account, record.lsn);
+        }
+        if (record.type == TRANSFER) {
+            BankAccount to = this->getAccount(record.counterpartyId);
+            if (record.lsn > to.getLastLsn()) {
+                to.deposit(record.amount);
+                this->totalBalance.add(record.amount, record.counterpartyId);
+                this->touch(to, record.lsn);
+            }
+        }
+    }
+
+    // Queue the ledger row in the write-ahead log; call with the account lock held
+    long long logRow(long long row, const string& name) {
+        if (this->log == nullptr) {
+            return 0;
+        }
+        TransactionRow transaction(this->transactions.getSegment(row), row % LedgerSegment::ROWS);
+        LogRecord record;
+        record.lsn = row;
+        record.type = transaction.getType();
+        record.customerId = transaction.getCustomerId();
+        record.counterpartyId = transaction.getCounterpartyId();
+        record.tellerId = transaction.getTellerId();
+        record.amount = transaction.getAmount();
+        record.timestamp = transaction.getTimestamp();
+        record.name = name;
+        return this->log->append(record);
+    }
+
+    // Queue ledger rows first..last-1 in the write-ahead log in chunks
+    long long logRows(long long first, long long last) {
+        if (this->log == nullptr || first == last) {
+            return 0;
+        }
+        const int CHUNK = 4096;
+        vector<LogRecord> records(CHUNK);
+        long long ticket = 0;
+        for (long long start = first; start < last; start += CHUNK) {
+            int count = (int) min((long long) CHUNK, last - start);
+            for (int i = 0; i < count; i++) {
+                long long row = start + i;
+                TransactionRow transaction(this->transactions.getSegment(row), row % LedgerSegment::ROWS);
+                LogRecord& record = records[i];
+                record.lsn = row;
+                record.type = transaction.getType();
+                record.customerId = transaction.getCustomerId();
+                record.counterpartyId = transaction.getCounterpartyId();
+                record.tellerId = transaction.getTellerId();
+                record.amount = transaction.getAmount();
+                record.timestamp = transaction.getTimestamp();
+            }
+            ticket = this->log->append(records.data(), count);
+        }
+        return ticket;
+    }
+
+    // Sum the postings per account: an LSD radix sort on customer ID (only as
+    // many 11-bit digits as the account count needs), then one pass merging
+    // runs. Leaves customerIds ascending and unique, deltas aligned with them.
+    static void reduceDeltas(const Posting* postings, size_t count, long long accountCount,
+                             vector<int>& customerIds, vector<long long>& deltas) {
+        const int DIGIT_BITS = 11;
+        const int BUCKETS = 1 << DIGIT_BITS;
+        vector<uint32_t> keys(count), keysOut(count);
+        vector<long long> values(count), valuesOut(count);
+        for (size_t i = 0; i < count; i++) {
+            keys[i] = postings[i].customerId;
+            values[i] = postings[i].amount;
+        }
+        int bits = 1;
+        while (bits < 32 && (1LL << bits) < accountCount) {
+            bits++;
+        }
+        vector<size_t> offsets(BUCKETS);
+        for (int shift = 0; shift < bits; shift += DIGIT_BITS) {
+            fill(offsets.begin(), offsets.end(), 0);
+            for (size_t i = 0; i < count; i++) {
+                offsets[(keys[i] >> shift) & (BUCKETS - 1)]++;
+            }
+            size_t total = 0;
+            for (size_t& offset : offsets) {
+                size_t bucketSize = offset;
+                offset = total;
+                total += bucketSize;
+            }
+            for (size_t i = 0; i < count; i++) {
+                size_t& offset = offsets[(keys[i] >> shift) & (BUCKETS - 1)];
+                keysOut[offset] = keys[i];
+                valuesOut[offset] = values[i];
+                offset++;
+            }
+            keys.swap(keysOut);
+            values.swap(valuesOut);
+        }
+        customerIds.clear();
+        deltas.clear();
+        for (size_t i = 0; i < count; i++) {
+            if (customerIds.empty() || (uint32_t) customerIds.back() != keys[i]) {
+                customerIds.push_back(keys[i]);
+                deltas.push_back(0);
+            }
+            deltas.back() += values[i];
+        }
+    }
+
+    // Lock customers first..first+count-1, let job (if any) fill deltas from
+    // their balances, and post the deltas as one ACCRUAL row. Returns the row
+    // and sets ticket, or -1 with nothing changed if a balance would go below zero.
+    long long postDeltas(int first, int count, const BalanceJob* job, int64_t* deltas, int tellerId,
+                         long long& ticket) {
+        for (int i = 0; i < count; i++) {
+            this->accounts.getLock(first + i).lock();
+        }
+        int64_t* balances = this->accounts.getBalances() + first;
+        if (job != nullptr) {
+            job->computeDeltas(balances, deltas, count);
+        }
+        long long net = 0;
+        int invalid = 0;
+        for (int i = 0; i < count; i++) {
+            net += deltas[i];
+            invalid |= balances[i] + deltas[i] < 0;
+        }
+        long long row = -1;
+        ticket = 0;
+        if (!invalid) {
+            row = this->transactions.append(ACCRUAL, first, tellerId, net, first + count - 1);
+            int64_t* lastLsns = this->accounts.getLastLsns() + first;
+            for (int i = 0; i < count; i++) {
+                balances[i] += deltas[i];
+                lastLsns[i] = row;
+            }
+            this->totalBalance.add(net, first);
+            this->countVolume(tellerId, net);
+            for (int page = first / CHECKPOINT_PAGE; page <= (first + count - 1) / CHECKPOINT_PAGE; page++) {
+                this->dirtyPages[page].store(1, memory_order_relaxed);
+            }
+            ticket = this->logRow(row, string((const char*) deltas, count * sizeof(int64_t)));
+        }
+        for (int i = 0; i < count; i++) {
+            this->accounts.getLock(first + i).unlock();
+        }
+        return row;
+    }
+
+    // The single-account operations and transfers behind the public ones,
+    // which check the teller and amount first; recover() calls them directly
+    int applyOpenAccount(string customerName, int tellerId) {
+        int customerId;
+        long long ticket;
+        {
+            lock_guard<mutex> guard(this->openAccountLock);
+            customerId = this->accounts.getSize();
+            if (customerId == this->accounts.getCapacity()) {
+                throw "Too many accounts";
+            }
+            long long row = this->transactions.append(OPEN_ACCOUNT, customerId, tellerId, 0);
+
+            // Create account, published only once its row is known
+            this->accounts.add(customerName, 0, row);
+            this->dirtyPages[customerId / CHECKPOINT_PAGE].store(1, memory_order_relaxed);
+            this->countVolume(tellerId, 0);
+
+            // Log transaction
+            ticket = this->logRow(row, customerName);
+        }
+        this->awaitDurable(ticket);
+        return customerId;
+    }
+
+    void applyDeposit(int customerId, int tellerId, int amount) {
+        BankAccount account = this->getAccount(customerId);
+        long long ticket;
+        {
+            lock_guard<AccountLock> guard(account.getLock());
+            // The row comes first: if the ledger is full, nothing has changed
+            long long row = this->transactions.append(DEPOSIT, customerId, tellerId, amount);
+            account.deposit(amount);
+            this->totalBalance.add(amount, customerId);
+            this->touch(account, row);
+            this->countVolume(tellerId, amount);
+            ticket = this->logRow(row, "");
+        }
+        this->awaitDurable(ticket);
+    }
+
+    void applyWithdrawal(int customerId, int tellerId, int amount) {
+        BankAccount account = this->getAccount(customerId);
+        long long ticket;
+        {
+            lock_guard<AccountLock> guard(account.getLock());
+            if (amount > account.getBalance()) {
+                throw "Insufficient funds";
+            }
+            long long row = this->transactions.append(WITHDRAWAL, customerId, tellerId, amount);
+            account.withdraw(amount);
+            this->totalBalance.add(-amount, customerId);
+            this->touch(account, row);
+            this->countVolume(tellerId, amount);
+            ticket = this->logRow(row, "");
+        }
+        this->awaitDurable(ticket);
+    }
+
+    void applyTransfer(int fromCustomerId, int toCustomerId, int amount, int tellerId) {
+        if (fromCustomerId == toCustomerId) {
+            throw "Cannot transfer to the same account";
+        }
+        BankAccount from = this->getAccount(fromCustomerId);
+        BankAccount to = this->getAccount(toCustomerId);
+        BankAccount first = fromCustomerId < toCustomerId ? from : to;
+        BankAccount second = fromCustomerId < toCustomerId ? to : from;
+        long long ticket;
+        {
+            lock_guard<AccountLock> firstGuard(first.getLock());
+            lock_guard<AccountLock> secondGuard(second.getLock());
+            if (amount > from.getBalance()) {
+                throw "Insufficient funds";
+            }
+            long long row = this->transactions.append(TRANSFER, fromCustomerId, tellerId, amount, toCustomerId);
+            from.withdraw(amount);
+            to.deposit(amount);
+            this->touch(from, row);
+            this->touch(to, row);
+            this->countVolume(tellerId, amount);
+            ticket = this->logRow(row, "");
+        }
+        this->awaitDurable(ticket);
+    }
+
+    // Run apply unless key was already used; a failed operation frees its
+    // key so the client can retry it
+    template <typename Operation>
+    bool once(IdempotencyKey key, Operation apply) {
+        if (this->idempotencyTable == nullptr) {
+            throw "No idempotency table attached";
+        }
+        if (!this->idempotencyTable->claim(key, TransactionLedger::now())) {
+            return false;
+        }
+        try {
+            apply();
+        } catch (...) {
+            this->idempotencyTable->release(key);
+            throw;
+        }
+        return true;
+    }
+
+    // Wait for the record to be durable; called after releasing the account lock
+    void awaitDurable(long long ticket) {
+        if (this->log != nullptr) {
+            this->log->waitDurable(ticket);
+        }
+    }
+
+public:
+    static const int JOB_BATCH = 4096;                  // accounts per ledger row of a batch job
+    static const int MIN_BATCHES_PER_THREAD = 16;
+    static const int MAX_TELLERS = 1 << 22;             // teller IDs run from 0 to MAX_TELLERS - 1
+    static_assert(MAX_TELLERS * sizeof(TellerSlot) <= CheckpointStore::TELLER_REGION_BYTES,
+                  "a checkpoint's teller region must hold every teller");
+
+    static const long long DEFAULT_CAPACITY = 1LL << 20;
+
+    // Existing accounts (which may belong to another system) and
+    // transactions are copied in. Room for capacity accounts is reserved up
+    // front; opening one more throws.
+    BankSystem(vector<BankAccount> accounts, vector<Transaction*> transactions,
+               long long capacity = DEFAULT_CAPACITY)
+        : accounts(capacity), dirtyPages((capacity + CHECKPOINT_PAGE - 1) / CHECKPOINT_PAGE),
+          tellerVolumes(MAX_TELLERS) {
+        this->log = nullptr;
+        this->idempotencyTable = nullptr;
+        for (BankAccount account : accounts) {
+            this->totalBalance.add(account.getBalance(), this->accounts.getSize());
+            this->accounts.add(account.getName(), account.getBalance(), -1);
+        }
+        for (Transaction* transaction : transactions) {
+            this->transactions.append(transaction->getType(), transaction->getCustomerId(), transaction->getTellerId(),
+                                      transaction->getAmount(), transaction->getCounterpartyId());
+        }
+        // Copied rows count toward no teller's volume
+        this->checkpointedLsn = this->transactions.getSize();
+    }
+
+    // From now on every operation returns only once its log record is durable
+    void attachLog(WriteAheadLog* log) {
+        this->log = log;
+    }
+
+    // Enables the operations taking an IdempotencyKey. The table lives in
+    // memory only, so keys used before a restart are not remembered.
+    void attachIdempotencyTable(IdempotencyTable* idempotencyTable) {
+        this->idempotencyTable = idempotencyTable;
+    }
+
+    // Rebuild accounts, balances and teller volumes by replaying the log at
+    // path into this (empty, log-less) system; returns the number of records
+    // replayed. Records are applied as logged, without the checks on caller
+    // input, which they passed when they were written.
+    long long recover(string path) {
+        return WriteAheadLog::read(path, [this](LogRecord& record) {
+            if (record.type == OPEN_ACCOUNT) {
+                this->applyOpenAccount(record.name, record.tellerId);
+            } else if (record.type == DEPOSIT) {
+                this->applyDeposit(record.customerId, record.tellerId, record.amount);
+            } else if (record.type == WITHDRAWAL) {
+                this->applyWithdrawal(record.customerId, record.tellerId, record.amount);
+            } else if (record.type == TRANSFER) {
+                this->applyTransfer(record.customerId, record.counterpartyId, record.amount, record.tellerId);
+            } else if (record.type == ACCRUAL) {
+                vector<int64_t> deltas(record.name.size() / sizeof(int64_t));
+                memcpy(deltas.data(), record.name.data(), record.name.size());
+                long long ticket;
+                if (this->postDeltas(record.customerId, deltas.size(), nullptr, deltas.data(), record.tellerId,
+                                     ticket) < 0) {
+                    throw "Insufficient funds";
+                }
+            }
+        });
+    }
+
+    // Write account balances and teller volumes to store. A full checkpoint
+    // writes every page; an incremental one only pages changed since the
+    // previous checkpoint. Each account is locked just long enough to copy it,
+    // so operations never wait on the disk. Teller volumes are the previous
+    // checkpoint's plus the ledger rows since. Returns the number of accounts
+    // written.
+    long long checkpoint(CheckpointStore* store, bool full) {
+        // Anything not captured below is logged after this point, and so is
+        // every row from nextLsn on, as those are reserved later still
+        long long walOffset = this->log == nullptr ? 0 : this->log->getAppendedBytes();
+        long long nextLsn = this->transactions.getSize();
+        long long accountCount = this->accounts.getSize();
+        CheckpointHeader previous = store->getHeader();
+
+        vector<char> names;
+        for (long long i = previous.accountCount; i < accountCount; i++) {
+            string name = this->accounts.getName(i);
+            uint32_t length = name.size();
+            names.insert(names.end(), (char*) &length, (char*) &length + 4);
+            names.insert(names.end(), name.begin(), name.end());
+        }
+        long long namesBytes = store->appendNames(names);
+
+        vector<TellerSlot> rows;
+        for (long long row = this->checkpointedLsn; row < nextLsn; row++) {
+            TransactionRow transaction(this->transactions.getSegment(row), row % LedgerSegment::ROWS);
+            addRowVolume(rows, transaction.getTellerId(), transaction.getAmount());
+        }
+        vector<TellerSlot> volumes = this->checkpointedVolumes;
+        mergeVolumes(volumes, rows);
+        store->writeTellers(volumes);
+
+        vector<AccountSlot> page(CHECKPOINT_PAGE);
+        long long written = 0;
+        try {
+            for (long long first = 0; first < accountCount; first += CHECKPOINT_PAGE) {
+                atomic<uint8_t>& dirty = this->dirtyPages[first / CHECKPOINT_PAGE];
+                if (!dirty.exchange(0, memory_order_acq_rel) && !full) {
+                    continue;
+                }
+                int count = min((long long) CHECKPOINT_PAGE, accountCount - first);
+                if (count < CHECKPOINT_PAGE) {
+                    // Accounts opened past accountCount share this page
+                    dirty.store(1, memory_order_relaxed);
+                }
+                int64_t* balances = this->accounts.getBalances() + first;
+                int64_t* lastLsns = this->accounts.getLastLsns() + first;
+                for (int i = 0; i < count; i++) {
+                    lock_guard<AccountLock> guard(this->accounts.getLock(first + i));
+                    page[i].balance = balances[i];
+                    page[i].lastLsn = lastLsns[i];
+                }
+                store->writeSlots(first, page.data(), count);
+                written += count;
+            }
+
+            CheckpointHeader next = previous;
+            next.accountCount = accountCount;
+            next.walOffset = walOffset;
+            next.nextLsn = nextLsn;
+            next.namesBytes = namesBytes;
+            next.tellerCount = volumes.size();
+            store->commit(next);
+        } catch (const char*) {
+            // Pages cleaned above may not be on disk; the next checkpoint writes them again
+            for (long long first = 0; first < accountCount; first += CHECKPOINT_PAGE) {
+                this->dirtyPages[first / CHECKPOINT_PAGE].store(1, memory_order_relaxed);
+            }
+            throw;
+        }
+        this->checkpointedVolumes.swap(volumes);
+        this->checkpointedLsn = nextLsn;
+        return written;
+    }
+
+    // Rebuild this (empty, log-less) system from the latest checkpoint in
+    // store plus the part of the log at logPath written after it. History
+    // before the checkpoint stays in the log and is not read; the ledger
+    // resumes numbering where it left off. Returns the number of log records
+    // replayed.
+    long long restore(CheckpointStore* store, string logPath) {
+        CheckpointHeader header = store->getHeader();
+        store->map([this, &header](const AccountSlot* slots, const char* names) {
+            this->accounts.reserve(header.accountCount);
+            for (long long i = 0; i < header.accountCount; i++) {
+                uint32_t length;
+                memcpy(&length, names, 4);
+                this->accounts.add(string(names + 4, length), slots[i].balance, slots[i].lastLsn);
+                this->totalBalance.add(slots[i].balance, i);
+                names += 4 + length;
+            }
+        });
+        // Rows logged after walOffset but numbered before nextLsn are already
+        // in the checkpointed volumes
+        vector<TellerSlot> volumes = store->readTellers();
+        vector<TellerSlot> rows;
+        long long nextLsn = header.nextLsn;
+        long long replayed =
+            WriteAheadLog::read(logPath, header.walOffset, [this, &header, &rows, &nextLsn](LogRecord& record) {
+                this->applyLogged(record);
+                if (record.lsn >= header.nextLsn) {
+                    addRowVolume(rows, record.tellerId, record.amount);
+                }
+                nextLsn = max(nextLsn, record.lsn + 1);
+            });
+        mergeVolumes(volumes, rows);
+        for (TellerSlot& volume : volumes) {
+            this->tellerVolumes[volume.tellerId].operations.store(volume.operations, memory_order_relaxed);
+            this->tellerVolumes[volume.tellerId].amount.store(volume.amount, memory_order_relaxed);
+        }
+        this->checkpointedVolumes.swap(volumes);
+        this->checkpointedLsn = nextLsn;
+        this->transactions.restartAt(nextLsn);
+        return replayed;
+    }
+
+    BankAccount getAccount(int customerId) {
+        if (customerId < 0 || customerId >= this->accounts.getSize()) {
+            throw "Account does not exist";
+        }
+        return BankAccount(&this->accounts, customerId);
+    }
+
+    vector<BankAccount> getAccounts() {
+        vector<BankAccount> accounts;
+        long long count = this->accounts.getSize();
+        for (long long i = 0; i < count; i++) {
+            accounts.push_back(BankAccount(&this->accounts, i));
+        }
+        return accounts;
+    }
+
+    long long getAccountCount() {
+        return this->accounts.getSize();
+    }
+
+    // The account columns, for whole-bank jobs that run while no operation does
+    AccountStore& getAccountStore() {
+        return this->accounts;
+    }
+
+    // Sum of all balances, the bank's liabilities to its customers. Kept up
+    // to date by every operation, so reading it takes no locks and no scan.
+    long long getTotalBalance() {
+        return this->totalBalance.get();
+    }
+
+    // Operations posted by tellerId, and the sum of their amounts (net, for
+    // a batch job's row)
+    long long getTellerOperations(int tellerId) {
+        checkTeller(tellerId);
+        return this->tellerVolumes[tellerId].operations.load(memory_order_relaxed);
+    }
+
+    long long getTellerVolume(int tellerId) {
+        checkTeller(tellerId);
+        return this->tellerVolumes[tellerId].amount.load(memory_order_relaxed);
+    }
+
+    LedgerView getTransactions() {
+        return LedgerView(&this->transactions, this->transactions.getFirst(), this->transactions.getSize());
+    }
+
+    // One customer's rows, newest first, including transfers in either direction
+    HistoryView getHistory(int customerId) {
+        return this->getHistory(customerId, INT64_MIN, INT64_MAX);
+    }
+
+    HistoryView getHistory(int customerId, long long fromTimestamp, long long toTimestamp) {
+        this->getAccount(customerId);
+        return HistoryView(&this->transactions, HistoryView::CUSTOMER, customerId, fromTimestamp, toTimestamp);
+    }
+
+    // One teller's rows, newest first
+    HistoryView getTellerHistory(int tellerId) {
+        return HistoryView(&this->transactions, HistoryView::TELLER, tellerId, INT64_MIN, INT64_MAX);
+    }
+
+    // Rows with timestamps in [fromTimestamp, toTimestamp), oldest first
+    TimeRangeView getTransactionsBetween(long long fromTimestamp, long long toTimestamp) {
+        return TimeRangeView(&this->transactions, fromTimestamp, toTimestamp, this->transactions.getFirst(),
+                             this->transactions.getSize());
+    }
+
+    int openAccount(string customerName, int tellerId) {
+        checkTeller(tellerId);
+        return this->applyOpenAccount(customerName, tellerId);
+    }
+
+    void deposit(int customerId, int tellerId, int amount) {
+        if (amount <= 0) {
+            throw "Deposit amount must be positive";
+        }
+        checkTeller(tellerId);
+        this->applyDeposit(customerId, tellerId, amount);
+    }
+
+    void withdraw(int customerId, int tellerId, int amount) {
+        if (amount <= 0) {
+            throw "Withdrawal amount must be positive";
+        }
+        checkTeller(tellerId);
+        this->applyWithdrawal(customerId, tellerId, amount);
+    }
+
+    // The keyed operations apply at most once per key within the idempotency
+    // table's time to live; a repeat returns false and changes nothing. A
+    // repeat that arrives while the first attempt is still running is also
+    // refused, even if that attempt then fails.
+    bool deposit(int customerId, int tellerId, int amount, IdempotencyKey key) {
+        return this->once(key, [this, customerId, tellerId, amount]() {
+            this->deposit(customerId, tellerId, amount);
+        });
+    }
+
+    bool withdraw(int customerId, int tellerId, int amount, IdempotencyKey key) {
+        return this->once(key, [this, customerId, tellerId, amount]() {
+            this->withdraw(customerId, tellerId, amount);
+        });
+    }
+
+    bool transfer(int fromCustomerId, int toCustomerId, int amount, int tellerId, IdempotencyKey key) {
+        return this->once(key, [this, fromCustomerId, toCustomerId, amount, tellerId]() {
+            this->transfer(fromCustomerId, toCustomerId, amount, tellerId);
+        });
+    }
+
+    // Move amount between two accounts as one operation with one ledger row.
+    // Both account locks are taken lowest customer ID first, so concurrent
+    // transfers in opposite directions cannot deadlock.
+    void transfer(int fromCustomerId, int toCustomerId, int amount, int tellerId) {
+        if (amount <= 0) {
+            throw "Transfer amount must be positive";
+        }
+        checkTeller(tellerId);
+        this->applyTransfer(fromCustomerId, toCustomerId, amount, tellerId);
+    }
+
+    // Post a whole file of deposits and withdrawals as one unit: either every
+    // posting is applied or, if any is invalid or would overdraw its account
+    // once the batch is netted, none is. Each posting still gets its own
+    // ledger row; deposits are written before withdrawals so replaying the
+    // rows one at a time never overdraws an account.
+    void postBatch(const Posting* postings, size_t count) {
+        if (count == 0) {
+            return;
+        }
+
+        // Branch-free validation so the compiler can vectorize it
+        uint32_t accountCount = this->accounts.getSize();
+        int invalid = 0;
+        for (size_t i = 0; i < count; i++) {
+            invalid |= ((uint32_t) postings[i].customerId >= accountCount) | (postings[i].amount == 0)
+                       | (postings[i].amount == INT32_MIN) | ((uint32_t) postings[i].tellerId >= MAX_TELLERS);
+        }
+        if (invalid) {
+            throw "Invalid posting";
+        }
+
+        vector<int> customerIds;
+        vector<long long> deltas;
+        reduceDeltas(postings, count, accountCount, customerIds, deltas);
+
+        // Ascending customer IDs, the same lock order transfer uses
+        for (int customerId : customerIds) {
+            this->accounts.getLock(customerId).lock();
+        }
+        auto unlockAll = [this, &customerIds]() {
+            for (int customerId : customerIds) {
+                this->accounts.getLock(customerId).unlock();
+            }
+        };
+        for (size_t i = 0; i < customerIds.size(); i++) {
+            if (this->accounts.getBalances()[customerIds[i]] + deltas[i] < 0) {
+                unlockAll();
+                throw "Insufficient funds";
+            }
+        }
+        long long first;
+        try {
+            first = this->transactions.reserve(count);
+        } catch (const char*) {
+            unlockAll();
+            throw;
+        }
+        long long net = 0;
+        for (size_t i = 0; i < customerIds.size(); i++) {
+            BankAccount account(&this->accounts, customerIds[i]);
+            account.deposit(deltas[i]);
+            this->touch(account, first + count - 1);
+            net += deltas[i];
+        }
+        this->totalBalance.add(net, customerIds[0]);
+        for (size_t i = 0; i < count; i++) {
+            this->countVolume(postings[i].tellerId, postings[i].amount);
+        }
+
+        long long row = first;
+        long long timestamp = TransactionLedger::now();
+        for (size_t i = 0; i < count; i++) {
+            if (postings[i].amount > 0) {
+                this->transactions.write(row++, DEPOSIT, postings[i].customerId, postings[i].tellerId,
+                                         postings[i].amount, -1, timestamp);
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (postings[i].amount < 0) {
+                this->transactions.write(row++, WITHDRAWAL, postings[i].customerId, postings[i].tellerId,
+                                         -(long long) postings[i].amount, -1, timestamp);
+            }
+        }
+        long long ticket = this->logRows(first, first + count);
+        unlockAll();
+        this->awaitDurable(ticket);
+    }
+
+    // Apply job to every account, JOB_BATCH accounts per ledger row, with the
+    // batches shared out among one thread per core. Each batch locks its
+    // accounts only while it runs, so other operations carry on. If a batch
+    // would take a balance below zero, it and the batches not yet started are
+    // skipped and this throws; the others stay posted.
+    BatchJobResult runBatchJob(const BalanceJob& job, int tellerId) {
+        checkTeller(tellerId);
+        long long accountCount = this->accounts.getSize();
+        long long batchCount = (accountCount + JOB_BATCH - 1) / JOB_BATCH;
+        BatchJobResult result;
+        result.rows.assign(batchCount, -1);
+        result.deltas.resize(accountCount);
+        result.netDelta = 0;
+
+        int threadCount = min((long long) thread::hardware_concurrency(), batchCount / MIN_BATCHES_PER_THREAD);
+        threadCount = max(threadCount, 1);
+        atomic<long long> nextBatch(0);
+        atomic<bool> failed(false);
+        vector<long long> tickets(threadCount, 0);
+        auto runBatches = [this, &job, tellerId, accountCount, batchCount, &result, &nextBatch, &failed,
+                           &tickets](int t) {
+            for (long long batch = nextBatch++; batch < batchCount && !failed.load(); batch = nextBatch++) {
+                int first = batch * JOB_BATCH;
+                int count = min((long long) JOB_BATCH, accountCount - first);
+                long long ticket;
+                result.rows[batch] = this->postDeltas(first, count, &job, result.deltas.data() + first, tellerId,
+                                                      ticket);
+                if (result.rows[batch] < 0) {
+                    failed.store(true);
+                }
+                tickets[t] = max(tickets[t], ticket);
+            }
+        };
+        vector<thread> workers;
+        for (int t = 1; t < threadCount; t++) {
+            workers.push_back(thread(runBatches, t));
+        }
+        runBatches(0);
+        for (thread& worker : workers) {
+            worker.join();
+        }
+        this->awaitDurable(*max_element(tickets.begin(), tickets.end()));
+        if (failed.load()) {
+            throw "Insufficient funds";
+        }
+        for (int64_t delta : result.deltas) {
+            result.netDelta += delta;
+        }
+        return result;
+    }
+};
+
+// One operation for a ShardedBank. The caller owns it and must keep it alive
+// until getState() leaves PENDING; until then it travels between shard queues.
+class BankRequest {
+public:
+    enum Kind {
+        OPEN,
+        DEPOSIT,
+        WITHDRAW,
+        TRANSFER,
+        BALANCE,
+        SUM_BALANCES,
+    };
+
+    enum State {
+        PENDING,
+        DONE,
+        FAILED,
+    };
+
+    // Steps of a cross-shard transfer
+    enum Phase {
+        SUBMITTED,      // at the source shard, which holds the funds
+        PREPARE,        // at the destination, which votes
+        VOTED_YES,      // back at the source, which writes the debit row
+        VOTED_NO,       // back at the source, which releases the hold
+        COMMIT,         // at the destination, which applies the credit and writes its row
+    };
+
+    Kind kind;
+    int customerId;
+    int counterpartyId;
+    int tellerId;
+    long long amount;           // also the result of BALANCE and SUM_BALANCES
+    string name;
+    Phase phase;
+    const char* error;
+    atomic<int> state;
+    atomic<BankRequest*> next;  // link in a shard queue
+
+    BankRequest() : state(PENDING), next(nullptr) {}
+
+    State getState() {
+        return (State) this->state.load(memory_order_acquire);
+    }
+};
+
+// Lock-free multi-producer, single-consumer queue of requests (Vyukov's
+// intrusive design): producers swap themselves in as the head, the consumer
+// walks from the tail. A stub node keeps the list non-empty.
+class RequestQueue {
+private:
+    atomic<BankRequest*> head;
+    BankRequest* tail;
+    BankRequest stub;
+
+public:
+    RequestQueue() : head(&stub), tail(&stub) {}
+
+    void push(BankRequest* request) {
+        request->next.store(nullptr, memory_order_relaxed);
+        BankRequest* previous = this->head.exchange(request, memory_order_acq_rel);
+        previous->next.store(request, memory_order_release);
+    }
+
+    // nullptr when empty, or when a producer is halfway through a push
+    BankRequest* pop() {
+        BankRequest* tail = this->tail;
+        BankRequest* next = tail->next.load(memory_order_acquire);
+        if (tail == &this->stub) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+            this->tail = next;
+            tail = next;
+            next = next->next.load(memory_order_acquire);
+        }
+        if (next != nullptr) {
+            this->tail = next;
+            return tail;
+        }
+        if (tail != this->head.load(memory_order_acquire)) {
+            return nullptr;
+        }
+        this->push(&this->stub);
+        next = tail->next.load(memory_order_acquire);
+        if (next != nullptr) {
+            this->tail = next;
+            return tail;
+        }
+        return nullptr;
+    }
+};
+
+// Bank core split into shards by customer ID (customerId % shardCount). Each
+// shard owns its accounts and its own ledger, and only its thread, pinned to
+// one core, ever touches them; everything else reaches it through its queue.
+// A transfer between shards is a two-phase commit run by the source shard.
+class ShardedBank {
+private:
+    static const int SPIN_POLLS = 4096;     // empty polls before an idle worker sleeps
+
+    class Shard {
+    public:
+        RequestQueue queue;
+        TransactionLedger ledger;
+        vector<long long> balances;     // by customerId / shardCount
+        vector<string> names;
+        vector<uint8_t> opened;
+        thread worker;
+        mutex parkLock;
+        condition_variable wakeup;
+        atomic<bool> parked;            // the worker is asleep, or about to check the queue once more
+        long long promisedRows;         // ledger rows kept for transfer phases still to come
+    };
+
+    int shardCount;
+    vector<Shard*> shards;
+    atomic<int> nextCustomerId;
+    atomic<bool> stopping;
+    StripedCounter totalBalance;        // deposits less withdrawals, one stripe per shard
+
+    // Whether shard's ledger has a row to spare beyond the promised ones;
+    // only its worker appends, so the row is still there when it appends
+    bool hasRoom(Shard* shard) {
+        return shard->ledger.getSize() + shard->promisedRows < TransactionLedger::MAX_ROWS;
+    }
+
+    bool exists(Shard* shard, int customerId) {
+        size_t local = customerId / this->shardCount;
+        return customerId >= 0 && local < shard->opened.size() && shard->opened[local];
+    }
+
+    void complete(BankRequest* request, const char* error) {
+        request->error = error;
+        request->state.store(error == nullptr ? BankRequest::DONE : BankRequest::FAILED, memory_order_release);
+    }
+
+    void process(Shard* shard, BankRequest* request) {
+        size_t local = request->customerId / this->shardCount;
+        if (request->kind == BankRequest::SUM_BALANCES) {
+            long long total = 0;
+            for (long long balance : shard->balances) {
+                total += balance;
+            }
+            request->amount = total;
+            this->complete(request, nullptr);
+            return;
+        }
+        if (request->kind == BankRequest::OPEN) {
+            if (!this->hasRoom(shard)) {
+                this->complete(request, "Ledger is full");
+                return;
+            }
+            if (local >= shard->opened.size()) {
+                shard->balances.resize(local + 1, 0);
+                shard->names.resize(local + 1);
+                shard->opened.resize(local + 1, 0);
+            }
+            shard->ledger.append(OPEN_ACCOUNT, request->customerId, request->tellerId, 0);
+            shard->opened[local] = 1;
+            shard->names[local] = request->name;
+            this->complete(request, nullptr);
+            return;
+        }
+
+        // Destination side of a cross-shard transfer: request->counterpartyId
+        // is ours. A yes vote keeps a ledger row for the credit.
+        if (request->phase == BankRequest::PREPARE) {
+            if (!this->exists(shard, request->counterpartyId)) {
+                request->error = "Account does not exist";
+            } else if (!this->hasRoom(shard)) {
+                request->error = "Ledger is full";
+            } else {
+                shard->promisedRows++;
+            }
+            request->phase = request->error == nullptr ? BankRequest::VOTED_YES : BankRequest::VOTED_NO;
+            this->enqueue(this->shards[this->shardOf(request->customerId)], request);
+            return;
+        }
+        if (request->phase == BankRequest::COMMIT) {
+            shard->promisedRows--;
+            shard->ledger.append(TRANSFER, request->customerId, request->tellerId, request->amount,
+                                 request->counterpartyId);
+            shard->balances[request->counterpartyId / this->shardCount] += request->amount;
+            this->complete(request, nullptr);
+            return;
+        }
+
+        // Source side: the funds and a ledger row were held when the transfer was submitted
+        if (request->phase == BankRequest::VOTED_YES) {
+            shard->promisedRows--;
+            shard->ledger.append(TRANSFER, request->customerId, request->tellerId, request->amount,
+                                 request->counterpartyId);
+            request->phase = BankRequest::COMMIT;
+            this->enqueue(this->shards[this->shardOf(request->counterpartyId)], request);
+            return;
+        }
+        if (request->phase == BankRequest::VOTED_NO) {
+            shard->promisedRows--;
+            shard->balances[local] += request->amount;
+            this->complete(request, request->error);
+            return;
+        }
+
+        if (!this->exists(shard, request->customerId)) {
+            this->complete(request, "Account does not exist");
+            return;
+        }
+        if (request->kind != BankRequest::BALANCE && !this->hasRoom(shard)) {
+            this->complete(request, "Ledger is full");
+            return;
+        }
+        long long& balance = shard->balances[local];
+        if (request->kind == BankRequest::BALANCE) {
+            request->amount = balance;
+            this->complete(request, nullptr);
+        } else if (request->kind == BankRequest::DEPOSIT) {
+            shard->ledger.append(DEPOSIT, request->customerId, request->tellerId, request->amount);
+            balance += request->amount;
+            this->totalBalance.add(request->amount, this->shardOf(request->customerId));
+            this->complete(request, nullptr);
+        } else if (request->amount > balance) {
+            this->complete(request, "Insufficient funds");
+        } else if (request->kind == BankRequest::WITHDRAW) {
+            shard->ledger.append(WITHDRAWAL, request->customerId, request->tellerId, request->amount);
+            balance -= request->amount;
+            this->totalBalance.add(-request->amount, this->shardOf(request->customerId));
+            this->complete(request, nullptr);
+        } else if (request->counterpartyId < 0) {
+            this->complete(request, "Account does not exist");
+        } else if (request->customerId == request->counterpartyId) {
+            this->complete(request, "Cannot transfer to the same account");
+        } else if (this->shardOf(request->counterpartyId) == this->shardOf(request->customerId)) {
+            if (!this->exists(shard, request->counterpartyId)) {
+                this->complete(request, "Account does not exist");
+                return;
+            }
+            shard->ledger.append(TRANSFER, request->customerId, request->tellerId, request->amount,
+                                 request->counterpartyId);
+            balance -= request->amount;
+            shard->balances[request->counterpartyId / this->shardCount] += request->amount;
+            this->complete(request, nullptr);
+        } else {
+            // Phase one: hold the funds and a row for the debit, then ask the destination to vote
+            balance -= request->amount;
+            shard->promisedRows++;
+            request->phase = BankRequest::PREPARE;
+            this->enqueue(this->shards[this->shardOf(request->counterpartyId)], request);
+        }
+    }
+
+    // Push onto shard's queue, waking its worker if it is parked. The fence
+    // pairs with the one in park(): either the worker's last look at the
+    // queue finds the request or this sees the worker parked.
+    void enqueue(Shard* shard, BankRequest* request) {
+        shard->queue.push(request);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (shard->parked.load(memory_order_relaxed)) {
+            lock_guard<mutex> guard(shard->parkLock);
+            shard->wakeup.notify_one();
+        }
+    }
+
+    // Sleep until a request is pushed or the bank stops. Returns a request
+    // found by the last look at the queue, if any.
+    BankRequest* park(Shard* shard) {
+        unique_lock<mutex> guard(shard->parkLock);
+        shard->parked.store(true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        BankRequest* request = shard->queue.pop();
+        if (request == nullptr && !this->stopping.load(memory_order_acquire)) {
+            shard->wakeup.wait(guard);
+        }
+        shard->parked.store(false, memory_order_relaxed);
+        return request;
+    }
+
+    // Poll the queue, yielding after a few empty polls and parking after
+    // SPIN_POLLS of them, so an idle shard leaves its core alone
+    void run(Shard* shard) {
+        int idle = 0;
+        while (true) {
+            BankRequest* request = shard->queue.pop();
+            if (request == nullptr) {
+                if (this->stopping.load(memory_order_acquire) && idle > 1000) {
+                    return;
+                }
+                if (++idle > SPIN_POLLS && !this->stopping.load(memory_order_acquire)) {
+                    request = this->park(shard);
+                    idle = 0;
+                } else if (idle > 64) {
+                    this_thread::yield();
+                }
+                if (request == nullptr) {
+                    continue;
+                }
+            }
+            idle = 0;
+            this->process(shard, request);
+        }
+    }
+
+    // Submit and wait; rethrows the request's error
+    void call(BankRequest& request) {
+        this->submit(&request);
+        while (request.getState() == BankRequest::PENDING) {
+            this_thread::yield();
+        }
+        if (request.getState() == BankRequest::FAILED) {
+            throw request.error;
+        }
+    }
+
+public:
+    ShardedBank(int shardCount) : nextCustomerId(0), stopping(false) {
+        this->shardCount = shardCount;
+        int cores = max(1, (int) thread::hardware_concurrency());
+        for (int i = 0; i < shardCount; i++) {
+            Shard* shard = new Shard();
+            shard->parked = false;
+            shard->promisedRows = 0;
+            this->shards.push_back(shard);
+            shard->worker = thread([this, shard]() { this->run(shard); });
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % cores, &cpus);
+            pthread_setaffinity_np(shard->worker.native_handle(), sizeof(cpu_set_t), &cpus);
+        }
+    }
+
+    // Every submitted request must have left PENDING
+    ~ShardedBank() {
+        this->stopping.store(true, memory_order_release);
+        for (Shard* shard : this->shards) {
+            {
+                lock_guard<mutex> guard(shard->parkLock);
+                shard->wakeup.notify_one();
+            }
+            shard->worker.join();
+            delete shard;
+        }
+    }
+
+    ShardedBank(const ShardedBank&) = delete;
+    ShardedBank& operator=(const ShardedBank&) = delete;
+
+    int getShardCount() {
+        return this->shardCount;
+    }
+
+    int shardOf(int customerId) {
+        return customerId % this->shardCount;
+    }
+
+    // Queue request at the shard that owns its customer without waiting. An
+    // OPEN request gets its customer ID here.
+    void submit(BankRequest* request) {
+        request->phase = BankRequest::SUBMITTED;
+        request->error = nullptr;
+        request->state.store(BankRequest::PENDING, memory_order_relaxed);
+        if (request->kind == BankRequest::OPEN) {
+            request->customerId = this->nextCustomerId.fetch_add(1, memory_order_relaxed);
+        }
+        if (request->customerId < 0) {
+            this->complete(request, "Account does not exist");
+            return;
+        }
+        // Checked here, before the source shard holds any funds
+        bool moves = request->kind == BankRequest::DEPOSIT || request->kind == BankRequest::WITHDRAW
+                     || request->kind == BankRequest::TRANSFER;
+        if (moves && request->amount <= 0) {
+            this->complete(request, "Amount must be positive");
+            return;
+        }
+        this->enqueue(this->shards[this->shardOf(request->customerId)], request);
+    }
+
+    int openAccount(string customerName, int tellerId) {
+        BankRequest request;
+        request.kind = BankRequest::OPEN;
+        request.name = customerName;
+        request.tellerId = tellerId;
+        this->call(request);
+        return request.customerId;
+    }
+
+    void deposit(int customerId, int tellerId, int amount) {
+        BankRequest request;
+        request.kind = BankRequest::DEPOSIT;
+        request.customerId = customerId;
+        request.tellerId = tellerId;
+        request.amount = amount;
+        this->call(request);
+    }
+
+    void withdraw(int customerId, int tellerId, int amount) {
+        BankRequest request;
+        request.kind = BankRequest::WITHDRAW;
+        request.customerId = customerId;
+        request.tellerId = tellerId;
+        request.amount = amount;
+        this->call(request);
+    }
+
+    void transfer(int fromCustomerId, int toCustomerId, int amount, int tellerId) {
+        BankRequest request;
+        request.kind = BankRequest::TRANSFER;
+        request.customerId = fromCustomerId;
+        request.counterpartyId = toCustomerId;
+        request.tellerId = tellerId;
+        request.amount = amount;
+        this->call(request);
+    }
+
+    long long getBalance(int customerId) {
+        BankRequest request;
+        request.kind = BankRequest::BALANCE;
+        request.customerId = customerId;
+        this->call(request);
+        return request.amount;
+    }
+
+    // Money owed to customers: deposits less withdrawals, which transfers
+    // leave unchanged. Exact at any moment, funds held by a cross-shard
+    // transfer between its phases included, and reading it takes no round
+    // trip through the shards.
+    long long getTotalBalance() {
+        return this->totalBalance.get();
+    }
+
+    // Sum of every account's balance; each shard's part is exact at the
+    // moment it answers. Funds held by a cross-shard transfer are in no
+    // balance until it commits or fails, so this equals getTotalBalance()
+    // only while no transfer is in flight.
+    long long sumBalances() {
+        vector<BankRequest> requests(this->shardCount);
+        for (int i = 0; i < this->shardCount; i++) {
+            requests[i].kind = BankRequest::SUM_BALANCES;
+            requests[i].customerId = i;
+            this->submit(&requests[i]);
+        }
+        long long total = 0;
+        for (BankRequest& request : requests) {
+            while (request.getState() == BankRequest::PENDING) {
+                this_thread::yield();
+            }
+            total += request.amount;
+        }
+        return total;
+    }
+
+    // Ledger of one shard. A cross-shard transfer has a TRANSFER row in both
+    // the source's and the destination's.
+    LedgerView getShardTransactions(int shard) {
+        TransactionLedger* ledger = &this->shards[shard]->ledger;
+        return LedgerView(ledger, ledger->getFirst(), ledger->getSize());
+    }
+};
+
+// Hands branch customers to tellers. Each teller has a desk that serves one
+// customer at a time; the others queue on it. The desk keeps a moving
+// average of its service time so slower tellers get shorter queues.
+class TellerScheduler {
+public:
+    enum Policy {
+        RANDOM,         // uniformly random desk
+        LEAST_LOADED,   // shortest expected wait: (queue + 1) x average service time
+    };
+
+private:
+    static const long long INITIAL_SERVICE_NANOS = 1000;
+
+    class Desk {
+    public:
+        BankTeller teller;
+        mutex serving;
+        atomic<int> queued;                 // assigned customers not yet done, including the one served
+        atomic<long long> averageNanos;
+
+        Desk(BankTeller teller) : teller(teller), queued(0), averageNanos(INITIAL_SERVICE_NANOS) {}
+    };
+
+    Policy policy;
+    vector<Desk*> desks;
+    atomic<unsigned> nextStart;
+
+    Desk* assign() {
+        int count = this->desks.size();
+        Desk* chosen;
+        if (this->policy == RANDOM) {
+            static thread_local minstd_rand random(hash<thread::id>()(this_thread::get_id()));
+            chosen = this->desks[uniform_int_distribution<int>(0, count - 1)(random)];
+        } else {
+            // Start the scan at a rotating desk so ties spread out
+            int start = this->nextStart.fetch_add(1, memory_order_relaxed) % count;
+            long long bestCost = INT64_MAX;
+            chosen = nullptr;
+            for (int i = 0; i < count; i++) {
+                Desk* desk = this->desks[(start + i) % count];
+                long long cost = (desk->queued.load(memory_order_relaxed) + 1)
+                                 * desk->averageNanos.load(memory_order_relaxed);
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    chosen = desk;
+                }
+            }
+        }
+        chosen->queued.fetch_add(1, memory_order_relaxed);
+        return chosen;
+    }
+
+    // Fold one service time into the desk average; called while serving
+    void finish(Desk* desk, chrono::steady_clock::time_point start) {
+        long long sample = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        long long average = desk->averageNanos.load(memory_order_relaxed);
+        desk->averageNanos.store(average + (sample - average) / 8, memory_order_relaxed);
+        desk->queued.fetch_sub(1, memory_order_relaxed);
+    }
+
+public:
+    TellerScheduler(Policy policy) : nextStart(0) {
+        this->policy = policy;
+    }
+
+    ~TellerScheduler() {
+        for (Desk* desk : this->desks) {
+            delete desk;
+        }
+    }
+
+    TellerScheduler(const TellerScheduler&) = delete;
+    TellerScheduler& operator=(const TellerScheduler&) = delete;
+
+    // Tellers are added while the branch is being set up, before it serves anyone
+    void addTeller(BankTeller teller) {
+        this->desks.push_back(new Desk(teller));
+    }
+
+    int getTellerCount() {
+        return this->desks.size();
+    }
+
+    vector<int> getTellerIds() {
+        vector<int> ids;
+        for (Desk* desk : this->desks) {
+            ids.push_back(desk->teller.getId());
+        }
+        return ids;
+    }
+
+    // Queue for a teller, then run operation at their desk
+    void serve(const function<void(BankTeller&)>& operation) {
+        if (this->desks.size() == 0) {
+            throw "Branch does not have any tellers";
+        }
+        Desk* desk = this->assign();
+        lock_guard<mutex> guard(desk->serving);
+        auto start = chrono::steady_clock::now();
+        try {
+            operation(desk->teller);
+        } catch (...) {
+            this->finish(desk, start);
+            throw;
+        }
+        this->finish(desk, start);
+    }
+};
+
+// At most maxCount withdrawals totalling at most maxAmount per account within
+// any window of windowMicros
+class VelocityRule {
+public:
+    long long windowMicros;
+    int maxCount;
+    long long maxAmount;
+};
+
+// Per-account velocity limits shared by every branch of a bank. Each account
+// has a ring of its last RING admitted withdrawals in a dense array indexed by
+// customer ID, reserved for capacity accounts (as a BankSystem's); pages are
+// only backed for accounts that withdraw, and a check
+// reads one account's ring under its own lock, so its cost does not depend
+// on the number of accounts or on other customers.
+class VelocityGuard {
+public:
+    static const int RING = 8;      // rules may allow at most this many withdrawals per window
+
+private:
+    class alignas(64) Ring {
+    public:
+        long long times[RING];      // INT64_MIN once cancelled
+        int amounts[RING];
+        unsigned long long next;    // withdrawals admitted so far; slots from next on are unused
+        AccountLock lock;
+    };
+
+    vector<VelocityRule> rules;
+    long long capacity;
+    DenseArray<Ring> rings;
+    atomic<long long> admitted;
+    atomic<long long> rejected;
+
+public:
+    VelocityGuard(vector<VelocityRule> rules, long long capacity) : capacity(capacity), rings(capacity) {
+        for (VelocityRule& rule : rules) {
+            if (rule.maxCount < 1 || rule.maxCount > RING || rule.windowMicros <= 0) {
+                throw "Invalid velocity rule";
+            }
+        }
+        this->rules = rules;
+        this->admitted = 0;
+        this->rejected = 0;
+    }
+
+    // Check a withdrawal at time now (as TransactionLedger::now()) against
+    // every rule and record it if allowed, setting ticket for cancel().
+    // Returns false if a rule would be broken.
+    bool tryAdmit(int customerId, int amount, long long now, unsigned long long& ticket) {
+        if (customerId < 0 || customerId >= this->capacity) {
+            throw "Account is beyond the velocity guard's capacity";
+        }
+        Ring& ring = this->rings[customerId];
+        lock_guard<AccountLock> guard(ring.lock);
+        int held = (int) min(ring.next, (unsigned long long) RING);
+        for (VelocityRule& rule : this->rules) {
+            long long since = now - rule.windowMicros;
+            int count = 1;
+            long long total = amount;
+            for (int i = 0; i < RING; i++) {
+                bool inWindow = i < held && ring.times[i] > since;
+                count += inWindow;
+                total += inWindow ? ring.amounts[i] : 0;
+            }
+            if (count > rule.maxCount || total > rule.maxAmount) {
+                this->rejected.fetch_add(1, memory_order_relaxed);
+                return false;
+            }
+        }
+        // Reuse a cancelled slot or else the oldest. Every rule left room
+        // for this withdrawal, so the oldest is outside every window.
+        int slot = (int) ring.next;
+        if (held == RING) {
+            slot = 0;
+            for (int i = 1; i < RING; i++) {
+                slot = ring.times[i] < ring.times[slot] ? i : slot;
+            }
+        }
+        ring.next++;
+        ring.times[slot] = now;
+        ring.amounts[slot] = amount;
+        // A slot is only overwritten by a later withdrawal, so its time and
+        // index identify this one
+        ticket = (unsigned long long) now * RING + slot;
+        this->admitted.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    // Forget an admitted withdrawal that did not go through, freeing its slot
+    void cancel(int customerId, unsigned long long ticket) {
+        Ring& ring = this->rings[customerId];
+        lock_guard<AccountLock> guard(ring.lock);
+        int slot = ticket % RING;
+        if (ring.times[slot] == (long long) (ticket - slot) / RING) {
+            ring.amounts[slot] = 0;
+            ring.times[slot] = INT64_MIN;
+        }
+    }
+
+    long long getAdmitted() {
+        return this->admitted.load(memory_order_relaxed);
+    }
+
+    long long getRejected() {
+        return this->rejected.load(memory_order_relaxed);
+    }
+};
+
+class BankBranch {
+private:
+    string address;
+    atomic<int> cashOnHand;     // shared by tellers and the bank's collection pass
+    BankSystem* bankSystem;
+    TellerScheduler tellers;
+    VelocityGuard* velocityGuard;   // optional, shared with the bank's other branches
+    StripedCounter* cashTotal;      // optional, the bank's sum of cash across branches
+    int stripe;                     // this branch's slot in cashTotal
+
+    void moveCash(int amount) {
+        if (this->cashTotal != nullptr) {
+            this->cashTotal->add(amount, this->stripe);
+        }
+    }
+
+public:
+    BankBranch(string address, int cashOnHand, BankSystem* bankSystem,
+               TellerScheduler::Policy policy = TellerScheduler::LEAST_LOADED)
+        : tellers(policy) {
+        this->address = address;
+        this->cashOnHand = cashOnHand;
+        this->bankSystem = bankSystem;
+        this->velocityGuard = nullptr;
+        this->cashTotal = nullptr;
+        this->stripe = 0;
+    }
+
+    void setVelocityGuard(VelocityGuard* velocityGuard) {
+        this->velocityGuard = velocityGuard;
+    }
+
+    // Report every change in cash on hand to cashTotal, starting with the
+    // current amount. Call before the branch serves anyone.
+    void attachCashTotal(StripedCounter* cashTotal, int stripe) {
+        this->cashTotal = cashTotal;
+        this->stripe = stripe;
+        this->moveCash(this->cashOnHand.load());
+    }
+
+    void addTeller(BankTeller teller) {
+        this->tellers.addTeller(teller);
+    }
+
+    vector<int> getTellerIds() {
+        return this->tellers.getTellerIds();
+    }
+
+    int openAccount(string customerName) {
+        int customerId;
+        this->tellers.serve([this, &customerName, &customerId](BankTeller& teller) {
+            customerId = this->bankSystem->openAccount(customerName, teller.getId());
+        });
+        return customerId;
+    }
+
+    void deposit(int customerId, int amount) {
+        this->tellers.serve([this, customerId, amount](BankTeller& teller) {
+            this->bankSystem->deposit(customerId, teller.getId(), amount);
+        });
+    }
+
+    void withdraw(int customerId, int amount) {
+        if (amount <= 0) {
+            throw "Withdrawal amount must be positive";
+        }
+        if (this->tellers.getTellerCount() == 0) {
+            throw "Branch does not have any tellers";
+        }
+        if (customerId < 0 || customerId >= this->bankSystem->getAccountCount()) {
+            throw "Account does not exist";
+        }
+        unsigned long long ticket = 0;
+        if (this->velocityGuard != nullptr
+            && !this->velocityGuard->tryAdmit(customerId, amount, TransactionLedger::now(), ticket)) {
+            throw "Withdrawal exceeds velocity limits";
+        }
+        int cash = this->cashOnHand.load();
+        do {
+            if (amount > cash) {
+                if (this->velocityGuard != nullptr) {
+                    this->velocityGuard->cancel(customerId, ticket);
+                }
+                throw "Branch does not have enough cash";
+            }
+        } while (!this->cashOnHand.compare_exchange_weak(cash, cash - amount));
+        this->moveCash(-amount);
+        try {
+            this->tellers.serve([this, customerId, amount](BankTeller& teller) {
+                this->bankSystem->withdraw(customerId, teller.getId(), amount);
+            });
+        } catch (...) {
+            // The cash never left the branch, nor did the withdrawal count
+            this->cashOnHand += amount;
+            this->moveCash(amount);
+            if (this->velocityGuard != nullptr) {
+                this->velocityGuard->cancel(customerId, ticket);
+            }
+            throw;
+        }
+    }
+
+    // No cash leaves the branch, so cashOnHand is untouched
+    void transfer(int fromCustomerId, int toCustomerId, int amount) {
+        this->tellers.serve([this, fromCustomerId, toCustomerId, amount](BankTeller& teller) {
+            this->bankSystem->transfer(fromCustomerId, toCustomerId, amount, teller.getId());
+        });
+    }
+
+    int collectCash(double ratio) {
+        int cash = this->cashOnHand.load();
+        int cashToCollect;
+        do {
+            cashToCollect = (int) round(cash * ratio);
+        } while (!this->cashOnHand.compare_exchange_weak(cash, cash - cashToCollect));
+        this->moveCash(-cashToCollect);
+        return cashToCollect;
+    }
+
+    // Take up to amount out of the branch; returns what was taken
+    int takeCash(int amount) {
+        int cash = this->cashOnHand.load();
+        int cashToTake;
+        do {
+            cashToTake = min(amount, cash);
+        } while (!this->cashOnHand.compare_exchange_weak(cash, cash - cashToTake));
+        this->moveCash(-cashToTake);
+        return cashToTake;
+    }
+
+    int getCashOnHand() {
+        return this->cashOnHand.load();
+    }
+
+    void provideCash(int amount) {
+        this->cashOnHand += amount;
+        this->moveCash(amount);
+    }
+};
+
+// Expected withdrawals at each branch in the next period (e.g. a day), from
+// exponentially weighted averages of the amount and its variance over past
+// periods
+class CashForecast {
+private:
+    double smoothing;           // weight of the newest period, in (0, 1]
+    vector<double> means;
+    vector<double> variances;
+    int periods;
+
+public:
+    CashForecast(int branchCount, double smoothing) : means(branchCount, 0), variances(branchCount, 0) {
+        this->smoothing = smoothing;
+        this->periods = 0;
+    }
+
+    // Fold in one period's withdrawal totals, indexed by branch
+    void addPeriod(const vector<long long>& withdrawn) {
+        for (size_t i = 0; i < this->means.size(); i++) {
+            double amount = withdrawn[i];
+            if (this->periods == 0) {
+                this->means[i] = amount;
+                continue;
+            }
+            double difference = amount - this->means[i];
+            this->means[i] += this->smoothing * difference;
+            this->variances[i] = (1 - this->smoothing) * (this->variances[i] + this->smoothing * difference * difference);
+        }
+        this->periods++;
+    }
+
+    // Fold in one period given as its ledger rows, e.g. from
+    // BankSystem::getTransactionsBetween. tellerBranches maps a teller ID to
+    // a branch index, or -1; see Bank::getTellerBranches.
+    template <typename View>
+    void addPeriod(View rows, const vector<int>& tellerBranches) {
+        vector<long long> withdrawn(this->means.size(), 0);
+        for (TransactionRow row : rows) {
+            if (row.getType() != WITHDRAWAL || (size_t) row.getTellerId() >= tellerBranches.size()) {
+                continue;
+            }
+            int branch = tellerBranches[row.getTellerId()];
+            if (branch >= 0 && (size_t) branch < withdrawn.size()) {
+                withdrawn[branch] += row.getAmount();
+            }
+        }
+        this->addPeriod(withdrawn);
+    }
+
+    double getMean(int branch) {
+        return this->means[branch];
+    }
+
+    double getDeviation(int branch) {
+        return sqrt(this->variances[branch]);
+    }
+
+    // Cash each branch should start the next period with: the expected
+    // withdrawals plus safetyFactor standard deviations
+    vector<long long> getTargets(double safetyFactor) {
+        vector<long long> targets(this->means.size());
+        for (size_t i = 0; i < targets.size(); i++) {
+            targets[i] = (long long) ceil(this->means[i] + safetyFactor * sqrt(this->variances[i]));
+        }
+        return targets;
+    }
+};
+
+// Cheapest flow meeting every node's supply (positive) or demand (negative),
+// by cost scaling (Goldberg and Tarjan). Each phase divides epsilon by
+// SCALING_FACTOR and pushes excess along edges whose reduced cost is
+// negative, lowering a node's price when it has none left, until the flow is
+// optimal for the original integer costs. Each node's arcs are stored
+// together, and global price updates keep relabels few.
+class MinCostFlow {
+public:
+    static constexpr long long INFINITE_CAPACITY = INT64_MAX / 4;
+
+private:
+    static const int SCALING_FACTOR = 16;
+
+    class Edge {
+    public:
+        int from;
+        int to;
+        long long capacity;     // left in the residual graph
+        long long cost;
+    };
+
+    int nodeCount;
+    vector<Edge> edges;         // edge i's reverse is edge i ^ 1
+    vector<long long> supplies;
+
+public:
+    MinCostFlow(int nodeCount) : supplies(nodeCount, 0) {
+        this->nodeCount = nodeCount;
+    }
+
+    // Returns the edge's handle for getFlow
+    int addEdge(int from, int to, long long capacity, long long cost) {
+        this->edges.push_back(Edge{from, to, capacity, cost});
+        this->edges.push_back(Edge{to, from, 0, -cost});
+        return this->edges.size() - 2;
+    }
+
+    void addSupply(int node, long long amount) {
+        this->supplies[node] += amount;
+    }
+
+    long long getFlow(int edge) {
+        return this->edges[edge ^ 1].capacity;
+    }
+
+    // Route all supply to the demands; returns the total cost
+    long long solve() {
+        int n = this->nodeCount;
+        long long balance = 0;
+        long long totalSupply = 0;
+        for (long long supply : this->supplies) {
+            balance += supply;
+            totalSupply += max(supply, 0LL);
+        }
+        if (balance != 0) {
+            throw "Supplies and demands do not balance";
+        }
+        // An optimal flow never needs more on one edge than all the supply,
+        // and the bound keeps excesses from overflowing
+        for (size_t i = 0; i < this->edges.size(); i += 2) {
+            this->edges[i].capacity = min(this->edges[i].capacity, totalSupply);
+        }
+
+        // Edges copied into arcs grouped by source node, so a node's arcs sit
+        // together in memory; costs are (n + 1)-scaled, as a 1-optimal flow
+        // for those is optimal for the real costs
+        class Arc {
+        public:
+            int to;
+            int mate;               // the reverse arc
+            long long capacity;
+            long long cost;
+        };
+        vector<int> start(n + 1, 0);
+        for (Edge& edge : this->edges) {
+            start[edge.from + 1]++;
+        }
+        for (int v = 0; v < n; v++) {
+            start[v + 1] += start[v];
+        }
+        vector<int> positions(this->edges.size());
+        vector<int> next(start.begin(), start.end() - 1);
+        for (size_t i = 0; i < this->edges.size(); i++) {
+            positions[i] = next[this->edges[i].from]++;
+        }
+        vector<Arc> arcs(this->edges.size());
+        long long epsilon = 1;
+        for (size_t i = 0; i < this->edges.size(); i++) {
+            Edge& edge = this->edges[i];
+            arcs[positions[i]] = Arc{edge.to, positions[i ^ 1], edge.capacity, edge.cost * (n + 1)};
+            epsilon = max(epsilon, abs(edge.cost * (n + 1)));
+        }
+        vector<long long> prices(n, 0);
+        vector<long long> excess = this->supplies;
+        vector<int> current(n);
+        deque<int> active;
+
+        // Lower every price by epsilon times the node's distance to the
+        // nearest deficit, an arc being floor(reduced cost / epsilon) + 1
+        // long. Every node then has an admissible path to a deficit, which
+        // saves the many small relabels that would find it. Distances are
+        // capped at n, which keeps them in an array of buckets and still
+        // leaves the flow epsilon-optimal.
+        vector<int> distances(n);
+        vector<char> settled(n);
+        vector<vector<int>> buckets(n + 1);
+        auto updatePrices = [&]() {
+            int remaining = 0;
+            for (int v = 0; v < n; v++) {
+                distances[v] = INT32_MAX;
+                settled[v] = false;
+                remaining += excess[v] > 0;
+                if (excess[v] < 0) {
+                    distances[v] = 0;
+                    buckets[0].push_back(v);
+                }
+            }
+            int distance = 0;
+            for (; distance <= n && remaining > 0; distance++) {
+                for (size_t k = 0; k < buckets[distance].size() && remaining > 0; k++) {
+                    int w = buckets[distance][k];
+                    if (settled[w]) {
+                        continue;
+                    }
+                    settled[w] = true;
+                    remaining -= excess[w] > 0;
+                    for (int j = start[w]; j < start[w + 1]; j++) {
+                        int v = arcs[j].to;
+                        Arc& into = arcs[arcs[j].mate];     // from v into w
+                        if (into.capacity > 0 && !settled[v]) {
+                            long long reduced = into.cost + prices[v] - prices[w];
+                            long long length = reduced < 0 ? 0 : reduced / epsilon + 1;
+                            int reached = min((long long) n, distance + length);
+                            if (reached < distances[v]) {
+                                distances[v] = reached;
+                                buckets[reached].push_back(v);
+                            }
+                        }
+                    }
+                }
+                if (remaining > 0) {
+                    buckets[distance].clear();
+                }
+            }
+            // Nodes with excess that no deficit can be reached from
+            if (remaining > 0) {
+                throw "No flow meets the demands";
+            }
+            // Stopped early, so nothing left unsettled is nearer than the last bucket
+            int farthest = max(distance - 1, 0);
+            for (int d = farthest; d <= n; d++) {
+                buckets[d].clear();
+            }
+            for (int v = 0; v < n; v++) {
+                prices[v] -= (settled[v] ? distances[v] : farthest) * epsilon;
+                current[v] = start[v];
+            }
+        };
+
+        // Lower v's price just enough for its cheapest residual arc to become
+        // admissible; false if it has none
+        int relabels = 0;
+        auto relabel = [&](int v) {
+            long long best = INT64_MIN;
+            for (int j = start[v]; j < start[v + 1]; j++) {
+                if (arcs[j].capacity > 0) {
+                    best = max(best, prices[arcs[j].to] - arcs[j].cost);
+                }
+            }
+            if (best == INT64_MIN) {
+                return false;
+            }
+            prices[v] = best - epsilon;
+            current[v] = start[v];
+            if (++relabels == n) {
+                updatePrices();
+                relabels = 0;
+            }
+            return true;
+        };
+        auto admissible = [&](int v, int j) {
+            return arcs[j].capacity > 0 && arcs[j].cost + prices[v] - prices[arcs[j].to] < 0;
+        };
+
+        do {
+            epsilon = max(1LL, epsilon / SCALING_FACTOR);
+            for (int v = 0; v < n; v++) {
+                for (int j = start[v]; j < start[v + 1]; j++) {
+                    if (admissible(v, j)) {
+                        excess[v] -= arcs[j].capacity;
+                        excess[arcs[j].to] += arcs[j].capacity;
+                        arcs[arcs[j].mate].capacity += arcs[j].capacity;
+                        arcs[j].capacity = 0;
+                    }
+                }
+            }
+            for (int v = 0; v < n; v++) {
+                if (excess[v] > 0) {
+                    active.push_back(v);
+                }
+            }
+            updatePrices();
+            while (!active.empty()) {
+                int v = active.front();
+                active.pop_front();
+                while (excess[v] > 0) {
+                    if (current[v] == start[v + 1]) {
+                        if (!relabel(v)) {
+                            throw "No flow meets the demands";
+                        }
+                        continue;
+                    }
+                    int j = current[v];
+                    if (!admissible(v, j)) {
+                        current[v]++;
+                        continue;
+                    }
+                    // Look ahead: excess that would be stuck at w, as it has
+                    // no admissible arc either, is better not pushed
+                    int w = arcs[j].to;
+                    if (excess[w] >= 0) {
+                        while (current[w] < start[w + 1] && !admissible(w, current[w])) {
+                            current[w]++;
+                        }
+                        if (current[w] == start[w + 1] && relabel(w)) {
+                            continue;
+                        }
+                    }
+                    long long amount = min(excess[v], arcs[j].capacity);
+                    arcs[j].capacity -= amount;
+                    arcs[arcs[j].mate].capacity += amount;
+                    excess[v] -= amount;
+                    excess[w] += amount;
+                    if (excess[w] > 0 && excess[w] <= amount) {
+                        active.push_back(w);
+                    }
+                }
+            }
+        } while (epsilon > 1);
+
+        for (size_t i = 0; i < this->edges.size(); i++) {
+            this->edges[i].capacity = arcs[positions[i]].capacity;
+        }
+        long long total = 0;
+        for (size_t i = 0; i < this->edges.size(); i += 2) {
+            total += this->getFlow(i) * this->edges[i].cost;
+        }
+        return total;
+    }
+};
+
+// A position on a flat map, in kilometres
+class Location {
+public:
+    double x;
+    double y;
+};
+
+// Cash carried from one branch, by index in Bank::getBranches, to another;
+// either end may be the bank's VAULT
+class CashMovement {
+public:
+    static const int VAULT = -1;
+
+    int from;
+    int to;
+    long long amount;
+};
+
+class RebalancingPlan {
+public:
+    vector<CashMovement> movements;     // in an order that never moves cash a branch has not received yet
+    long long cost;                     // sum of amount x cost per unit over the movements
+    long long shortfall;                // target cash the bank had no cash left to cover
+};
+
+// Plans the night's cash movements: every branch should start the next day
+// with its target (see CashForecast), and the cash above it goes to branches
+// below theirs or back to the vault. Moving one unit costs its distance in
+// whole kilometres, plus one. Cash may go straight between a branch and its
+// NEIGHBOURS nearest branches or through the vault, and the cheapest plan is
+// a minimum-cost flow over those routes.
+class RebalancingPlanner {
+public:
+    static const int NEIGHBOURS = 8;
+
+private:
+    vector<Location> branches;
+    Location vault;
+    vector<int> neighbours;     // NEIGHBOURS per branch, or fewer followed by -1
+
+    Location getLocation(int site) {
+        return site == CashMovement::VAULT ? this->vault : this->branches[site];
+    }
+
+    // Nearest branches first, by searching rings of grid cells around each
+    // branch until no unsearched cell can be closer than the ones found
+    void findNeighbours() {
+        int count = this->branches.size();
+        this->neighbours.assign((size_t) count * NEIGHBOURS, -1);
+        if (count < 2) {
+            return;
+        }
+        double minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+        for (Location& location : this->branches) {
+            minX = min(minX, location.x);
+            minY = min(minY, location.y);
+            maxX = max(maxX, location.x);
+            maxY = max(maxY, location.y);
+        }
+        int side = max(1, (int) sqrt(count / 2.0));
+        double cellSize = max(max(maxX - minX, maxY - minY) / side, 1e-9);
+        auto cellOf = [minX, minY, cellSize, side](double x, double y, int& column, int& row) {
+            column = min(side - 1, (int) ((x - minX) / cellSize));
+            row = min(side - 1, (int) ((y - minY) / cellSize));
+        };
+        vector<int> cellStart(side * side + 1, 0);
+        vector<int> cellOrder(count);
+        for (Location& location : this->branches) {
+            int column, row;
+            cellOf(location.x, location.y, column, row);
+            cellStart[row * side + column + 1]++;
+        }
+        for (int cell = 0; cell < side * side; cell++) {
+            cellStart[cell + 1] += cellStart[cell];
+        }
+        vector<int> next(cellStart.begin(), cellStart.end() - 1);
+        for (int i = 0; i < count; i++) {
+            int column, row;
+            cellOf(this->branches[i].x, this->branches[i].y, column, row);
+            cellOrder[next[row * side + column]++] = i;
+        }
+
+        vector<pair<double, int>> nearest;     // max-heap on distance
+        for (int i = 0; i < count; i++) {
+            Location here = this->branches[i];
+            int column, row;
+            cellOf(here.x, here.y, column, row);
+            nearest.clear();
+            for (int ring = 0; ring < side; ring++) {
+                // Everything in this ring or beyond is at least this far away
+                if ((int) nearest.size() == NEIGHBOURS && nearest.front().first <= (ring - 1) * cellSize) {
+                    break;
+                }
+                for (int r = row - ring; r <= row + ring; r++) {
+                    for (int c = column - ring; c <= column + ring; c++) {
+                        bool onRing = abs(r - row) == ring || abs(c - column) == ring;
+                        if (!onRing || r < 0 || c < 0 || r >= side || c >= side) {
+                            continue;
+                        }
+                        for (int k = cellStart[r * side + c]; k < cellStart[r * side + c + 1]; k++) {
+                            int other = cellOrder[k];
+                            if (other == i) {
+                                continue;
+                            }
+                            double distance = hypot(this->branches[other].x - here.x, this->branches[other].y - here.y);
+                            if ((int) nearest.size() < NEIGHBOURS) {
+                                nearest.push_back({distance, other});
+                                push_heap(nearest.begin(), nearest.end());
+                            } else if (distance < nearest.front().first) {
+                                pop_heap(nearest.begin(), nearest.end());
+                                nearest.back() = {distance, other};
+                                push_heap(nearest.begin(), nearest.end());
+                            }
+                        }
+                    }
+                }
+            }
+            sort_heap(nearest.begin(), nearest.end());
+            for (size_t k = 0; k < nearest.size(); k++) {
+                this->neighbours[(size_t) i * NEIGHBOURS + k] = nearest[k].second;
+            }
+        }
+    }
+
+public:
+    RebalancingPlanner(vector<Location> branches, Location vault) {
+        this->branches = branches;
+        this->vault = vault;
+        this->findNeighbours();
+    }
+
+    // Cost of moving one unit of cash; CashMovement::VAULT for the vault
+    long long getCost(int from, int to) {
+        Location a = this->getLocation(from);
+        Location b = this->getLocation(to);
+        return (long long) round(hypot(a.x - b.x, a.y - b.y)) + 1;
+    }
+
+    // cash and targets are indexed by branch; vaultCash is what the vault
+    // holds and can hand out
+    RebalancingPlan plan(const vector<long long>& cash, long long vaultCash, const vector<long long>& targets) {
+        int count = this->branches.size();
+        int vaultNode = count;
+        int shortageNode = count + 1;   // supplies the cash nobody has, at a cost above any route
+        MinCostFlow flow(count + 2);
+
+        long long need = 0;
+        long long penalty = 1;
+        vector<CashMovement> routes;    // amount holds the route's edge until the flow is known
+        auto addRoute = [this, &flow, &routes, vaultNode](int from, int to) {
+            int fromNode = from == CashMovement::VAULT ? vaultNode : from;
+            int toNode = to == CashMovement::VAULT ? vaultNode : to;
+            int edge = flow.addEdge(fromNode, toNode, MinCostFlow::INFINITE_CAPACITY, this->getCost(from, to));
+            routes.push_back(CashMovement{from, to, edge});
+        };
+        for (int i = 0; i < count; i++) {
+            long long surplus = cash[i] - targets[i];
+            flow.addSupply(i, surplus);
+            need -= surplus;
+            for (int k = 0; k < NEIGHBOURS; k++) {
+                int other = this->neighbours[(size_t) i * NEIGHBOURS + k];
+                if (other >= 0) {
+                    addRoute(i, other);
+                }
+            }
+            addRoute(i, CashMovement::VAULT);
+            addRoute(CashMovement::VAULT, i);
+            penalty = max(penalty, 2 * this->getCost(i, CashMovement::VAULT) + 1);
+        }
+        long long shortfall = max(0LL, need - vaultCash);
+        flow.addSupply(vaultNode, need - shortfall);
+        flow.addSupply(shortageNode, shortfall);
+        for (int i = 0; i < count && shortfall > 0; i++) {
+            if (cash[i] < targets[i]) {
+                flow.addEdge(shortageNode, i, targets[i] - cash[i], penalty);
+            }
+        }
+
+        RebalancingPlan plan;
+        plan.cost = flow.solve() - penalty * shortfall;
+        plan.shortfall = shortfall;
+
+        // A route leaves once every route into its source has arrived; the
+        // flow has no cycles, as one would only add cost. The vault is node
+        // count here.
+        vector<vector<CashMovement>> outgoing(count + 1);
+        vector<int> incoming(count + 1, 0);
+        for (CashMovement route : routes) {
+            route.amount = flow.getFlow(route.amount);
+            if (route.amount > 0) {
+                int from = route.from == CashMovement::VAULT ? count : route.from;
+                int to = route.to == CashMovement::VAULT ? count : route.to;
+                outgoing[from].push_back(route);
+                incoming[to]++;
+            }
+        }
+        vector<int> ready;
+        for (int v = 0; v <= count; v++) {
+            if (incoming[v] == 0 && !outgoing[v].empty()) {
+                ready.push_back(v);
+            }
+        }
+        while (!ready.empty()) {
+            int v = ready.back();
+            ready.pop_back();
+            for (CashMovement& movement : outgoing[v]) {
+                plan.movements.push_back(movement);
+                int to = movement.to == CashMovement::VAULT ? count : movement.to;
+                if (--incoming[to] == 0 && !outgoing[to].empty()) {
+                    ready.push_back(to);
+                }
+            }
+        }
+        return plan;
+    }
+};
+
+class Bank {
+private:
+    static const int MIN_BRANCHES_PER_THREAD = 1024;
+
+    vector<BankBranch*> branches;
+    BankSystem* bankSystem;
+    long long totalCash;
+    VelocityGuard* velocityGuard;
+    StripedCounter cashInBranches;  // kept equal to the sum of every branch's cash on hand
+
+public:
+    Bank(vector<BankBranch*> branches, BankSystem* bankSystem, long long totalCash) {
+        this->branches = branches;
+        this->bankSystem = bankSystem;
+        this->totalCash = totalCash;
+        this->velocityGuard = nullptr;
+        for (size_t i = 0; i < branches.size(); i++) {
+            branches[i]->attachCashTotal(&this->cashInBranches, i);
+        }
+    }
+
+    // The branch stays owned by the bank; the pointer remains valid as more are added
+    BankBranch* addBranch(string address, int initialFunds) {
+        BankBranch* branch = new BankBranch(address, initialFunds, this->bankSystem);
+        branch->setVelocityGuard(this->velocityGuard);
+        branch->attachCashTotal(&this->cashInBranches, this->branches.size());
+        this->branches.push_back(branch);
+        return branch;
+    }
+
+    // Apply velocityGuard's limits to withdrawals at every branch, existing and future
+    void setVelocityGuard(VelocityGuard* velocityGuard) {
+        this->velocityGuard = velocityGuard;
+        for (BankBranch* branch : this->branches) {
+            branch->setVelocityGuard(velocityGuard);
+        }
+    }
+
+    vector<BankBranch*> getBranches() {
+        return this->branches;
+    }
+
+    long long getTotalCash() {
+        return this->totalCash;
+    }
+
+    // Cash held across all branches, read without visiting any of them
+    long long getCashInBranches() {
+        return this->cashInBranches.get();
+    }
+
+    // What the bank owes its customers; see BankSystem::getTotalBalance
+    long long getTotalBalance() {
+        return this->bankSystem->getTotalBalance();
+    }
+
+    // Collect from every branch in place. Large banks are split into
+    // contiguous ranges, one per core, each summing into its own slot;
+    // the slots are added to totalCash once all workers finish.
+    void collectCash(double ratio) {
+        int branchCount = this->branches.size();
+        int threadCount = min((int) thread::hardware_concurrency(), branchCount / MIN_BRANCHES_PER_THREAD);
+        threadCount = max(threadCount, 1);
+        vector<long long> collected(threadCount, 0);
+        auto collectRange = [this, ratio, branchCount, threadCount, &collected](int t) {
+            int first = (long long) branchCount * t / threadCount;
+            int last = (long long) branchCount * (t + 1) / threadCount;
+            long long sum = 0;
+            for (int i = first; i < last; i++) {
+                sum += this->branches[i]->collectCash(ratio);
+            }
+            collected[t] = sum;
+        };
+        vector<thread> workers;
+        for (int t = 1; t < threadCount; t++) {
+            workers.push_back(thread(collectRange, t));
+        }
+        collectRange(0);
+        for (thread& worker : workers) {
+            worker.join();
+        }
+        for (long long sum : collected) {
+            this->totalCash += sum;
+        }
+    }
+
+    // Carry out movements in order, e.g. a RebalancingPlan's; VAULT is
+    // totalCash. A movement takes only what its source still holds. Returns
+    // the cash moved.
+    long long moveCash(const vector<CashMovement>& movements) {
+        long long moved = 0;
+        for (const CashMovement& movement : movements) {
+            long long amount;
+            if (movement.from == CashMovement::VAULT) {
+                amount = min(movement.amount, this->totalCash);
+                this->totalCash -= amount;
+            } else {
+                amount = this->branches[movement.from]->takeCash(min(movement.amount, (long long) INT32_MAX));
+            }
+            if (movement.to == CashMovement::VAULT) {
+                this->totalCash += amount;
+            } else {
+                this->branches[movement.to]->provideCash(amount);
+            }
+            moved += amount;
+        }
+        return moved;
+    }
+
+    // Index in getBranches of each teller's branch, by teller ID, or -1
+    vector<int> getTellerBranches() {
+        vector<int> tellerBranches;
+        for (size_t i = 0; i < this->branches.size(); i++) {
+            for (int tellerId : this->branches[i]->getTellerIds()) {
+                if (tellerId < 0) {
+                    continue;
+                }
+                if (tellerId >= (int) tellerBranches.size()) {
+                    tellerBranches.resize(tellerId + 1, -1);
+                }
+                tellerBranches[tellerId] = i;
+            }
+        }
+        return tellerBranches;
+    }
+
+    void printTransactions() {
+        cout.flush();
+        this->exportTransactions(STDOUT_FILENO);
+    }
+
+    void exportTransactions(int fd) {
+        TransactionRenderer::writeLedger(this->bankSystem->getTransactions(), fd);
+    }
+
+    // The ledger as a compressed binary archive for LedgerArchiveReader;
+    // returns its size in bytes
+    long long exportArchive(int fd) {
+        LedgerArchiveWriter writer(fd);
+        writer.addAll(this->bankSystem->getTransactions());
+        return writer.finish();
+    }
+
+    // Newest first
+    void printStatement(int customerId) {
+        cout.flush();
+        TransactionRenderer::writeLedger(this->bankSystem->getHistory(customerId), STDOUT_FILENO);
+    }
+};
+
+// Discrete-event model of one branch for comparing teller policies. Customers
+// arrive at random, each needs one operation whose length depends on its type
+// and on the speed of the teller who serves it. Times are in minutes.
+class BranchSimulation {
+public:
+    enum Policy {
+        SKEWED_RANDOM,  // the old getAvailableTeller: round() of a uniform draw
+        RANDOM,
+        LEAST_LOADED,   // shortest expected wait, from the known mean of each operation type
+        WORK_STEALING,  // random queue, but an idle teller takes the oldest customer of the longest queue
+    };
+
+    class Result {
+    public:
+        vector<double> waits;   // sorted
+        vector<int> served;     // per teller
+
+        double percentile(double p) {
+            return this->waits[min(this->waits.size() - 1, (size_t) (p * this->waits.size()))];
+        }
+    };
+
+private:
+    class Customer {
+    public:
+        double arrival;
+        double work;            // minutes at speed 1
+        double expectedWork;    // mean for the operation type, which is all the scheduler knows
+    };
+
+    class Event {
+    public:
+        double time;
+        int teller;             // -1 for an arrival
+
+        bool operator>(const Event& other) const {
+            return this->time > other.time;
+        }
+    };
+
+    vector<double> tellerSpeeds;
+    double arrivalsPerMinute;
+
+public:
+    BranchSimulation(vector<double> tellerSpeeds, double arrivalsPerMinute) {
+        this->tellerSpeeds = tellerSpeeds;
+        this->arrivalsPerMinute = arrivalsPerMinute;
+    }
+
+    Result run(Policy policy, int customerCount, unsigned seed) {
+        // Operation mix: open account, deposit, withdrawal
+        const double shares[] = {0.10, 0.55, 0.35};
+        const double meanMinutes[] = {12, 3, 4};
+
+        int tellerCount = this->tellerSpeeds.size();
+        mt19937 random(seed);
+        uniform_real_distribution<double> uniform(0, 1);
+        exponential_distribution<double> interarrival(this->arrivalsPerMinute);
+        vector<deque<Customer>> queues(tellerCount);
+        vector<double> queuedWork(tellerCount, 0);
+        vector<double> expectedFree(tellerCount, 0);
+        vector<bool> busy(tellerCount, false);
+        priority_queue<Event, vector<Event>, greater<Event>> events;
+        Result result;
+        result.served = vector<int>(tellerCount, 0);
+
+        auto startService = [&](int teller, double now) {
+            Customer customer = queues[teller].front();
+            queues[teller].pop_front();
+            queuedWork[teller] -= customer.expectedWork;
+            result.waits.push_back(now - customer.arrival);
+            result.served[teller]++;
+            busy[teller] = true;
+            expectedFree[teller] = now + customer.expectedWork / this->tellerSpeeds[teller];
+            events.push(Event{now + customer.work / this->tellerSpeeds[teller], teller});
+        };
+
+        int arrived = 0;
+        events.push(Event{interarrival(random), -1});
+        while (!events.empty()) {
+            Event event = events.top();
+            events.pop();
+            double now = event.time;
+            if (event.teller < 0) {
+                Customer customer;
+                customer.arrival = now;
+                double draw = uniform(random);
+                int type = draw < shares[0] ? 0 : draw < shares[0] + shares[1] ? 1 : 2;
+                customer.expectedWork = meanMinutes[type];
+                customer.work = exponential_distribution<double>(1 / meanMinutes[type])(random);
+
+                int teller;
+                if (policy == SKEWED_RANDOM) {
+                    teller = (int) round(uniform(random) * (tellerCount - 1));
+                } else if (policy == LEAST_LOADED) {
+                    teller = 0;
+                    double bestWait = INFINITY;
+                    for (int t = 0; t < tellerCount; t++) {
+                        double finish = max(expectedFree[t] - now, 0.0)
+                                        + (queuedWork[t] + customer.expectedWork) / this->tellerSpeeds[t];
+                        if (finish < bestWait) {
+                            bestWait = finish;
+                            teller = t;
+                        }
+                    }
+                } else {
+                    teller = uniform_int_distribution<int>(0, tellerCount - 1)(random);
+                }
+                queues[teller].push_back(customer);
+                queuedWork[teller] += customer.expectedWork;
+                if (!busy[teller]) {
+                    startService(teller, now);
+                }
+                if (++arrived < customerCount) {
+                    events.push(Event{now + interarrival(random), -1});
+                }
+            } else {
+                int teller = event.teller;
+                busy[teller] = false;
+                if (queues[teller].empty() && policy == WORK_STEALING) {
+                    int victim = -1;
+                    for (int t = 0; t < tellerCount; t++) {
+                        if (!queues[t].empty() && (victim < 0 || queues[t].size() > queues[victim].size())) {
+                            victim = t;
+                        }
+                    }
+                    if (victim >= 0) {
+                        Customer stolen = queues[victim].front();
+                        queues[victim].pop_front();
+                        queuedWork[victim] -= stolen.expectedWork;
+                        queues[teller].push_back(stolen);
+                        queuedWork[teller] += stolen.expectedWork;
+                    }
+                }
+                if (!queues[teller].empty()) {
+                    startService(teller, now);
+                }
+            }
+        }
+        sort(result.waits.begin(), result.waits.end());
+        return result;
+    }
+};
+
+// Days of cash going in and out of a bank's branches, comparing nightly
+// policies by how often a customer finds their branch without enough cash.
+// Each branch gets its own daily rates of withdrawals and of cash deposits,
+// so some branches drain while others fill up.
+class CashSimulation {
+public:
+    enum Policy {
+        FLAT_RATIO,     // Bank::collectCash(setting), then the vault shared out evenly
+        PLANNED,        // RebalancingPlanner towards CashForecast targets with setting deviations
+    };
+
+    class Result {
+    public:
+        long long withdrawals;
+        long long stockouts;        // withdrawals refused for want of cash
+        long long cashMoved;
+        long long cost;             // priced by RebalancingPlanner::getCost
+        double nightSeconds;        // forecasting and planning over all nights
+    };
+
+private:
+    static const int ACCOUNTS = 10000;
+    static constexpr double MEAN_AMOUNT = 200;
+    static constexpr double MEAN_VISITS = 40;     // withdrawals, and deposits, at an average branch a day
+
+    vector<Location> locations;
+    Location vault;
+    vector<double> withdrawalRates;
+    vector<double> depositRates;
+    int startingCash;
+
+public:
+    // Branches spread over a square of side kilometres, the vault in the middle
+    CashSimulation(int branchCount, double side, unsigned seed) {
+        mt19937 random(seed);
+        uniform_real_distribution<double> position(0, side);
+        lognormal_distribution<double> spread(-0.18, 0.6);      // mean 1
+        for (int i = 0; i < branchCount; i++) {
+            this->locations.push_back(Location{position(random), position(random)});
+            this->withdrawalRates.push_back(MEAN_VISITS * spread(random));
+            this->depositRates.push_back(MEAN_VISITS * spread(random));
+        }
+        this->vault = Location{side / 2, side / 2};
+        this->startingCash = (int) (1.5 * MEAN_VISITS * MEAN_AMOUNT);
+    }
+
+    Result run(Policy policy, double setting, int days, unsigned seed) {
+        int count = this->locations.size();
+        BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>());
+        Bank bank = Bank(vector<BankBranch*>(), &bankSystem, 0);
+        for (int i = 0; i < count; i++) {
+            bank.addBranch("Branch " + to_string(i), this->startingCash)->addTeller(BankTeller(i));
+        }
+        for (int i = 0; i < ACCOUNTS; i++) {
+            bankSystem.deposit(bankSystem.openAccount("Customer", 0), 0, 1000000000);
+        }
+        vector<BankBranch*> branches = bank.getBranches();
+        vector<int> tellerBranches = bank.getTellerBranches();
+        RebalancingPlanner planner(this->locations, this->vault);
+        CashForecast forecast(count, 0.2);
+
+        mt19937 random(seed);
+        exponential_distribution<double> amounts(1 / MEAN_AMOUNT);
+        Result result = {0, 0, 0, 0, 0};
+        vector<bool> visits;    // true for a withdrawal
+        for (int day = 0; day < days; day++) {
+            long long dayStart = TransactionLedger::now();
+            for (int i = 0; i < count; i++) {
+                int withdrawals = poisson_distribution<int>(this->withdrawalRates[i])(random);
+                int deposits = poisson_distribution<int>(this->depositRates[i])(random);
+                visits.assign(withdrawals, true);
+                visits.resize(withdrawals + deposits, false);
+                shuffle(visits.begin(), visits.end(), random);
+                for (bool withdrawal : visits) {
+                    int customerId = random() % ACCOUNTS;
+                    int amount = max(1, (int) amounts(random));
+                    if (!withdrawal) {
+                        // The customer's cash goes in the drawer
+                        branches[i]->deposit(customerId, amount);
+                        branches[i]->provideCash(amount);
+                        continue;
+                    }
+                    result.withdrawals++;
+                    try {
+                        branches[i]->withdraw(customerId, amount);
+                    } catch (const char* error) {
+                        result.stockouts++;
+                    }
+                }
+            }
+            long long dayEnd = TransactionLedger::now();
+
+            auto start = chrono::steady_clock::now();
+            if (policy == FLAT_RATIO) {
+                vector<int> before(count);
+                for (int i = 0; i < count; i++) {
+                    before[i] = branches[i]->getCashOnHand();
+                }
+                bank.collectCash(setting);
+                long long share = bank.getTotalCash() / count;
+                vector<CashMovement> movements;
+                for (int i = 0; i < count; i++) {
+                    long long collected = before[i] - branches[i]->getCashOnHand();
+                    result.cashMoved += collected;
+                    result.cost += collected * planner.getCost(i, CashMovement::VAULT);
+                    movements.push_back(CashMovement{CashMovement::VAULT, i, share});
+                    result.cost += share * planner.getCost(CashMovement::VAULT, i);
+                }
+                result.cashMoved += bank.moveCash(movements);
+            } else {
+                forecast.addPeriod(bankSystem.getTransactionsBetween(dayStart, dayEnd + 1), tellerBranches);
+                vector<long long> cash(count);
+                for (int i = 0; i < count; i++) {
+                    cash[i] = branches[i]->getCashOnHand();
+                }
+                RebalancingPlan plan = planner.plan(cash, bank.getTotalCash(), forecast.getTargets(setting));
+                result.cashMoved += bank.moveCash(plan.movements);
+                result.cost += plan.cost;
+            }
+            result.nightSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            // The next day's rows must not share a timestamp with this day's
+            while (TransactionLedger::now() <= dayEnd) {
+                this_thread::yield();
+            }
+        }
+        for (BankBranch* branch : branches) {
+            delete branch;
+        }
+        return result;
+    }
+};
+
+// Append and scan 10M deposits: heap-allocated Transaction objects versus the columnar ledger
+void benchmarkLedger() {
+    const int count = 10000000;
+    auto start = chrono::steady_clock::now();
+    vector<Transaction*> objects;
+    for (int i = 0; i < count; i++) {
+        objects.push_back(new Deposit(i % 1000, i % 7, i % 500));
+    }
+    double objectAppend = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    start = chrono::steady_clock::now();
+    long long objectTotal = 0;
+    for (Transaction* transaction : objects) {
+        objectTotal += transaction->getAmount();
+    }
+    double objectScan = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (Transaction* transaction : objects) {
+        delete transaction;
+    }
+
+    TransactionLedger ledger;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        ledger.append(DEPOSIT, i % 1000, i % 7, i % 500);
+    }
+    double ledgerAppend = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    start = chrono::steady_clock::now();
+    long long ledgerTotal = 0;
+    for (TransactionRow row : LedgerView(&ledger, 0, ledger.getSize())) {
+        ledgerTotal += row.getAmount();
+    }
+    double ledgerScan = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << count << " transactions: objects append " << objectAppend * 1000 << "ms scan " << objectScan * 1000
+         << "ms, ledger append " << ledgerAppend * 1000 << "ms scan " << ledgerScan * 1000 << "ms ("
+         << (objectTotal == ledgerTotal ? "totals match" : "totals differ") << ")" << endl;
+}
+
+// Render 10M ledger rows to /dev/null: a string per row through cout versus
+// TransactionRenderer's buffered writes
+void benchmarkRendering() {
+    const int count = 10000000;
+    TransactionLedger ledger;
+    for (int i = 0; i < count; i++) {
+        ledger.append(i % 3 == 0 ? WITHDRAWAL : DEPOSIT, i % 100000, i % 40, i % 5000);
+    }
+    LedgerView view(&ledger, 0, ledger.getSize());
+    int devNull = open("/dev/null", O_WRONLY);
+
+    ofstream sink("/dev/null");
+    auto start = chrono::steady_clock::now();
+    for (TransactionRow row : view) {
+        sink << row.getTransactionDescription() << endl;
+    }
+    double stringSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    TransactionRenderer::writeLedger(view, devNull);
+    double rendererSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    close(devNull);
+
+    cout << count << " lines: strings + endl " << count / stringSeconds / 1e6 << "M lines/s, renderer "
+         << count / rendererSeconds / 1e6 << "M lines/s" << endl;
+}
+
+// Deposit/withdraw throughput as threads are added; each thread works its own
+// accounts, and the final balances are checked against what was applied
+void benchmarkConcurrentAccounts() {
+    const int operationsPerThread = 1000000;
+    const int accountsPerThread = 1024;
+    int maxThreads = max(4u, thread::hardware_concurrency());
+    for (int threadCount = 1; threadCount <= maxThreads; threadCount *= 2) {
+        BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>());
+        for (int i = 0; i < threadCount * accountsPerThread; i++) {
+            bankSystem.openAccount("Customer", 0);
+        }
+        vector<thread> workers;
+        auto start = chrono::steady_clock::now();
+        for (int t = 0; t < threadCount; t++) {
+            workers.push_back(thread([&bankSystem, t, operationsPerThread, accountsPerThread]() {
+                for (int i = 0; i < operationsPerThread; i++) {
+                    int customerId = t * accountsPerThread + (i / 2) % accountsPerThread;
+                    if (i % 2 == 0) {
+                        bankSystem.deposit(customerId, t, 10);
+                    } else {
+                        bankSystem.withdraw(customerId, t, 10);
+                    }
+                }
+            }));
+        }
+        for (thread& worker : workers) {
+            worker.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        long long total = bankSystem.getTotalBalance();
+        cout << threadCount << " threads: " << (double) threadCount * operationsPerThread / seconds / 1e6
+             << "M operations/s, total balance " << total << " (expected 0)" << endl;
+    }
+}
+
+// Logged deposits at 1, 8 and 64 client threads for each durability mode:
+// throughput and p99 time from call to durable return
+void benchmarkWriteAheadLog() {
+    const int totalOperations = 12800;
+    const string path = "bank_bench.wal";
+    const char* modeNames[] = {"per-operation", "per-batch", "time-window"};
+    int threadCounts[] = {1, 8, 64};
+    for (int mode = 0; mode < 3; mode++) {
+        for (int threadCount : threadCounts) {
+            unlink(path.c_str());
+            BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>());
+            WriteAheadLog* log = new WriteAheadLog(path, (WriteAheadLog::DurabilityMode) mode, 200);
+            bankSystem.attachLog(log);
+            for (int i = 0; i < threadCount; i++) {
+                bankSystem.openAccount("Customer", 0);
+            }
+
+            int operationsPerThread = totalOperations / threadCount;
+            vector<vector<double>> latencies(threadCount);
+            vector<thread> clients;
+            auto start = chrono::steady_clock::now();
+            for (int t = 0; t < threadCount; t++) {
+                clients.push_back(thread([&bankSystem, &latencies, t, operationsPerThread]() {
+                    for (int i = 0; i < operationsPerThread; i++) {
+                        auto begin = chrono::steady_clock::now();
+                        bankSystem.deposit(t, t, 1);
+                        latencies[t].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - begin).count());
+                    }
+                }));
+            }
+            for (thread& client : clients) {
+                client.join();
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            delete log;
+
+            vector<double> all;
+            for (vector<double>& threadLatencies : latencies) {
+                all.insert(all.end(), threadLatencies.begin(), threadLatencies.end());
+            }
+            sort(all.begin(), all.end());
+            cout << modeNames[mode] << ", " << threadCount << " threads: " << all.size() / seconds << " ops/s, p99 "
+                 << all[all.size() * 99 / 100] << "us" << endl;
+        }
+    }
+
+    BankSystem recovered = BankSystem(vector<BankAccount>(), vector<Transaction*>());
+    auto start = chrono::steady_clock::now();
+    long long records = recovered.recover(path);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    long long balances = recovered.getTotalBalance();
+    cout << "recovered " << records << " records in " << seconds * 1000 << "ms, total balance " << balances << endl;
+    unlink(path.c_str());
+}
+
+// Posts the same end-of-day file one call at a time and with postBatch,
+// without a log and with a group-committed one, and checks both paths end
+// with the same balances
+void benchmarkBatchPosting() {
+    const int accountCount = 200000;
+    const string path = "bank_bench.wal";
+    int postingCounts[] = {2000000, 20000};
+    for (int logged = 0; logged < 2; logged++) {
+        int postingCount = postingCounts[logged];
+        mt19937 random(42);
+        vector<Posting> postings(postingCount);
+        for (Posting& posting : postings) {
+            posting.customerId = random() % accountCount;
+            posting.tellerId = random() % 16;
+            posting.amount = random() % 10 == 0 ? -(int) (random() % 50 + 1) : (int) (random() % 1000 + 1);
+        }
+
+        double seconds[2];
+        vector<long long> balances[2];
+        for (int batched = 0; batched < 2; batched++) {
+            unlink(path.c_str());
+            BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>());
+            for (int i = 0; i < accountCount; i++) {
+                bankSystem.deposit(bankSystem.openAccount("Customer", 0), 0, 1000);
+            }
+            // Only the posting run is logged; the log is not meant to be recovered
+            WriteAheadLog* log = nullptr;
+            if (logged) {
+                log = new WriteAheadLog(path, WriteAheadLog::PER_BATCH, 200);
+                bankSystem.attachLog(log);
+            }
+
+            auto start = chrono::steady_clock::now();
+            if (batched) {
+                bankSystem.postBatch(postings.data(), postings.size());
+            } else {
+                for (Posting& posting : postings) {
+                    if (posting.amount > 0) {
+                        bankSystem.deposit(posting.customerId, posting.tellerId, posting.amount);
+                    } else {
+                        bankSystem.withdraw(posting.customerId, posting.tellerId, -posting.amount);
+                    }
+                }
+            }
+            seconds[batched] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            delete log;
+            for (BankAccount account : bankSystem.getAccounts()) {
+                balances[batched].push_back(account.getBalance());
+            }
+        }
+        unlink(path.c_str());
+        cout << postingCount << " postings" << (logged ? " with per-batch log" : "") << ": per-call "
+             << postingCount / seconds[0] / 1e6 << "M/s, postBatch " << postingCount / seconds[1] / 1e6
+             << "M/s, speedup " << seconds[0] / seconds[1] << "x, balances "
+             << (balances[0] == balances[1] ? "match" : "DIFFER") << endl;
+    }
+}
+
+// Collects from many branches at once and checks that the cash taken out
+// of branches equals what arrived in totalCash
+void benchmarkCashCollection() {
+    BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>());
+    int branchCounts[] = {1000, 100000, 1000000};
+    for (int branchCount : branchCounts) {
+        Bank bank = Bank(vector<BankBranch*>(), &bankSystem, 0);
+        for (int i = 0; i < branchCount; i++) {
+            BankBranch* branch = bank.addBranch("Branch " + to_string(i), 1000 + i % 5000);
+            branch->addTeller(BankTeller(2 * i));
+            branch->addTeller(BankTeller(2 * i + 1));
+        }
+        long long before = 0;
+        for (BankBranch* branch : bank.getBranches()) {
+            before += branch->getCashOnHand();
+        }
+
+        const int rounds = 10;
+        auto start = chrono::steady_clock::now();
+        for (int round = 0; round < rounds; round++) {
+            bank.collectCash(0.1);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        long long after = 0;
+        for (BankBranch* branch : bank.getBranches()) {
+            after += branch->getCashOnHand();
+        }
+        cout << branchCount << " branches: " << (double) branchCount * rounds / seconds / 1e6
+             << "M branches/s, " << thread::hardware_concurrency() << " cores, cash "
+             << (before - after == bank.getTotalCash() ? "balanced" : "NOT balanced") << endl;
+        for (BankBranch* branch : bank.getBranches()) {
+            delete branch;
+        }
+    }
+}
+
+// The account layout before AccountStore: one heap object per account
+class HeapAccount {
+public:
+    int customerId;
+    string name;
+    long long balance;
+    long long lastLsn;
+    AccountLock lock;
+};
+
+// Whole-bank scans (a balance total and an interest accrual) over one heap
+// object per account against the dense balance column
+void benchmarkAccountScans() {
+    const int accountCount = 10000000;
+    const int rounds = 5;
+    mt19937 random(11);
+
+    vector<HeapAccount*> heapAccounts;
+    BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>(), accountCount);
+    for (int i = 0; i < accountCount; i++) {
+        int balance = random() % 100000 + 1;
+        HeapAccount* account = new HeapAccount();
+        account->customerId = i;
+        account->name = "Customer";
+        account->balance = balance;
+        account->lastLsn = 0;
+        heapAccounts.push_back(account);
+        bankSystem.deposit(bankSystem.openAccount("Customer", 0), 0, balance);
+    }
+    // Accounts opened over time end up scattered across the heap
+    shuffle(heapAccounts.begin(), heapAccounts.end(), random);
+
+    auto report = [accountCount, rounds](const string& scan, double heapSeconds, double denseSeconds, bool match) {
+        cout << scan << ": heap objects " << (double) accountCount * rounds / heapSeconds / 1e6 << "M accounts/s, dense "
+             << (double) accountCount * rounds / denseSeconds / 1e6 << "M accounts/s, speedup "
+             << heapSeconds / denseSeconds << "x, " << (match ? "results match" : "results DIFFER") << endl;
+    };
+
+    long long heapTotal = 0;
+    auto start = chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        heapTotal = 0;
+        for (HeapAccount* account : heapAccounts) {
+            heapTotal += account->balance;
+        }
+    }
+    double heapSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    // Summed from the column rather than read from getTotalBalance, which
+    // does not see the raw writes below
+    int64_t* balances = bankSystem.getAccountStore().getBalances();
+    auto sumBalances = [balances, accountCount]() {
+        long long total = 0;
+        for (int i = 0; i < accountCount; i++) {
+            total += balances[i];
+        }
+        return total;
+    };
+    long long denseTotal = 0;
+    start = chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        denseTotal = sumBalances();
+    }
+    double denseSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    report("total balance", heapSeconds, denseSeconds, heapTotal == denseTotal);
+
+    // 0.01% per round, in whole units
+    start = chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        for (HeapAccount* account : heapAccounts) {
+            account->balance += account->balance / 10000;
+        }
+    }
+    heapSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    start = chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < accountCount; i++) {
+            balances[i] += balances[i] / 10000;
+        }
+    }
+    denseSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    heapTotal = 0;
+    for (HeapAccount* account : heapAccounts) {
+        heapTotal += account->balance;
+        delete account;
+    }
+    report("interest accrual", heapSeconds, denseSeconds, heapTotal == sumBalances());
+}
+
+// A nightly interest and fee run over every account: per-account deposit and
+// withdraw calls against runBatchJob, which must reach the same balances
+void benchmarkBatchJobs() {
+    const int accountCount = 10000000;
+    RateSchedule schedule;
+    schedule.addTier(0, 0.0001);
+    schedule.addTier(10000, 0.0002);
+    schedule.addTier(50000, 0.0003);
+    schedule.setFee(1000, 5);
+
+    BankSystem perCall = BankSystem(vector<BankAccount>(), vector<Transaction*>(), accountCount);
+    BankSystem batched = BankSystem(vector<BankAccount>(), vector<Transaction*>(), accountCount);
+    mt19937 random(3);
+    for (int i = 0; i < accountCount; i++) {
+        int balance = random() % 100000 + 1;
+        perCall.deposit(perCall.openAccount("Customer", 0), 0, balance);
+        batched.deposit(batched.openAccount("Customer", 0), 0, balance);
+    }
+    long long before = batched.getTotalBalance();
+
+    auto start = chrono::steady_clock::now();
+    int64_t* balances = perCall.getAccountStore().getBalances();
+    for (int i = 0; i < accountCount; i++) {
+        int64_t delta;
+        schedule.computeDeltas(balances + i, &delta, 1);
+        if (delta > 0) {
+            perCall.deposit(i, 0, delta);
+        } else if (delta < 0) {
+            perCall.withdraw(i, 0, -delta);
+        }
+    }
+    double perCallSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    BatchJobResult result = batched.runBatchJob(schedule, 0);
+    double batchSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // The arithmetic alone, over a copy of the balance column
+    vector<int64_t> copy(batched.getAccountStore().getBalances(), batched.getAccountStore().getBalances() + accountCount);
+    vector<int64_t> deltas(accountCount);
+    start = chrono::steady_clock::now();
+    schedule.computeDeltas(copy.data(), deltas.data(), accountCount);
+    double kernelSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    bool match = perCall.getTotalBalance() == batched.getTotalBalance()
+                 && batched.getTotalBalance() == before + result.netDelta;
+    for (int i = 0; match && i < accountCount; i++) {
+        match = perCall.getAccount(i).getBalance() == batched.getAccount(i).getBalance();
+    }
+    cout << accountCount << " accounts, " << thread::hardware_concurrency() << " cores: per-call "
+         << accountCount / perCallSeconds / 1e6 << "M accounts/s, batch job " << accountCount / batchSeconds / 1e6
+         << "M accounts/s in " << result.rows.size() << " ledger rows, kernel alone "
+         << accountCount / kernelSeconds / 1e6 << "M accounts/s, " << (match ? "balances match" : "balances DIFFER")
+         << endl;
+}
+
+// Full and incremental checkpoints of a large bank, then a restart from the
+// checkpoint plus the log tail, checked against the balances before the crash
+void benchmarkCheckpoint() {
+    const int accountCount = 10000000;
+    const string logPath = "bank_bench.wal";
+    const string checkpointPath = "bank_bench.ckpt";
+    unlink(logPath.c_str());
+    unlink(checkpointPath.c_str());
+    unlink((checkpointPath + ".names").c_str());
+    unlink((checkpointPath + ".tellers").c_str());
+
+    BankSystem* bankSystem = new BankSystem(vector<BankAccount>(), vector<Transaction*>(), accountCount);
+    for (int i = 0; i < accountCount; i++) {
+        bankSystem->openAccount("Customer " + to_string(i), 0);
+    }
+    WriteAheadLog* log = new WriteAheadLog(logPath, WriteAheadLog::PER_BATCH, 200);
+    bankSystem->attachLog(log);
+    CheckpointStore* store = new CheckpointStore(checkpointPath);
+
+    mt19937 random(7);
+    auto randomPostings = [&random, accountCount](int count) {
+        vector<Posting> postings(count);
+        for (Posting& posting : postings) {
+            posting.customerId = random() % accountCount;
+            posting.tellerId = 0;
+            posting.amount = random() % 1000 + 1;
+        }
+        return postings;
+    };
+
+    auto start = chrono::steady_clock::now();
+    long long written = bankSystem->checkpoint(store, true);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "full checkpoint: " << written << " accounts in " << seconds << "s" << endl;
+
+    int postingCounts[] = {1000, 10000, 100000};
+    for (int postingCount : postingCounts) {
+        vector<Posting> postings = randomPostings(postingCount);
+        bankSystem->postBatch(postings.data(), postings.size());
+        start = chrono::steady_clock::now();
+        written = bankSystem->checkpoint(store, false);
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "incremental checkpoint after " << postingCount << " postings: " << written << " accounts in "
+             << seconds << "s" << endl;
+    }
+
+    // Log tail not covered by any checkpoint, then crash
+    vector<Posting> tail = randomPostings(1000000);
+    bankSystem->postBatch(tail.data(), tail.size());
+    delete log;
+    delete store;
+    vector<long long> expected;
+    for (BankAccount account : bankSystem->getAccounts()) {
+        expected.push_back(account.getBalance());
+    }
+    delete bankSystem;
+
+    start = chrono::steady_clock::now();
+    store = new CheckpointStore(checkpointPath);
+    BankSystem* recovered = new BankSystem(vector<BankAccount>(), vector<Transaction*>(), accountCount);
+    long long replayed = recovered->restore(store, logPath);
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    bool matches = recovered->getAccountCount() == (long long) expected.size();
+    for (size_t i = 0; matches && i < expected.size(); i++) {
+        matches = recovered->getAccount(i).getBalance() == expected[i];
+    }
+    cout << "restart: " << accountCount << " accounts and " << replayed << " log records in " << seconds
+         << "s, balances " << (matches ? "match" : "DIFFER") << endl;
+
+    delete recovered;
+    delete store;
+    unlink(logPath.c_str());
+    unlink(checkpointPath.c_str());
+    unlink((checkpointPath + ".names").c_str());
+    unlink((checkpointPath + ".tellers").c_str());
+}
+
+// Statements through the per-customer index against filtering a full ledger
+// scan, and a time-range query through the segment bounds against a scan
+void benchmarkHistory() {
+    const int accountCount = 100000;
+    const int postingCount = 10000000;
+    BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>());
+    for (int i = 0; i < accountCount; i++) {
+        bankSystem.openAccount("Customer", 0);
+    }
+    mt19937 random(3);
+    vector<Posting> postings(postingCount);
+    for (Posting& posting : postings) {
+        posting.customerId = random() % accountCount;
+        posting.tellerId = random() % 64;
+        posting.amount = random() % 1000 + 1;
+    }
+    bankSystem.postBatch(postings.data(), postings.size());
+
+    vector<char> buffer(1 << 20);
+    const int statements = 1000;
+    long long indexedRows = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < statements; i++) {
+        size_t used = 0;
+        for (TransactionRow row : bankSystem.getHistory(random() % accountCount)) {
+            used += TransactionRenderer::render(row, buffer.data() + used);
+            indexedRows++;
+        }
+    }
+    double indexed = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / statements;
+
+    const int scans = 5;
+    long long scannedRows = 0;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < scans; i++) {
+        int customerId = random() % accountCount;
+        size_t used = 0;
+        for (TransactionRow row : bankSystem.getTransactions()) {
+            if (row.getCustomerId() == customerId || row.getCounterpartyId() == customerId) {
+                used += TransactionRenderer::render(row, buffer.data() + used);
+                scannedRows++;
+            }
+        }
+    }
+    double scanned = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / scans;
+    cout << "statement of ~" << indexedRows / statements << " rows: index " << indexed << "us, full scan "
+         << scanned << "us" << endl;
+
+    // Synthetic clock: one row per millisecond, so the ledger spans ~2.8 hours
+    TransactionLedger ledger;
+    long long first = ledger.reserve(postingCount);
+    for (int i = 0; i < postingCount; i++) {
+        ledger.write(first + i, DEPOSIT, i % accountCount, i % 64, 1, -1, i * 1000LL);
+    }
+    long long from = postingCount / 2 * 1000LL;
+    long long to = from + 60 * 1000000LL;
+    double ranged[2];
+    long long rangeRows = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        start = chrono::steady_clock::now();
+        rangeRows = 0;
+        for (TransactionRow row : TimeRangeView(&ledger, from, to, 0, ledger.getSize())) {
+            rangeRows += row.getAmount();
+        }
+        ranged[pass] = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    }
+    start = chrono::steady_clock::now();
+    long long filteredRows = 0;
+    for (TransactionRow row : LedgerView(&ledger, 0, ledger.getSize())) {
+        if (row.getTimestamp() >= from && row.getTimestamp() < to) {
+            filteredRows += row.getAmount();
+        }
+    }
+    double filtered = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    cout << "one minute (" << rangeRows << " rows) of " << postingCount << ": segments " << ranged[0]
+         << "us first query (seals segments), " << ranged[1] << "us after, full scan " << filtered << "us" << (rangeRows == filteredRows ? "" : " MISMATCH") << endl;
+}
+
+// Customer waits in a simulated branch of eight tellers of uneven speed,
+// loaded to about 85% of its capacity, under each teller policy
+void benchmarkTellerPolicies() {
+    vector<double> speeds = {0.6, 0.8, 0.9, 1.0, 1.0, 1.1, 1.2, 1.4};
+    BranchSimulation simulation(speeds, 1.6);
+    const char* names[] = {"skewed random", "random", "least loaded", "work stealing"};
+    for (int policy = 0; policy < 4; policy++) {
+        BranchSimulation::Result result = simulation.run((BranchSimulation::Policy) policy, 200000, 11);
+        int fewest = *min_element(result.served.begin(), result.served.end());
+        int most = *max_element(result.served.begin(), result.served.end());
+        cout << names[policy] << ": wait p50 " << result.percentile(0.5) << " min, p90 " << result.percentile(0.9)
+             << ", p99 " << result.percentile(0.99) << ", max " << result.waits.back() << "; customers per teller "
+             << fewest << "-" << most << endl;
+    }
+}
+
+// Deposits, withdrawals and transfers (mostly cross-shard once there is more
+// than one shard) from one client thread per shard, each keeping a window of
+// requests in flight; checks that the total balance adds up afterwards
+void benchmarkShards() {
+    const int accountCount = 100000;
+    const int operationsPerClient = 1000000;
+    const int window = 64;
+    int cores = max(1, (int) thread::hardware_concurrency());
+    vector<int> shardCounts;
+    for (int shards = 1; shards < cores; shards *= 2) {
+        shardCounts.push_back(shards);
+    }
+    shardCounts.push_back(cores);
+    for (int shardCount : shardCounts) {
+        ShardedBank bank(shardCount);
+        vector<BankRequest> opens(accountCount);
+        for (BankRequest& request : opens) {
+            request.kind = BankRequest::OPEN;
+            request.name = "Customer";
+            request.tellerId = 0;
+            bank.submit(&request);
+        }
+        for (BankRequest& request : opens) {
+            while (request.getState() == BankRequest::PENDING) {
+                this_thread::yield();
+            }
+        }
+        for (int i = 0; i < accountCount; i++) {
+            bank.deposit(i, 0, 1000);
+        }
+        long long before = bank.getTotalBalance();
+
+        int clientCount = shardCount;
+        vector<long long> netDeposits(clientCount, 0);
+        vector<thread> clients;
+        auto start = chrono::steady_clock::now();
+        for (int c = 0; c < clientCount; c++) {
+            clients.push_back(thread([&bank, &netDeposits, c, operationsPerClient, window, accountCount]() {
+                mt19937 random(c);
+                vector<BankRequest> requests(window);
+                vector<bool> busy(window, false);
+                long long net = 0;
+                int submitted = 0;
+                int finished = 0;
+                while (finished < operationsPerClient) {
+                    for (int w = 0; w < window; w++) {
+                        BankRequest& request = requests[w];
+                        if (busy[w]) {
+                            BankRequest::State state = request.getState();
+                            if (state == BankRequest::PENDING) {
+                                continue;
+                            }
+                            if (state == BankRequest::DONE) {
+                                net += request.kind == BankRequest::DEPOSIT ? request.amount
+                                       : request.kind == BankRequest::WITHDRAW ? -request.amount : 0;
+                            }
+                            busy[w] = false;
+                            finished++;
+                        }
+                        if (submitted < operationsPerClient) {
+                            int draw = random() % 10;
+                            request.kind = draw < 4 ? BankRequest::DEPOSIT : draw < 7 ? BankRequest::WITHDRAW
+                                                                                      : BankRequest::TRANSFER;
+                            request.customerId = random() % accountCount;
+                            request.counterpartyId = random() % accountCount;
+                            if (request.counterpartyId == request.customerId) {
+                                request.counterpartyId = (request.counterpartyId + 1) % accountCount;
+                            }
+                            request.tellerId = c;
+                            request.amount = random() % 100 + 1;
+                            bank.submit(&request);
+                            busy[w] = true;
+                            submitted++;
+                        }
+                    }
+                    this_thread::yield();
+                }
+                netDeposits[c] = net;
+            }));
+        }
+        for (thread& client : clients) {
+            client.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        long long expected = before;
+        for (long long net : netDeposits) {
+            expected += net;
+        }
+        cout << shardCount << " shards: " << (double) clientCount * operationsPerClient / seconds / 1e6
+             << "M ops/s, balances "
+             << (bank.getTotalBalance() == expected && bank.sumBalances() == expected ? "add up" : "DO NOT add up")
+             << endl;
+    }
+}
+
+// Draws ranks 0..n-1 with probability proportional to 1 / (rank + 1)^skew
+class ZipfGenerator {
+private:
+    vector<double> cumulative;
+
+public:
+    ZipfGenerator(int n, double skew) {
+        this->cumulative = vector<double>(n);
+        double total = 0;
+        for (int i = 0; i < n; i++) {
+            total += 1.0 / pow(i + 1, skew);
+            this->cumulative[i] = total;
+        }
+        for (double& value : this->cumulative) {
+            value /= total;
+        }
+    }
+
+    template <typename Random>
+    int next(Random& random) {
+        double u = uniform_real_distribution<double>(0, 1)(random);
+        return min((int) (lower_bound(this->cumulative.begin(), this->cumulative.end(), u) - this->cumulative.begin()),
+                   (int) this->cumulative.size() - 1);
+    }
+};
+
+// Transfers between accounts picked uniformly and with Zipfian skew, so a few
+// hot accounts take most of the traffic; checks that no money is created or lost
+void benchmarkTransfers() {
+    const int accountCount = 10000;
+    const int transfersPerThread = 200000;
+    int threadCounts[] = {1, 4, 16};
+    double skews[] = {0.0, 0.99, 1.2};
+    for (double skew : skews) {
+        ZipfGenerator zipf(accountCount, skew);
+        for (int threadCount : threadCounts) {
+            BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>());
+            for (int i = 0; i < accountCount; i++) {
+                bankSystem.deposit(bankSystem.openAccount("Customer", 0), 0, 1000000);
+            }
+            vector<thread> workers;
+            auto start = chrono::steady_clock::now();
+            for (int t = 0; t < threadCount; t++) {
+                workers.push_back(thread([&bankSystem, &zipf, t, transfersPerThread, accountCount]() {
+                    mt19937 random(t);
+                    for (int i = 0; i < transfersPerThread; i++) {
+                        int from = zipf.next(random);
+                        int to = zipf.next(random);
+                        if (from == to) {
+                            to = (to + 1) % accountCount;
+                        }
+                        bankSystem.transfer(from, to, 1, t);
+                    }
+                }));
+            }
+            for (thread& worker : workers) {
+                worker.join();
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            long long total = bankSystem.getTotalBalance();
+            cout << "skew " << skew << ", " << threadCount << " threads: "
+                 << (double) threadCount * transfersPerThread / seconds / 1e6 << "M transfers/s, money "
+                 << (total == (long long) accountCount * 1000000 ? "conserved" : "NOT conserved") << endl;
+        }
+    }
+}
+
+// Export a 10M-row ledger as text and as a binary archive, then stream 100M
+// rows through an archive and back, checking peak memory stays bounded
+void benchmarkArchive() {
+    const string path = "bank_bench.archive";
+    auto peakMegabytes = []() {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss / 1024;
+    };
+
+    // 100M synthetic rows, a day's worth of traffic, generated on the fly
+    const long long rowCount = 100000000;
+    const long long start = TransactionLedger::now();
+    auto rowAt = [start](long long i, LogRecord& row) {
+        uint64_t hash = (uint64_t) i * 0x9E3779B97F4A7C15ULL;
+        row.type = (TransactionType) (DEPOSIT + (hash >> 62) % 3);
+        row.customerId = (hash >> 8) % 10000000;
+        row.counterpartyId = row.type == TRANSFER ? (hash >> 20) % 10000000 : -1;
+        row.tellerId = (hash >> 40) % 1000;
+        row.amount = (hash >> 30) % 10000 + 1;
+        row.timestamp = start + i * 864;
+    };
+    long long peakBefore = peakMegabytes();
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    auto begin = chrono::steady_clock::now();
+    LedgerArchiveWriter writer(fd);
+    LogRecord row;
+    long long expectedAmount = 0;
+    for (long long i = 0; i < rowCount; i++) {
+        rowAt(i, row);
+        expectedAmount += row.amount;
+        writer.add(row.type, row.customerId, row.counterpartyId, row.tellerId, row.amount, row.timestamp);
+    }
+    long long bytes = writer.finish();
+    close(fd);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    cout << rowCount << " rows exported: " << rowCount / seconds / 1e6 << "M rows/s, " << bytes / seconds / 1e6
+         << "MB/s, " << (double) bytes / rowCount << " bytes/row" << endl;
+
+    LedgerArchiveReader reader(path);
+    long long amount = 0;
+    bool match = true;
+    begin = chrono::steady_clock::now();
+    long long visited = reader.read(INT64_MIN, INT64_MAX, [&amount, &match, &rowAt](LogRecord& record) {
+        LogRecord expected;
+        rowAt(record.lsn, expected);
+        match = match && record.customerId == expected.customerId && record.timestamp == expected.timestamp;
+        amount += record.amount;
+    });
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    cout << visited << " rows imported: " << visited / seconds / 1e6 << "M rows/s, "
+         << (match && amount == expectedAmount ? "rows match" : "rows DIFFER") << ", peak memory grew by "
+         << peakMegabytes() - peakBefore << "MB" << endl;
+
+    // One hour out of the day
+    long long from = start + 12 * 3600 * 1000000LL;
+    long long to = from + 3600 * 1000000LL - 1;
+    begin = chrono::steady_clock::now();
+    visited = reader.read(from, to, [](LogRecord&) {});
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    cout << "one hour: " << visited << " rows of " << reader.getRowCount() << " in " << seconds * 1000 << "ms" << endl;
+
+    // A real ledger, as text and as an archive
+    BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>());
+    Bank bank = Bank(vector<BankBranch*>(), &bankSystem, 0);
+    for (int i = 0; i < 1000000; i++) {
+        bankSystem.openAccount("Customer", i % 100);
+    }
+    mt19937 random(17);
+    vector<Posting> postings(1000000);
+    for (int batch = 0; batch < 9; batch++) {
+        for (Posting& posting : postings) {
+            posting.customerId = random() % 1000000;
+            posting.tellerId = random() % 100;
+            posting.amount = random() % 1000 + 1;
+        }
+        bankSystem.postBatch(postings.data(), postings.size());
+    }
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    begin = chrono::steady_clock::now();
+    bank.exportTransactions(fd);
+    double textSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    long long textBytes = lseek(fd, 0, SEEK_CUR);
+    close(fd);
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    begin = chrono::steady_clock::now();
+    bytes = bank.exportArchive(fd);
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    close(fd);
+    cout << "10M-row ledger: text " << textBytes / 1e6 << "MB in " << textSeconds << "s, archive " << bytes / 1e6
+         << "MB in " << seconds << "s" << endl;
+    unlink(path.c_str());
+}
+
+// Idempotency checks on their own (new keys mixed with retries) and the cost
+// they add to a deposit
+void benchmarkIdempotency() {
+    const long long capacity = 8000000;
+    const long long timeToLive = 10 * 60 * 1000000LL;
+    const int operations = 10000000;
+    mt19937_64 random(19);
+
+    // A third of requests retry one of the last thousand
+    vector<IdempotencyKey> keys(operations);
+    for (int i = 0; i < operations; i++) {
+        if (i >= 1000 && random() % 3 == 0) {
+            keys[i] = keys[i - 1 - random() % 1000];
+        } else {
+            keys[i] = {random(), random()};
+        }
+    }
+    IdempotencyTable table(capacity, timeToLive);
+    long long now = TransactionLedger::now();
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < operations; i++) {
+        table.claim(keys[i], now + i);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << operations << " checks: " << seconds / operations * 1e9 << "ns each, " << table.getHits() << " hits, "
+         << table.getMisses() << " misses, " << table.getEvictions() << " evictions" << endl;
+
+    // In memory, and with every deposit made durable in a write-ahead log
+    const int accountCount = 1000000;
+    const string logPath = "bank_bench.wal";
+    for (bool logged : {false, true})
+    for (bool keyed : {false, true}) {
+        int deposits = logged ? 20000 : 4000000;
+        BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>(), accountCount);
+        for (int i = 0; i < accountCount; i++) {
+            bankSystem.openAccount("Customer", 0);
+        }
+        unlink(logPath.c_str());
+        WriteAheadLog log(logPath, WriteAheadLog::PER_BATCH, 0);
+        if (logged) {
+            bankSystem.attachLog(&log);
+        }
+        IdempotencyTable table(capacity, timeToLive);
+        bankSystem.attachIdempotencyTable(&table);
+        vector<int> customerIds(deposits);
+        for (int& customerId : customerIds) {
+            customerId = random() % accountCount;
+        }
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < deposits; i++) {
+            if (keyed) {
+                bankSystem.deposit(customerIds[i], 0, 1, keys[i]);
+            } else {
+                bankSystem.deposit(customerIds[i], 0, 1);
+            }
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << (keyed ? "keyed" : "plain") << (logged ? " logged" : " in-memory") << " deposits: "
+             << seconds / deposits * 1e9 << "ns each, " << bankSystem.getTotalBalance() << " applied" << endl;
+    }
+    unlink(logPath.c_str());
+}
+
+// Latency of velocity rule checks with 1M accounts, most of them cold, and
+// the cost they add to BankBranch::withdraw
+void benchmarkVelocity() {
+    const int accountCount = 1000000;
+    const int operations = 5000000;
+    vector<VelocityRule> rules = {
+        {60 * 1000000LL, 3, 2000},              // a minute
+        {24 * 3600 * 1000000LL, 8, 10000},      // a day
+    };
+
+    VelocityGuard guard(rules, accountCount);
+    ZipfGenerator zipf(accountCount, 0.99);
+    mt19937 random(5);
+    vector<int> customerIds(operations);
+    vector<int> amounts(operations);
+    for (int i = 0; i < operations; i++) {
+        customerIds[i] = zipf.next(random);
+        amounts[i] = random() % 500 + 1;
+    }
+    // Back every account's ring first: the first check of an account in a
+    // fresh page takes a page fault
+    long long now = TransactionLedger::now();
+    unsigned long long ticket;
+    for (int i = 0; i < accountCount; i++) {
+        guard.tryAdmit(i, 1, now - 48 * 3600 * 1000000LL, ticket);
+    }
+    vector<long long> latencies(operations);
+    for (int i = 0; i < operations; i++) {
+        now += 1000;
+        auto start = chrono::steady_clock::now();
+        guard.tryAdmit(customerIds[i], amounts[i], now, ticket);
+        latencies[i] = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    }
+    sort(latencies.begin(), latencies.end());
+    cout << operations << " checks over " << accountCount << " accounts: p50 " << latencies[operations / 2]
+         << "ns, p99 " << latencies[operations * 99LL / 100] << "ns, p99.9 " << latencies[operations * 999LL / 1000]
+         << "ns, " << guard.getAdmitted() - accountCount << " admitted, " << guard.getRejected() << " rejected"
+         << endl;
+
+    // End to end, with every withdrawal allowed by the rules
+    const int withdrawals = 1000000;
+    for (bool guarded : {false, true}) {
+        BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>(), accountCount);
+        Bank bank = Bank(vector<BankBranch*>(), &bankSystem, 0);
+        BankBranch* branch = bank.addBranch("Main Street", INT32_MAX);
+        branch->addTeller(BankTeller(0));
+        for (int i = 0; i < accountCount; i++) {
+            bankSystem.deposit(bankSystem.openAccount("Customer", 0), 0, 1000);
+        }
+        VelocityGuard permissive({{60 * 1000000LL, VelocityGuard::RING, INT64_MAX}}, accountCount);
+        if (guarded) {
+            bank.setVelocityGuard(&permissive);
+            for (int i = 0; i < accountCount; i++) {
+                permissive.tryAdmit(i, 1, 0, ticket);
+            }
+        }
+        vector<long long> latencies(withdrawals);
+        for (int i = 0; i < withdrawals; i++) {
+            auto start = chrono::steady_clock::now();
+            try {
+                branch->withdraw(random() % accountCount, 1);
+            } catch (const char* error) {
+            }
+            latencies[i] = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        }
+        sort(latencies.begin(), latencies.end());
+        cout << "branch withdrawals " << (guarded ? "with" : "without") << " velocity checks: p50 "
+             << latencies[withdrawals / 2] << "ns, p99 " << latencies[withdrawals * 99LL / 100] << "ns" << endl;
+        for (BankBranch* branch : bank.getBranches()) {
+            delete branch;
+        }
+    }
+}
+
+// Dashboard reads of the aggregates against the scans they replace, then the
+// aggregates polled while branches take deposits and withdrawals, checked
+// against the balance column, the branches and the ledger at the end
+void benchmarkAggregates() {
+    const int accountCount = 10000000;
+    const int branchCount = 1000;
+    BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>(), accountCount);
+    Bank bank = Bank(vector<BankBranch*>(), &bankSystem, 0);
+    for (int i = 0; i < branchCount; i++) {
+        BankBranch* branch = bank.addBranch("Branch " + to_string(i), 1000000);
+        branch->addTeller(BankTeller(i));
+    }
+    for (int i = 0; i < accountCount; i++) {
+        bankSystem.deposit(bankSystem.openAccount("Customer", 0), 0, 1000);
+    }
+
+    const int reads = 1000000;
+    long long aggregated = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < reads; i++) {
+        aggregated = bank.getTotalBalance() + bank.getCashInBranches();
+    }
+    double readSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    const int scans = 5;
+    const int64_t* balances = bankSystem.getAccountStore().getBalances();
+    long long scanned = 0;
+    start = chrono::steady_clock::now();
+    for (int round = 0; round < scans; round++) {
+        long long balanceSum = 0;
+        for (int i = 0; i < accountCount; i++) {
+            balanceSum += balances[i];
+        }
+        long long cashSum = 0;
+        for (BankBranch* branch : bank.getBranches()) {
+            cashSum += branch->getCashOnHand();
+        }
+        scanned = balanceSum + cashSum;
+    }
+    double scanSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "balance and cash totals: aggregates " << readSeconds / reads * 1e9 << "ns per read, scans "
+         << scanSeconds / scans * 1e3 << "ms per read over " << accountCount << " accounts and " << branchCount
+         << " branches, " << (aggregated == scanned ? "results match" : "results DIFFER") << endl;
+
+    // Each worker serves its own range of branches; one more thread plays the dashboard
+    int threadCount = thread::hardware_concurrency();
+    const int operationsPerThread = 2000000;
+    atomic<bool> done(false);
+    long long dashboardReads = 0;
+    thread dashboard([&bank, &bankSystem, &done, &dashboardReads]() {
+        long long seen = 0;
+        while (!done.load()) {
+            seen += bank.getTotalBalance() + bank.getCashInBranches() + bankSystem.getTellerVolume(0);
+            dashboardReads++;
+            this_thread::yield();
+        }
+        if (seen == 42) {
+            cout << endl;
+        }
+    });
+    vector<thread> workers;
+    start = chrono::steady_clock::now();
+    for (int t = 0; t < threadCount; t++) {
+        workers.push_back(thread([&bank, t, threadCount, accountCount, operationsPerThread]() {
+            vector<BankBranch*> branches = bank.getBranches();
+            mt19937 random(t);
+            for (int i = 0; i < operationsPerThread; i++) {
+                BankBranch* branch = branches[(t + (long long) threadCount * (i % 64)) % branches.size()];
+                int customerId = random() % accountCount;
+                int amount = random() % 100 + 1;
+                try {
+                    if (i % 2 == 0) {
+                        branch->deposit(customerId, amount);
+                    } else {
+                        branch->withdraw(customerId, amount);
+                    }
+                } catch (const char* error) {
+                }
+            }
+        }));
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    done = true;
+    dashboard.join();
+
+    long long balanceSum = 0;
+    for (int i = 0; i < accountCount; i++) {
+        balanceSum += balances[i];
+    }
+    long long cashSum = 0;
+    for (BankBranch* branch : bank.getBranches()) {
+        cashSum += branch->getCashOnHand();
+    }
+    vector<long long> operations(branchCount, 0);
+    vector<long long> volumes(branchCount, 0);
+    for (TransactionRow row : bankSystem.getTransactions()) {
+        if (row.getTellerId() < branchCount) {
+            operations[row.getTellerId()]++;
+            volumes[row.getTellerId()] += row.getAmount();
+        }
+    }
+    bool tellersMatch = true;
+    for (int i = 0; i < branchCount; i++) {
+        tellersMatch &= bankSystem.getTellerOperations(i) == operations[i]
+                        && bankSystem.getTellerVolume(i) == volumes[i];
+    }
+    cout << threadCount << " threads: " << (double) threadCount * operationsPerThread / seconds / 1e6
+         << "M branch operations/s with " << dashboardReads << " dashboard reads alongside; balances "
+         << (bank.getTotalBalance() == balanceSum ? "match" : "DO NOT match") << ", branch cash "
+         << (bank.getCashInBranches() == cashSum ? "matches" : "DOES NOT match") << ", teller volumes "
+         << (tellersMatch ? "match" : "DO NOT match") << " the ledger" << endl;
+    for (BankBranch* branch : bank.getBranches()) {
+        delete branch;
+    }
+}
+
+// Plans for 1k and 10k branches, each off its target by up to 20000 either
+// way, with a full and an empty vault; then the nightly policies run over
+// simulated days, counting customers turned away for want of cash
+void benchmarkRebalancing() {
+    for (int branchCount : {1000, 10000}) {
+        mt19937 random(17);
+        double side = sqrt(branchCount) * 3;       // about 9 km^2 per branch
+        uniform_real_distribution<double> position(0, side);
+        vector<Location> locations(branchCount);
+        for (Location& location : locations) {
+            location = Location{position(random), position(random)};
+        }
+        auto start = chrono::steady_clock::now();
+        RebalancingPlanner planner(locations, Location{side / 2, side / 2});
+        double setupSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        vector<long long> cash(branchCount);
+        vector<long long> targets(branchCount);
+        for (int i = 0; i < branchCount; i++) {
+            cash[i] = random() % 20000;
+            targets[i] = random() % 20000;
+        }
+        for (long long vaultCash : {20000LL * branchCount, 0LL}) {
+            start = chrono::steady_clock::now();
+            RebalancingPlan plan = planner.plan(cash, vaultCash, targets);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << branchCount << " branches, " << (vaultCash > 0 ? "full" : "empty") << " vault: planned in "
+                 << seconds * 1e3 << "ms (+" << setupSeconds * 1e3 << "ms finding neighbours), "
+                 << plan.movements.size() << " movements costing " << plan.cost << ", shortfall " << plan.shortfall
+                 << endl;
+        }
+    }
+
+    const int days = 60;
+    CashSimulation simulation(1000, 100, 23);
+    const char* names[] = {"flat ratio 0.1", "flat ratio 0.5", "planned, 2 deviations"};
+    CashSimulation::Policy policies[] = {CashSimulation::FLAT_RATIO, CashSimulation::FLAT_RATIO, CashSimulation::PLANNED};
+    double settings[] = {0.1, 0.5, 2};
+    for (int k = 0; k < 3; k++) {
+        CashSimulation::Result result = simulation.run(policies[k], settings[k], days, 29);
+        cout << names[k] << ": " << result.stockouts << " of " << result.withdrawals << " withdrawals refused ("
+             << 100.0 * result.stockouts / result.withdrawals << "%), " << result.cashMoved / days
+             << " cash moved a night at cost " << result.cost / days << ", " << result.nightSeconds / days * 1e3
+             << "ms a night" << endl;
+    }
+}
+
+// Rows with every number at its widest render within MAX_LINE, and the
+// widest transfer fills it exactly
+bool testRenderWidths() {
+    LedgerSegment* segment = new LedgerSegment();
+    TransactionType types[] = {OPEN_ACCOUNT, DEPOSIT, WITHDRAWAL, TRANSFER, ACCRUAL};
+    for (int i = 0; i < 5; i++) {
+        segment->customerIds[i] = INT32_MIN;
+        segment->counterpartyIds[i] = INT32_MIN;
+        segment->tellerIds[i] = INT32_MIN;
+        segment->amounts[i] = INT64_MIN;
+        segment->types[i].store(types[i]);
+    }
+    vector<char> line(TransactionRenderer::MAX_LINE + 64);
+    bool ok = true;
+    for (int i = 0; i < 5; i++) {
+        TransactionRow row(segment, i);
+        size_t length = TransactionRenderer::render(row, line.data());
+        ok = ok && length <= TransactionRenderer::MAX_LINE
+             && string(line.data(), length) == row.getTransactionDescription() + "\n";
+        if (types[i] == TRANSFER) {
+            ok = ok && length == TransactionRenderer::MAX_LINE;
+        }
+    }
+    delete segment;
+    return ok;
+}
+
+// A ledger fills up to MAX_ROWS and then refuses rows without claiming any
+bool testLedgerCapacity() {
+    TransactionLedger ledger;
+    ledger.restartAt(TransactionLedger::MAX_ROWS - 2);
+    bool ok = ledger.append(DEPOSIT, 0, 0, 1) == TransactionLedger::MAX_ROWS - 2;
+    try {
+        ledger.reserve(2);
+        ok = false;
+    } catch (const char*) {
+    }
+    ok = ok && ledger.append(DEPOSIT, 0, 0, 1) == TransactionLedger::MAX_ROWS - 1;
+    try {
+        ledger.append(DEPOSIT, 0, 0, 1);
+        ok = false;
+    } catch (const char*) {
+    }
+    return ok && ledger.getSize() == TransactionLedger::MAX_ROWS;
+}
+
+// A transfer, deposit or withdrawal of zero or less is refused and leaves
+// the balances untouched
+bool testTransferAmounts() {
+    BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>());
+    int from = bankSystem.openAccount("Customer", 0);
+    int to = bankSystem.openAccount("Customer", 0);
+    bankSystem.deposit(from, 0, 100);
+    bool ok = true;
+    for (int amount : {0, -50, INT32_MIN}) {
+        try {
+            bankSystem.transfer(from, to, amount, 0);
+            ok = false;
+        } catch (const char*) {
+        }
+        try {
+            bankSystem.deposit(from, 0, amount);
+            ok = false;
+        } catch (const char*) {
+        }
+        try {
+            bankSystem.withdraw(from, 0, amount);
+            ok = false;
+        } catch (const char*) {
+        }
+    }
+    bankSystem.transfer(from, to, 40, 0);
+    return ok && bankSystem.getAccount(from).getBalance() == 60 && bankSystem.getAccount(to).getBalance() == 40;
+}
+
+// The sharded bank refuses non-positive amounts before any funds are held
+bool testShardedAmounts() {
+    ShardedBank bank(2);
+    int from = bank.openAccount("Customer", 0);
+    int to = bank.openAccount("Customer", 0);
+    bank.deposit(from, 0, 100);
+    int refused = 0;
+    for (int amount : {0, -50}) {
+        try {
+            bank.transfer(from, to, amount, 0);
+        } catch (const char*) {
+            refused++;
+        }
+        try {
+            bank.deposit(from, 0, amount);
+        } catch (const char*) {
+            refused++;
+        }
+        try {
+            bank.withdraw(from, 0, amount);
+        } catch (const char*) {
+            refused++;
+        }
+    }
+    return refused == 6 && bank.getBalance(from) == 100 && bank.getBalance(to) == 0;
+}
+
+// Each side of a cross-shard transfer writes a row in its own shard's
+// ledger, and the total balance stays exact while transfers are in flight
+bool testShardedTransfers() {
+    const int transfers = 1000;
+    ShardedBank bank(2);
+    int from = bank.openAccount("Customer", 0);
+    int to = bank.openAccount("Customer", 0);
+    bank.deposit(from, 0, transfers);
+    atomic<bool> done(false);
+    thread client([&bank, &done, from, to, transfers]() {
+        for (int i = 0; i < transfers; i++) {
+            bank.transfer(from, to, 1, 0);
+        }
+        done.store(true);
+    });
+    bool ok = bank.shardOf(from) != bank.shardOf(to);
+    while (!done.load()) {
+        ok = ok && bank.getTotalBalance() == transfers;
+    }
+    client.join();
+    return ok && bank.sumBalances() == transfers && bank.getBalance(to) == transfers
+           && bank.getShardTransactions(bank.shardOf(from)).size() == 2 + transfers
+           && bank.getShardTransactions(bank.shardOf(to)).size() == 1 + transfers;
+}
+
+// A log replays in full, including a row by a teller ID from before
+// MAX_TELLERS was enforced, and both recover() and restore() rebuild the
+// teller volumes along with the balances. restore() must not read the log
+// below the checkpoint's walOffset, so that part is overwritten first.
+bool testRecovery() {
+    const string logPath = "bank_test.wal";
+    const string checkpointPath = "bank_test.ckpt";
+    unlink(logPath.c_str());
+    unlink(checkpointPath.c_str());
+    unlink((checkpointPath + ".names").c_str());
+    unlink((checkpointPath + ".tellers").c_str());
+
+    BankSystem* original = new BankSystem(vector<BankAccount>(), vector<Transaction*>());
+    WriteAheadLog* log = new WriteAheadLog(logPath, WriteAheadLog::PER_OPERATION, 0);
+    original->attachLog(log);
+    CheckpointStore* store = new CheckpointStore(checkpointPath);
+    int from = original->openAccount("Customer", 1);
+    int to = original->openAccount("Customer", 2);
+    original->deposit(from, 1, 500);
+    original->checkpoint(store, true);
+    original->transfer(from, to, 200, 2);
+    original->withdraw(to, 1, 50);
+    LogRecord legacy;
+    legacy.lsn = 5;
+    legacy.type = DEPOSIT;
+    legacy.customerId = from;
+    legacy.counterpartyId = -1;
+    legacy.tellerId = BankSystem::MAX_TELLERS + 5;
+    legacy.amount = 25;
+    legacy.timestamp = 0;
+    log->waitDurable(log->append(legacy));
+    delete log;
+    delete store;
+    delete original;
+
+    auto matches = [from, to](BankSystem* bankSystem) {
+        return bankSystem->getAccount(from).getBalance() == 325 && bankSystem->getAccount(to).getBalance() == 150
+               && bankSystem->getTotalBalance() == 475 && bankSystem->getTellerOperations(1) == 3
+               && bankSystem->getTellerVolume(1) == 550 && bankSystem->getTellerOperations(2) == 2
+               && bankSystem->getTellerVolume(2) == 200;
+    };
+    bool ok = false;
+    BankSystem* recovered = new BankSystem(vector<BankAccount>(), vector<Transaction*>());
+    try {
+        ok = recovered->recover(logPath) == 6 && matches(recovered);
+    } catch (const char*) {
+    }
+    delete recovered;
+    store = new CheckpointStore(checkpointPath);
+    vector<char> garbage(store->getHeader().walOffset, (char) 0xFF);
+    int fd = open(logPath.c_str(), O_WRONLY);
+    ok = ok && !garbage.empty() && pwrite(fd, garbage.data(), garbage.size(), 0) == (ssize_t) garbage.size();
+    close(fd);
+    BankSystem* restored = new BankSystem(vector<BankAccount>(), vector<Transaction*>());
+    ok = ok && restored->restore(store, logPath) == 3 && matches(restored);
+    delete restored;
+    delete store;
+    unlink(logPath.c_str());
+    unlink(checkpointPath.c_str());
+    unlink((checkpointPath + ".names").c_str());
+    unlink((checkpointPath + ".tellers").c_str());
+    return ok;
+}
+
+// A bank opens accounts up to its capacity and refuses the next one without
+// writing a ledger row for it
+bool testAccountCapacity() {
+    BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>(), 2);
+    bankSystem.openAccount("Customer", 0);
+    bankSystem.openAccount("Customer", 0);
+    try {
+        bankSystem.openAccount("Customer", 0);
+        return false;
+    } catch (const char*) {
+    }
+    return bankSystem.getAccountCount() == 2 && bankSystem.getTransactions().size() == 2;
+}
+
+// Keys claimed just before and long after 2^32 milliseconds of uptime still
+// expire after the time to live, not when the millisecond count wraps
+bool testIdempotencyExpiry() {
+    const long long hour = 3600LL * 1000000;
+    long long start = TransactionLedger::now();
+    IdempotencyTable table(1000, hour);
+    bool ok = true;
+    long long times[] = {(1LL << 32) * 1000 - 1000000, 100 * 24 * hour, 1000 * 24 * hour};
+    for (long long time : times) {
+        IdempotencyKey key = {(uint64_t) time, 7};
+        ok = ok && table.claim(key, start + time);
+        ok = ok && !table.claim(key, start + time + 1000);
+        ok = ok && !table.claim(key, start + time + hour / 2);
+        ok = ok && table.claim(key, start + time + 2 * hour);
+    }
+    return ok;
+}
+
+// Cancelled withdrawals free their ring slots: after one real withdrawal and
+// RING - 1 cancelled ones, the next admit must not evict the real one
+bool testVelocityCancel() {
+    const long long minute = 60 * 1000000LL;
+    VelocityGuard guard({{minute, 2, 1000}}, 2);
+    long long now = TransactionLedger::now();
+    unsigned long long ticket;
+    bool ok = guard.tryAdmit(0, 100, now, ticket);
+    for (int i = 1; i < VelocityGuard::RING; i++) {
+        ok = ok && guard.tryAdmit(0, 100, now + i, ticket);
+        guard.cancel(0, ticket);
+    }
+    ok = ok && guard.tryAdmit(0, 100, now + VelocityGuard::RING, ticket);
+    ok = ok && !guard.tryAdmit(0, 100, now + VelocityGuard::RING + 1, ticket);
+    // Cancelling a withdrawal that was not the newest frees its slot too
+    ok = ok && guard.tryAdmit(1, 100, now, ticket);
+    unsigned long long first = ticket;
+    ok = ok && guard.tryAdmit(1, 100, now + 1, ticket);
+    guard.cancel(1, first);
+    ok = ok && guard.tryAdmit(1, 100, now + 2, ticket) && !guard.tryAdmit(1, 100, now + 3, ticket);
+    // Only accounts within the guard's capacity have rings
+    try {
+        guard.tryAdmit(2, 100, now, ticket);
+        ok = false;
+    } catch (const char*) {
+    }
+    return ok;
+}
+
+// A log whose writes fail (on /dev/full) fails the operations waiting on it
+// in every durability mode, rather than hanging or ending the process
+bool testLogFailure() {
+    bool ok = true;
+    for (WriteAheadLog::DurabilityMode mode : {WriteAheadLog::PER_OPERATION, WriteAheadLog::PER_BATCH}) {
+        BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>());
+        WriteAheadLog log("/dev/full", mode, 0);
+        bankSystem.attachLog(&log);
+        for (int attempt = 0; attempt < 2; attempt++) {
+            try {
+                bankSystem.openAccount("Customer", 0);
+                ok = false;
+            } catch (const char*) {
+            }
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && string(argv[1]) == "test") {
+        string name = argc > 2 ? argv[2] : "";
+        int failures = 0;
+        auto check = [&failures](const char* test, bool ok) {
+            cout << test << ": " << (ok ? "ok" : "FAILED") << endl;
+            failures += ok ? 0 : 1;
+        };
+        if (name == "" || name == "ledger") {
+            check("ledger", testLedgerCapacity());
+        }
+        if (name == "" || name == "rendering") {
+            check("rendering", testRenderWidths());
+        }
+        if (name == "" || name == "transfers") {
+            check("transfers", testTransferAmounts());
+        }
+        if (name == "" || name == "shards") {
+            check("shards", testShardedAmounts());
+        }
+        if (name == "" || name == "sharded-transfers") {
+            check("sharded-transfers", testShardedTransfers());
+        }
+        if (name == "" || name == "recovery") {
+            check("recovery", testRecovery());
+        }
+        if (name == "" || name == "capacity") {
+            check("capacity", testAccountCapacity());
+        }
+        if (name == "" || name == "idempotency") {
+            check("idempotency", testIdempotencyExpiry());
+        }
+        if (name == "" || name == "velocity") {
+            check("velocity", testVelocityCancel());
+        }
+        if (name == "" || name == "wal") {
+            check("wal", testLogFailure());
+        }
+        return failures == 0 ? 0 : 1;
+    }
+    if (argc > 1 && string(argv[1]) == "bench") {
+        string name = argc > 2 ? argv[2] : "";
+        if (name == "" || name == "ledger") {
+            benchmarkLedger();
+        }
+        if (name == "" || name == "rendering") {
+            benchmarkRendering();
+        }
+        if (name == "" || name == "concurrency") {
+            benchmarkConcurrentAccounts();
+        }
+        if (name == "" || name == "wal") {
+            benchmarkWriteAheadLog();
+        }
+        if (name == "" || name == "transfers") {
+            benchmarkTransfers();
+        }
+        if (name == "" || name == "batch") {
+            benchmarkBatchPosting();
+        }
+        if (name == "" || name == "collection") {
+            benchmarkCashCollection();
+        }
+        if (name == "" || name == "scans") {
+            benchmarkAccountScans();
+        }
+        if (name == "" || name == "jobs") {
+            benchmarkBatchJobs();
+        }
+        if (name == "" || name == "velocity") {
+            benchmarkVelocity();
+        }
+        if (name == "" || name == "archive") {
+            benchmarkArchive();
+        }
+        if (name == "" || name == "idempotency") {
+            benchmarkIdempotency();
+        }
+        if (name == "" || name == "aggregates") {
+            benchmarkAggregates();
+        }
+        if (name == "" || name == "rebalancing") {
+            benchmarkRebalancing();
+        }
+        if (name == "" || name == "checkpoint") {
+            benchmarkCheckpoint();
+        }
+        if (name == "" || name == "history") {
+            benchmarkHistory();
+        }
+        if (name == "" || name == "tellers") {
+            benchmarkTellerPolicies();
+        }
+        if (name == "" || name == "shards") {
+            benchmarkShards();
+        }
+        return 0;
+    }
+
+    BankSystem bankSystem = BankSystem(vector<BankAccount>(), vector<Transaction*>());
+    Bank bank = Bank(vector<BankBranch*>(), &bankSystem, 10000);
+
+    string address = "123 Main St";
+    string address2 = "456 Elm St";
+
+    BankBranch* branch1 = bank.addBranch(address, 1000);
+    BankBranch* branch2 = bank.addBranch(address2, 1000);
+
+    branch1->addTeller(BankTeller(1));
+    branch1->addTeller(BankTeller(2));
+    branch2->addTeller(BankTeller(3));
+    branch2->addTeller(BankTeller(4));
+
+    string name1 = "John Doe";
+    string name2 = "Bob Smith";
+    string name3 = "Jane Doe";
+
+    int customerId1 = branch1->openAccount(name1);
+    int customerId2 = branch1->openAccount(name2);
+    int customerId3 = branch2->openAccount(name3);
+
+    branch1->deposit(customerId1, 100);
+    branch1->deposit(customerId2, 200);
+    branch2->deposit(customerId3, 300);
+
+    branch1->withdraw(customerId1, 50);
+    branch1->transfer(customerId2, customerId3, 75);
+
+    bank.printTransactions();
+    /*  Possible Output:
+        Teller 1 opened account 0
+        Teller 2 opened account 1
+        Teller 3 opened account 2
+        Teller 1 deposited 100 to account 0
         Teller 2 deposited 200 to account 1
         Teller 4 deposited 300 to account 2
         Teller 2 withdrew 50 from account 0
+        Teller 1 transferred 75 from account 1 to account 2
+    */
+
+    bank.printStatement(customerId3);
+    /*  Possible Output:
+        Teller 1 transferred 75 from account 1 to account 2
+        Teller 4 deposited 300 to account 2
+        Teller 3 opened account 2
     */
 
     bank.collectCash(0.5);